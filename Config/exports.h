@@ -8,23 +8,37 @@
 #define UNFS3_EXPORTS_H
 
 #include "../mount.h" /* exports type */
+#include "../worker.h" /* UNFS3_TLS */
 
 #define OPT_NO_ROOT_SQUASH	1
 #define OPT_ALL_SQUASH		2
 #define OPT_RW			4
 #define OPT_REMOVABLE		8
 #define OPT_INSECURE		16
+#define OPT_WDELAY		32
+#define OPT_ASYNC		64
 
 #define PASSWORD_MAXLEN   64
 
 #define ANON_NOTSPECIAL 0xffffffff
 
+/* scheduling weight and rate limits of an export entry, 0 means none */
+typedef struct {
+        uint32		key;		/* identifies the entry */
+        uint32		weight;
+        uint32		iops;
+        uint32		client_iops;
+        uint64		bandwidth;	/* bytes per second */
+        uint64		client_bandwidth;
+} e_limits;
+
 extern exports	exports_nfslist;
 /* Options cache */
-extern int	exports_opts;
-extern const char *export_path;
-extern uint32 	export_fsid;
-extern uint32   export_password_hash;
+extern UNFS3_TLS int	exports_opts;
+extern UNFS3_TLS const char *export_path;
+extern UNFS3_TLS uint32 	export_fsid;
+extern UNFS3_TLS uint32   export_password_hash;
+extern UNFS3_TLS e_limits export_limits;
 
 extern unsigned char password[PASSWORD_MAXLEN+1];
 
@@ -32,6 +46,7 @@ int		exports_parse(void);
 int		exports_options(const char *path, struct svc_req *rqstp, char **password, uint32 *fsid);
 int             export_point(const char *path);
 char            *export_point_from_fsid(uint32 fsid);
+char            *export_point_from_dev(uint32 dev);
 nfsstat3	exports_compat(const char *path, struct svc_req *rqstp);
 nfsstat3	exports_rw(void);
 uint32		exports_anonuid(void);
@@ -11,6 +11,8 @@
 #endif
 
 #include <assert.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <limits.h>
 
@@ -26,12 +28,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 #include "nfs.h"
 #include "mount.h"
 #include "daemon.h"
 #include "backend.h"
 #include "exports.h"
+#include "fh.h"
 
 #ifndef PATH_MAX
 # define PATH_MAX	4096
@@ -61,6 +65,7 @@ typedef struct {
         unsigned		prefix;
         uint32			anonuid;
         uint32			anongid;
+        e_limits		limits;
         struct e_host		*next;
 } e_host;
 
@@ -78,8 +83,8 @@ static e_item cur_item;
 static e_host cur_host;
 
 /* last looked-up anonuid and anongid */
-static uint32 last_anonuid = ANON_NOTSPECIAL;
-static uint32 last_anongid = ANON_NOTSPECIAL;
+static UNFS3_TLS uint32 last_anonuid = ANON_NOTSPECIAL;
+static UNFS3_TLS uint32 last_anongid = ANON_NOTSPECIAL;
 
 /* mount protocol compatible variants */
 static exports ne_list = NULL;
@@ -291,6 +296,14 @@ static void add_item(const char *path)
         if (!cur_item.hosts)
                 add_host();
 
+        /* rate limits of an entry survive reloading the exports file */
+        host = cur_item.hosts;
+        while (host) {
+                host->limits.key = fnv1a_32_update(host->orig,
+                                                   fnv1a_32(path));
+                host = (e_host *) host->next;
+        }
+
         *new = cur_item;
         strcpy(new->path, buf);
         strcpy(new->orig, path);
@@ -502,11 +515,60 @@ static void add_option(const char *opt)
                 cur_host.options |= OPT_INSECURE;
         else if (strcmp(opt,"secure") == 0)
                 cur_host.options &= ~OPT_INSECURE;
+        else if (strcmp(opt,"wdelay") == 0)
+                cur_host.options |= OPT_WDELAY;
+        else if (strcmp(opt,"no_wdelay") == 0)
+                cur_host.options &= ~OPT_WDELAY;
+        else if (strcmp(opt,"async") == 0)
+                cur_host.options |= OPT_ASYNC;
+        else if (strcmp(opt,"sync") == 0)
+                cur_host.options &= ~OPT_ASYNC;
         else
                 logmsg(LOG_WARNING, "Warning: Unknown exports option `%s' ignored",
                         opt);
 }
 
+/*
+ * parse a rate of at most max, followed by k, m, or g if suffix is set
+ * returns 0, which means no limit, if the value is invalid
+ */
+static uint64 parse_rate(const char *opt, const char *val, int suffix,
+                         uint64 max)
+{
+        char *end;
+        uint64 rate, unit = 1;
+
+        errno = 0;
+        rate = strtoull(val, &end, 10);
+        if (suffix)
+                switch (*end) {
+                        case 'k':
+                        case 'K':
+                                unit = 1024;
+                                end++;
+                                break;
+                        case 'm':
+                        case 'M':
+                                unit = 1024 * 1024;
+                                end++;
+                                break;
+                        case 'g':
+                        case 'G':
+                                unit = 1024 * 1024 * 1024;
+                                end++;
+                                break;
+                }
+
+        /* strtoull() would take a sign */
+        if (*val < '0' || *val > '9' || *end || errno == ERANGE ||
+            rate > max / unit) {
+                logmsg(LOG_WARNING, "Warning: Invalid value `%s' for exports option `%s' ignored",
+                       val, opt);
+                return 0;
+        }
+        return rate * unit;
+}
+
 static void add_option_with_value(const char *opt, const char *val)
 {
     if (strcmp(opt,"password") == 0) {
@@ -522,6 +584,18 @@ static void add_option_with_value(const char *opt, const char *val)
         cur_host.anonuid = atoi(val);
     } else if (strcmp(opt,"anongid") == 0) {
         cur_host.anongid = atoi(val);
+    } else if (strcmp(opt,"weight") == 0) {
+        cur_host.limits.weight = parse_rate(opt, val, FALSE, 0xffffffff);
+        if (cur_host.limits.weight > 100)
+            cur_host.limits.weight = 100;
+    } else if (strcmp(opt,"iops") == 0) {
+        cur_host.limits.iops = parse_rate(opt, val, FALSE, 0xffffffff);
+    } else if (strcmp(opt,"client_iops") == 0) {
+        cur_host.limits.client_iops = parse_rate(opt, val, FALSE, 0xffffffff);
+    } else if (strcmp(opt,"bandwidth") == 0) {
+        cur_host.limits.bandwidth = parse_rate(opt, val, TRUE, ~0ULL);
+    } else if (strcmp(opt,"client_bandwidth") == 0) {
+        cur_host.limits.client_bandwidth = parse_rate(opt, val, TRUE, ~0ULL);
     } else {
         logmsg(LOG_WARNING, "Warning: Unknown exports option `%s' ignored",
             opt);
@@ -606,9 +680,8 @@ opt:
  * C code using yacc parser + access code for exports list
  */
 
-/* effective export list and access flag */
+/* effective export list, only reloaded while no request is served */
 static e_item *export_list = NULL;
-static volatile int exports_access = FALSE;
 
 /* mount protocol compatible exports list */
 exports exports_nfslist = NULL;
@@ -720,15 +793,6 @@ int exports_parse(void)
 {
         FILE *efile;
 
-        /*
-         * if we are in the SIGHUP handler, a may_mount or get_options
-         * may currently be accessing the list
-         */
-        if (exports_access) {
-                logmsg(LOG_CRIT, "Export list is being traversed, no reload\n");
-                return FALSE;
-        }
-
         efile = fopen(opt_exports, "r");
         if (!efile) {
                 logmsg(LOG_CRIT, "Could not open '%s', exporting nothing",
@@ -763,6 +827,9 @@ int exports_parse(void)
         free_nfslist(exports_nfslist);
         export_list = e_list;
         exports_nfslist = ne_list;
+
+        /* kernel filehandles are opened through the export points */
+        fh_kernel_exports(exports_nfslist);
         return TRUE;
 }
 
@@ -822,11 +889,12 @@ static e_host* find_host(const struct in6_addr *remote, e_item *item,
         return NULL;
 }
 
-/* options cache */
-int exports_opts = -1;
-const char *export_path = NULL; 
-uint32 export_fsid = 0;
-uint32 export_password_hash = 0;
+/* options cache, per request */
+UNFS3_TLS int exports_opts = -1;
+UNFS3_TLS const char *export_path = NULL; 
+UNFS3_TLS uint32 export_fsid = 0;
+UNFS3_TLS uint32 export_password_hash = 0;
+UNFS3_TLS e_limits export_limits;
 
 /*
  * given a path, return client's effective options
@@ -841,6 +909,7 @@ int exports_options(const char *path, struct svc_req *rqstp,
         exports_opts = -1;
         export_path = NULL;
         export_fsid = 0;
+        memset(&export_limits, 0, sizeof(e_limits));
         last_anonuid = ANON_NOTSPECIAL;
         last_anongid = ANON_NOTSPECIAL;
 
@@ -851,9 +920,6 @@ int exports_options(const char *path, struct svc_req *rqstp,
         if (get_remote(rqstp, &remote))
                 return exports_opts;
 
-        /* protect against SIGHUP reloading the list */
-        exports_access = TRUE;
-
         list = export_list;
         while (list) {
                 /* longest matching prefix wins */
@@ -874,11 +940,11 @@ int exports_options(const char *path, struct svc_req *rqstp,
                                 last_len = strlen(list->path);
                                 last_anonuid = cur_host->anonuid;
                                 last_anongid = cur_host->anongid;
+                                export_limits = cur_host->limits;
                         }
                 }
                 list = (e_item *) list->next;
         }
-        exports_access = FALSE;
         return exports_opts;
 }
 
@@ -889,17 +955,14 @@ int export_point(const char *path)
 {
         e_item *list;
 
-        exports_access = TRUE;
         list = export_list;
 
         while (list) {
             if (strcmp(path, list->path) == 0) {
-                exports_access = FALSE;
                 return TRUE;
             }
             list = (e_item *) list->next;
         }
-        exports_access = FALSE;
         return FALSE;
 }
 
@@ -910,21 +973,38 @@ char *export_point_from_fsid(uint32 fsid)
 {
     e_item *list;
     
-    exports_access = TRUE;
     list = export_list;
     
     while (list) {
         if (list->fsid == fsid) {
-            exports_access = FALSE;
             return list->path;
         }
         list = (e_item *) list->next;
     }
-    exports_access = FALSE;
     return NULL;
 }
 
 
+/*
+ * return an exported path on a given device
+ */
+char *export_point_from_dev(uint32 dev)
+{
+    e_item *list;
+    backend_statstruct buf;
+
+    list = export_list;
+
+    while (list) {
+        if (backend_stat(list->path, &buf) != -1 &&
+            (uint32) buf.st_dev == dev) {
+            return list->path;
+        }
+        list = (e_item *) list->next;
+    }
+    return NULL;
+}
+
 /*
  * check whether export options of a path match with last set of options
  */
@@ -27,6 +27,7 @@
 #include "../nfs.h"
 #include "../daemon.h"
 #include "../backend.h"
+#include "../user.h"
 #include "cluster.h"
 
 /* array of dirents prefixed with master file name */
@@ -183,17 +184,6 @@ int compar(const void *x, const void *y)
     return strcmp(*(const char **) x, *(const char **) y);
 }
 
-/*
- * reset euid/egid to specific values
- */
-static void reset_ids(uid_t euid, gid_t egid)
-{
-    if (backend_setegid(egid) || backend_seteuid(euid)) {
-        logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
-        daemon_exit(CRISIS);
-    }
-}
-
 /*
  * scan directory for filenames beginning with master name as prefix
  */
@@ -211,15 +201,14 @@ void cluster_scandir(const char *path)
     /*
      * need to read directory as root, temporarily switch back
      */
-    euid = backend_geteuid();
-    egid = backend_getegid();
-    backend_setegid(0);
-    backend_seteuid(0);
+    euid = get_euid();
+    egid = get_egid();
+    switch_to_root();
 
     scan = backend_opendir(cluster_dirname(path));
     if (!scan) {
         cluster_count = -1;
-        reset_ids(euid, egid);
+        switch_ids(euid, egid);
         return;
     }
 
@@ -240,7 +229,7 @@ void cluster_scandir(const char *path)
             free(new);
             free(name);
             backend_closedir(scan);
-            reset_ids(euid, egid);
+            switch_ids(euid, egid);
             return;
         }
 
@@ -251,7 +240,7 @@ void cluster_scandir(const char *path)
     }
 
     backend_closedir(scan);
-    reset_ids(euid, egid);
+    switch_ids(euid, egid);
 
     /* list needs to be sorted for cluster_lookup_lowlevel to work */
     qsort(cluster_dirents, cluster_count, sizeof(char *), compar);
@@ -0,0 +1,352 @@
+
+/*
+ * UNFS3 asynchronous file I/O
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_EVENTFD_H) && \
+    defined(HAVE_SYS_SYSCALL_H)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "aio.h"
+
+/*
+ * intention of the asynchronous I/O engine
+ *
+ * READ, WRITE and COMMIT can hand their file operation to an io_uring
+ * instead of calling pread(), pwrite() or fsync() themselves. The
+ * request handler then returns without a reply, and the request is
+ * finished once the completion arrives in the main loop. This way a single
+ * thread keeps up to opt_aio_depth operations in flight.
+ *
+ * a handler claims ring slots with aio_reserve() before it commits to
+ * the asynchronous path, so the rings can never overflow. Queued ops
+ * are only submitted by aio_flush(), after the RPC library is done with
+ * the transport, so a completion never races with the request that
+ * started it.
+ *
+ * the ring is driven with plain system calls, no helper library is
+ * needed.
+ */
+
+/* maximum number of operations in flight, 0 means synchronous I/O */
+int opt_aio_depth = 0;
+
+#ifdef UNFS3_URING
+
+static int ring_fd = -1;
+static int event_fd = -1;
+
+/* submission queue, filled by any thread */
+static pthread_mutex_t sq_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned *sq_tail, *sq_mask, *sq_array;
+static struct io_uring_sqe *sqes;
+
+/* completion queue, only consumed by the main loop */
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+/* ring slots claimed by requests, protected by sq_mutex */
+static int inflight = 0;
+
+/* ops queued by this thread, waiting for aio_flush() */
+static UNFS3_TLS aio_op *pending_first = NULL;
+static UNFS3_TLS aio_op *pending_last = NULL;
+
+/*
+ * set up the ring
+ * returns an fd that becomes readable when completions are available
+ */
+int aio_init(void)
+{
+    struct io_uring_params p;
+    size_t sq_len, cq_len;
+    char *sq, *cq;
+
+    if (opt_aio_depth == 0)
+        return -1;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, opt_aio_depth, &p);
+    if (ring_fd == -1) {
+        logmsg(LOG_WARNING, "io_uring not available, using synchronous I/O");
+        return -1;
+    }
+
+    sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_len > sq_len)
+        sq_len = cq_len;
+
+    sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else {
+        cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            goto fail;
+    }
+
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+
+    sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *) (sq + p.sq_off.array);
+    cq_head = (unsigned *) (cq + p.cq_off.head);
+    cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1)
+        goto fail;
+
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_EVENTFD,
+                &event_fd, 1) == -1) {
+        close(event_fd);
+        event_fd = -1;
+        goto fail;
+    }
+
+    return event_fd;
+
+  fail:
+    /* mappings go away with the ring fd */
+    logmsg(LOG_WARNING, "Unable to set up io_uring, using synchronous I/O");
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+/*
+ * check whether file I/O goes through the ring
+ */
+int aio_active(void)
+{
+    return ring_fd != -1;
+}
+
+/*
+ * claim ring slots for ops that will be queued
+ * returns FALSE if the caller has to do its I/O synchronously
+ */
+int aio_reserve(int ops)
+{
+    int res = FALSE;
+
+    if (ring_fd == -1)
+        return FALSE;
+
+    pthread_mutex_lock(&sq_mutex);
+    if (inflight + ops <= opt_aio_depth) {
+        inflight += ops;
+        res = TRUE;
+    }
+    pthread_mutex_unlock(&sq_mutex);
+
+    return res;
+}
+
+/*
+ * give back ring slots
+ */
+void aio_release(int ops)
+{
+    pthread_mutex_lock(&sq_mutex);
+    inflight -= ops;
+    pthread_mutex_unlock(&sq_mutex);
+}
+
+/*
+ * queue an op for submission, its slot must have been reserved
+ */
+void aio_queue(aio_op * op)
+{
+    op->next = NULL;
+    if (pending_last)
+        pending_last->next = op;
+    else
+        pending_first = op;
+    pending_last = op;
+}
+
+/*
+ * submit the ops queued by this thread
+ */
+void aio_flush(void)
+{
+    struct io_uring_sqe *sqe;
+    aio_op *op, *first, *next;
+    unsigned tail, idx;
+    int count = 0, res, err = 0;
+
+    if (!pending_first)
+        return;
+
+    pthread_mutex_lock(&sq_mutex);
+
+    tail = *sq_tail;
+    for (op = pending_first; op; op = op->next) {
+        idx = tail & *sq_mask;
+        sqe = &sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+
+        if (op->opcode == AIO_FSYNC)
+            sqe->opcode = IORING_OP_FSYNC;
+        else if (op->opcode == AIO_FDATASYNC) {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else {
+            sqe->opcode = (op->opcode == AIO_READ) ?
+                IORING_OP_READV : IORING_OP_WRITEV;
+            sqe->addr = (unsigned long) &op->iov;
+            sqe->len = 1;
+            sqe->off = op->offset;
+        }
+        sqe->fd = op->fd;
+        if (op->link)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = (unsigned long) op;
+
+        sq_array[idx] = idx;
+        tail++;
+        count++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    first = pending_first;
+    pending_first = pending_last = NULL;
+
+    while (count > 0) {
+        res = syscall(__NR_io_uring_enter, ring_fd, count, 0, 0, NULL, 0);
+        if (res == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            err = errno;
+            logmsg(LOG_CRIT, "Unable to submit I/O to io_uring: %s",
+                   strerror(err));
+
+            /* the kernel did not consume the last count entries, take
+               them off the ring again */
+            __atomic_store_n(sq_tail, tail - count, __ATOMIC_RELEASE);
+            break;
+        }
+        count -= res;
+    }
+
+    pthread_mutex_unlock(&sq_mutex);
+
+    if (count == 0)
+        return;
+
+    /* fail the ops that were not submitted, so that their requests are
+       answered and their slots are given back */
+    for (op = first, res = 0; op; op = op->next)
+        res++;
+    for (op = first; res > count; op = op->next)
+        res--;
+    for (; op; op = next) {
+        next = op->next;
+        aio_release(1);
+        op->done(op, -err);
+    }
+}
+
+/*
+ * handle all available completions, called by the main loop
+ */
+void aio_complete(void)
+{
+    struct io_uring_cqe *cqe;
+    uint64_t events;
+    unsigned head, tail;
+    aio_op *op;
+    int res;
+
+    if (read(event_fd, &events, sizeof(events)) == -1 && errno != EAGAIN)
+        logmsg(LOG_WARNING, "Unable to read io_uring event counter");
+
+    head = *cq_head;
+    for (;;) {
+        tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail)
+            break;
+
+        cqe = &cqes[head & *cq_mask];
+        op = (aio_op *) (unsigned long) cqe->user_data;
+        res = cqe->res;
+
+        head++;
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+        aio_release(1);
+        op->done(op, res);
+    }
+
+    /* submit ops started by completion handlers */
+    aio_flush();
+}
+
+#else				       /* UNFS3_URING */
+
+int aio_init(void)
+{
+    return -1;
+}
+
+int aio_active(void)
+{
+    return FALSE;
+}
+
+int aio_reserve(U(int ops))
+{
+    return FALSE;
+}
+
+void aio_release(U(int ops))
+{
+}
+
+void aio_queue(U(aio_op * op))
+{
+}
+
+void aio_flush(void)
+{
+}
+
+void aio_complete(void)
+{
+}
+
+#endif				       /* UNFS3_URING */
@@ -0,0 +1,54 @@
+/*
+ * UNFS3 asynchronous file I/O
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_AIO_H
+#define UNFS3_AIO_H
+
+#include <sys/uio.h>
+
+#include "worker.h"
+
+#if defined(UNFS3_THREADS) && defined(HAVE_LINUX_IO_URING_H) && \
+    defined(HAVE_SYS_EVENTFD_H) && defined(HAVE_SYS_SYSCALL_H)
+#define UNFS3_URING 1
+#endif
+
+/* operations */
+#define AIO_READ	0
+#define AIO_WRITE	1
+#define AIO_FSYNC	2
+#define AIO_FDATASYNC	3
+
+/* upper limit for -q */
+#define AIO_DEPTH_MAX	4096
+
+/*
+ * one file operation, usually embedded in a larger request context
+ *
+ * done is called from the main loop with the result of the system call,
+ * or a negated errno value
+ */
+typedef struct aio_op {
+    int opcode;
+    int fd;
+    struct iovec iov;
+    off64_t offset;
+    int link;			/* next op waits for this one */
+    void (*done) (struct aio_op * op, int res);
+    void *arg;			/* for use by done */
+    struct aio_op *next;
+} aio_op;
+
+extern int opt_aio_depth;
+
+int aio_init(void);
+int aio_active(void);
+int aio_reserve(int ops);
+void aio_release(int ops);
+void aio_queue(aio_op * op);
+void aio_flush(void);
+void aio_complete(void);
+
+#endif
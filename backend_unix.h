@@ -80,6 +80,12 @@
 #define backend_lchown chown
 #endif
 
+#if HAVE_FDATASYNC == 1
+#define backend_fdatasync fdatasync
+#else
+#define backend_fdatasync fsync
+#endif
+
 #ifdef AFS_SUPPORT
 #  undef  backend_get_gen
 #  define backend_get_gen	afs_get_gen
@@ -31,6 +31,7 @@
 #define backend_fchmod win_fchmod
 #define backend_fchown win_fchown
 #define backend_fstat win_fstat
+#define backend_fdatasync _commit
 #define backend_fsync _commit
 #define backend_ftruncate chsize
 #define backend_getegid() 0
@@ -0,0 +1,205 @@
+
+/*
+ * UNFS3 group commit
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "backend.h"
+#include "worker.h"
+#include "commit.h"
+
+/*
+ * intention of the group commit
+ *
+ * stable WRITEs and COMMITs end in an fsync() each. When many clients
+ * write to the same file at once, their syncs queue up behind each
+ * other on the inode, and each of them flushes what the ones before it
+ * already made stable.
+ *
+ * with worker threads, the syncs of a file are done one group at a
+ * time instead. A request that needs a sync while one is running on
+ * the same file joins the next group, and whoever started that group
+ * syncs for all its members once the running one is done, with fsync()
+ * if any member needs the metadata as well, and with fdatasync()
+ * otherwise. Syncs of different files are left to run in parallel, so
+ * that the filesystem can batch them in its journal.
+ *
+ * requests only ever wait for the sync that is running when they
+ * arrive, so there is no delay when requests do not overlap.
+ */
+
+/* statistics */
+int commit_requests = 0;
+int commit_syncs = 0;
+
+#ifdef UNFS3_GROUP_COMMIT
+
+/* a request waiting for its file to be synced */
+typedef struct commit_member {
+    int datasync;		/* only data needs to be stable */
+    int res;			/* result of the sync, errno in err */
+    int err;
+    int done;
+    struct commit_member *next;
+} commit_member;
+
+/* the syncs of one file, while there are any */
+typedef struct commit_stage {
+    dev_t dev;
+    ino_t ino;
+    int running;		/* a group is being synced */
+    commit_member *next_group;	/* members of the group to sync next */
+    struct commit_stage *next;
+} commit_stage;
+
+static pthread_mutex_t commit_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+
+/* at most one per worker thread */
+static commit_stage *stages = NULL;
+
+/*
+ * sync one file
+ */
+static int commit_one(int fd, int datasync)
+{
+    return datasync ? backend_fdatasync(fd) : backend_fsync(fd);
+}
+
+/*
+ * find the stage of a file, or start one
+ * called with commit_mutex held
+ */
+static commit_stage *commit_stage_get(dev_t dev, ino_t ino)
+{
+    commit_stage *s;
+
+    for (s = stages; s; s = s->next)
+        if (s->dev == dev && s->ino == ino)
+            return s;
+
+    s = malloc(sizeof(commit_stage));
+    if (s) {
+        s->dev = dev;
+        s->ino = ino;
+        s->running = FALSE;
+        s->next_group = NULL;
+        s->next = stages;
+        stages = s;
+    }
+    return s;
+}
+
+/*
+ * drop the stage of a file once nobody waits for it
+ * called with commit_mutex held
+ */
+static void commit_stage_put(commit_stage * s)
+{
+    commit_stage **p;
+
+    if (s->running || s->next_group)
+        return;
+
+    for (p = &stages; *p != s; p = &(*p)->next);
+    *p = s->next;
+    free(s);
+}
+
+/*
+ * make the data written to fd so far stable, together with that of
+ * concurrent requests on the same file
+ */
+int commit_group(int fd, int datasync)
+{
+    backend_statstruct buf;
+    commit_stage *s;
+    commit_member self, *m, *group;
+    int res, err;
+
+    if (!worker_active()) {
+        commit_requests++;
+        commit_syncs++;
+        return commit_one(fd, datasync);
+    }
+    if (backend_fstat(fd, &buf) == -1)
+        return commit_one(fd, datasync);
+
+    self.datasync = datasync;
+    self.done = FALSE;
+
+    pthread_mutex_lock(&commit_mutex);
+    commit_requests++;
+
+    s = commit_stage_get(buf.st_dev, buf.st_ino);
+    if (!s) {
+        pthread_mutex_unlock(&commit_mutex);
+        return commit_one(fd, datasync);
+    }
+
+    /* the first member of a group syncs it */
+    self.next = s->next_group;
+    s->next_group = &self;
+
+    if (self.next) {
+        while (!self.done)
+            pthread_cond_wait(&commit_cond, &commit_mutex);
+        pthread_mutex_unlock(&commit_mutex);
+        errno = self.err;
+        return self.res;
+    }
+
+    while (s->running)
+        pthread_cond_wait(&commit_cond, &commit_mutex);
+
+    /* later requests form the next group */
+    group = s->next_group;
+    s->next_group = NULL;
+    s->running = TRUE;
+    pthread_mutex_unlock(&commit_mutex);
+
+    for (m = group; m; m = m->next)
+        if (!m->datasync)
+            datasync = FALSE;
+    res = commit_one(fd, datasync);
+    err = errno;
+
+    pthread_mutex_lock(&commit_mutex);
+    commit_syncs++;
+    s->running = FALSE;
+    for (m = group; m; m = m->next) {
+        m->res = res;
+        m->err = err;
+        m->done = TRUE;
+    }
+    commit_stage_put(s);
+    pthread_cond_broadcast(&commit_cond);
+    pthread_mutex_unlock(&commit_mutex);
+
+    errno = err;
+    return res;
+}
+
+#else				       /* UNFS3_GROUP_COMMIT */
+
+int commit_group(int fd, int datasync)
+{
+    commit_requests++;
+    commit_syncs++;
+    return datasync ? backend_fdatasync(fd) : backend_fsync(fd);
+}
+
+#endif				       /* UNFS3_GROUP_COMMIT */
@@ -0,0 +1,21 @@
+/*
+ * UNFS3 group commit
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_COMMIT_H
+#define UNFS3_COMMIT_H
+
+#include "worker.h"
+
+#ifdef UNFS3_THREADS
+#define UNFS3_GROUP_COMMIT 1
+#endif
+
+/* statistics */
+extern int commit_requests;
+extern int commit_syncs;
+
+int commit_group(int fd, int datasync);
+
+#endif
@@ -0,0 +1,1102 @@
+
+/*
+ * UNFS3 TCP connection transport
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "worker.h"
+#include "aio.h"
+#include "scheduler.h"
+#include "conn.h"
+#include "drc.h"
+
+/*
+ * intention of the connection transport
+ *
+ * libtirpc reads one record from a connection, runs it and sends the
+ * reply before it looks at the next one, so a slow READ holds up every
+ * request queued behind it. Here, the main loop accepts connections
+ * itself, splits the incoming byte stream into records and hands each
+ * record to a worker, or runs it directly without workers. Requests of
+ * one connection thus run concurrently, and each reply is sent as soon
+ * as it is ready, tagged with the XID of its call.
+ *
+ * every request gets its own SVCXPRT, whose ops decode the arguments
+ * from the record and encode the reply, so the protocol dispatchers work
+ * unchanged. A request may also keep its SVCXPRT beyond the dispatcher
+ * and reply later, see conn_defer().
+ *
+ * a connection is reference counted by its requests, so that its fd is
+ * not closed and reused while a reply may still be sent on it. At most
+ * CONN_MAX_REQS requests per connection are in progress, beyond that
+ * the connection is not read until some of them are done.
+ *
+ * only one request at a time sends on a connection. Replies finished
+ * meanwhile are queued and sent by that request, so a client that does
+ * not read its replies ties up one thread instead of all of them. A
+ * queued reply still counts as a request in progress.
+ */
+
+#ifdef UNFS3_CONN
+
+/* initial size of the receive buffer */
+#define CONN_BUF_SIZE	65536
+
+/* seconds to wait for a client to accept more reply data */
+#define CONN_SEND_TIMEOUT 35
+
+/* a reply waiting for the request that is sending on its connection */
+typedef struct conn_out {
+    char *buf;
+    size_t len;
+    struct conn_out *next;
+} conn_out;
+
+typedef struct conn {
+    int fd;
+    struct sockaddr_storage addr;	/* address of the client */
+    socklen_t addrlen;
+    sched_client *client;	/* for the request scheduler */
+
+    /* received data that does not form a complete record yet,
+       only touched by the main loop */
+    char *buf;
+    size_t len;
+    size_t size;
+
+    /* serializes replies */
+    pthread_mutex_t send_mutex;
+
+    /* protected by conn_mutex */
+    int refs;			/* the connection itself and its requests */
+    int reqs;			/* requests in progress */
+    int throttled;		/* not read because of too many requests */
+    int resume;			/* queued for conn_resume() */
+    int closed;			/* no longer read, replies are dropped */
+    int broken;			/* sending failed */
+    int sending;		/* a request is sending replies */
+    conn_out *out_first;	/* replies queued for it */
+    conn_out *out_last;
+    struct conn *next;		/* in resume list */
+} conn;
+
+/* a request received on a connection */
+typedef struct {
+    conn_call call;
+    sched_job job;
+    conn *c;
+} conn_req;
+
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* connections to read again, protected by conn_mutex */
+static conn *resume_list = NULL;
+static int resume_fd = -1;
+
+/* connections by fd, only used by the main loop */
+static conn **conns = NULL;
+static int conns_size = 0;
+
+static int conn_epoll_fd = -1;
+static void (*conn_dispatch) (struct svc_req *, SVCXPRT *) = NULL;
+
+static bool_t conn_xp_reply(SVCXPRT *, struct rpc_msg *);
+
+/* transport ops of requests on connections */
+static struct xp_ops conn_ops;
+
+/*
+ * set up the transport
+ * returns an fd the main loop has to watch for conn_resume()
+ */
+int conn_init(int epoll_fd, void (*dispatch) (struct svc_req *, SVCXPRT *))
+{
+    conn_epoll_fd = epoll_fd;
+    conn_dispatch = dispatch;
+    conn_call_ops(&conn_ops, conn_xp_reply);
+
+    resume_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return resume_fd;
+}
+
+/*
+ * set the events the main loop waits for on a connection
+ */
+static void conn_watch(conn * c, int op, int read)
+{
+    struct epoll_event ev;
+
+    ev.events = read ? EPOLLIN : 0;
+    ev.data.fd = c->fd;
+    epoll_ctl(conn_epoll_fd, op, c->fd, &ev);
+}
+
+/*
+ * drop a reference to a connection
+ * req says whether a finished request held it
+ */
+static void conn_release(conn * c, int req)
+{
+    uint64_t one = 1;
+    int last;
+
+    pthread_mutex_lock(&conn_mutex);
+    if (req)
+        c->reqs--;
+    c->refs--;
+    last = (c->refs == 0);
+
+    /* let the main loop read again */
+    if (!last && c->throttled && !c->resume && !c->closed &&
+        c->reqs < CONN_MAX_REQS) {
+        c->resume = TRUE;
+        c->refs++;
+        c->next = resume_list;
+        resume_list = c;
+        if (write(resume_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            logmsg(LOG_WARNING, "Unable to wake up main loop");
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    if (last) {
+        sched_client_put(c->client);
+        close(c->fd);
+        pthread_mutex_destroy(&c->send_mutex);
+        free(c->buf);
+        free(c);
+    }
+}
+
+/*
+ * stop serving a connection, called by the main loop
+ */
+static void conn_close(conn * c)
+{
+    epoll_ctl(conn_epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    conns[c->fd] = NULL;
+
+    pthread_mutex_lock(&conn_mutex);
+    c->closed = TRUE;
+    pthread_mutex_unlock(&conn_mutex);
+
+    conn_release(c, FALSE);
+}
+
+/*
+ * accept a new connection on a listening socket
+ */
+void conn_accept(int listen_fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    struct timespec ts;
+    const int on = 1;
+    conn **p;
+    conn *c;
+    int fd, size;
+
+    fd = accept4(listen_fd, (struct sockaddr *) &addr, &addrlen,
+                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+        /* give the client a chance to go away instead of spinning */
+        if (errno == EMFILE || errno == ENFILE) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = 50000000;
+            nanosleep(&ts, NULL);
+        }
+        return;
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *) &on, sizeof(on));
+
+    if (fd >= conns_size) {
+        size = conns_size ? conns_size : 64;
+        while (size <= fd)
+            size *= 2;
+        p = realloc(conns, sizeof(conn *) * size);
+        if (!p) {
+            close(fd);
+            return;
+        }
+        memset(p + conns_size, 0, sizeof(conn *) * (size - conns_size));
+        conns = p;
+        conns_size = size;
+    }
+
+    c = calloc(1, sizeof(conn));
+    if (c)
+        c->buf = malloc(CONN_BUF_SIZE);
+    if (!c || !c->buf) {
+        logmsg(LOG_WARNING, "Out of memory, dropping connection");
+        free(c);
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    memcpy(&c->addr, &addr, addrlen);
+    c->addrlen = addrlen;
+    c->size = CONN_BUF_SIZE;
+    c->refs = 1;
+    c->client = sched_client_get((struct sockaddr *) &addr);
+    pthread_mutex_init(&c->send_mutex, NULL);
+
+    conns[fd] = c;
+    conn_watch(c, EPOLL_CTL_ADD, TRUE);
+}
+
+/*
+ * calls received by the server's own transports
+ *
+ * the following is shared with the batched UDP transport: it sets up
+ * the SVCXPRT of a call, decodes the call and its credentials and hands
+ * it to the dispatcher, and encodes the reply with the XID of the call.
+ */
+
+static bool_t call_xp_recv(U(SVCXPRT * xprt), U(struct rpc_msg *msg))
+{
+    return FALSE;
+}
+
+static enum xprt_stat call_xp_stat(U(SVCXPRT * xprt))
+{
+    return XPRT_IDLE;
+}
+
+static bool_t call_xp_getargs(SVCXPRT * xprt, xdrproc_t xdr_args,
+                              void *args_ptr)
+{
+    conn_call *call = (conn_call *) xprt;
+
+    return (*xdr_args) (&call->xdrs, args_ptr);
+}
+
+static bool_t call_xp_freeargs(U(SVCXPRT * xprt), xdrproc_t xdr_args,
+                               void *args_ptr)
+{
+    XDR xdrs;
+
+    xdrs.x_op = XDR_FREE;
+    return (*xdr_args) (&xdrs, args_ptr);
+}
+
+static void call_xp_destroy(U(SVCXPRT * xprt))
+{
+}
+
+static bool_t call_xp_control(U(SVCXPRT * xprt), U(const u_int rq),
+                              U(void *in))
+{
+    return FALSE;
+}
+
+static const struct xp_ops2 call_ops2 = {
+    call_xp_control
+};
+
+/*
+ * fill in transport ops, only the reply differs between transports
+ */
+void conn_call_ops(struct xp_ops *ops,
+                   bool_t (*reply) (SVCXPRT *, struct rpc_msg *))
+{
+    ops->xp_recv = call_xp_recv;
+    ops->xp_stat = call_xp_stat;
+    ops->xp_getargs = call_xp_getargs;
+    ops->xp_reply = reply;
+    ops->xp_freeargs = call_xp_freeargs;
+    ops->xp_destroy = call_xp_destroy;
+}
+
+/*
+ * set up the SVCXPRT of a call whose record is in call->rec
+ */
+void conn_call_init(conn_call * call, const struct xp_ops *ops, int fd,
+                    struct sockaddr_storage *addr, socklen_t addrlen,
+                    void *owner)
+{
+    call->xprt.xp_fd = fd;
+    call->xprt.xp_ops = ops;
+    call->xprt.xp_ops2 = &call_ops2;
+    call->xprt.xp_addrlen = addrlen;
+    call->xprt.xp_rtaddr.buf = addr;
+    call->xprt.xp_rtaddr.len = addrlen;
+    call->xprt.xp_rtaddr.maxlen = sizeof(struct sockaddr_storage);
+    call->xprt.xp_p1 = owner;
+}
+
+/*
+ * authenticate a call
+ */
+static enum auth_stat conn_call_auth(conn_call * call)
+{
+    struct opaque_auth *cred = &call->msg.rm_call.cb_cred;
+    XDR xdrs;
+    bool_t res;
+
+    call->req.rq_cred = *cred;
+
+    switch (cred->oa_flavor) {
+        case AUTH_NONE:
+            call->req.rq_clntcred = NULL;
+            return AUTH_OK;
+        case AUTH_UNIX:
+            call->aup.aup_machname = call->machname;
+            call->aup.aup_gids = call->gids;
+            xdrmem_create(&xdrs, cred->oa_base, cred->oa_length, XDR_DECODE);
+            res = xdr_authunix_parms(&xdrs, &call->aup);
+            xdr_destroy(&xdrs);
+            if (!res)
+                return AUTH_BADCRED;
+            call->req.rq_clntcred = (void *) &call->aup;
+            return AUTH_OK;
+        default:
+            return AUTH_REJECTEDCRED;
+    }
+}
+
+/*
+ * decode and dispatch a call
+ * returns TRUE if the call has been deferred and must be kept
+ */
+int conn_call_serve(conn_call * call)
+{
+    enum auth_stat why;
+    u_int pos;
+
+    call->msg.rm_call.cb_cred.oa_base = call->cred_area;
+    call->msg.rm_call.cb_verf.oa_base = call->cred_area + MAX_AUTH_BYTES;
+    xdrmem_create(&call->xdrs, call->rec, call->len, XDR_DECODE);
+
+    /* drop garbage like libtirpc does */
+    if (!xdr_callmsg(&call->xdrs, &call->msg) ||
+        call->msg.rm_direction != CALL)
+        return FALSE;
+
+    call->xid = call->msg.rm_xid;
+    call->req.rq_prog = call->msg.rm_call.cb_prog;
+    call->req.rq_vers = call->msg.rm_call.cb_vers;
+    call->req.rq_proc = call->msg.rm_call.cb_proc;
+    call->req.rq_xprt = &call->xprt;
+    call->xprt.xp_verf = _null_auth;
+
+    why = conn_call_auth(call);
+    if (why != AUTH_OK) {
+        svcerr_auth(&call->xprt, why);
+        return FALSE;
+    }
+
+    pos = xdr_getpos(&call->xdrs);
+    switch (drc_begin(call->xprt.xp_rtaddr.buf, &call->msg,
+                      call->rec + pos, call->len - pos, &call->drc,
+                      &call->replay, &call->replay_len)) {
+        case DRC_BUSY:
+            return FALSE;
+        case DRC_REPLAY:
+            SVC_REPLY(&call->xprt, &call->msg);
+            free(call->replay);
+            call->replay = NULL;
+            return FALSE;
+        default:
+            break;
+    }
+
+    conn_dispatch(&call->req, &call->xprt);
+
+    return call->deferred;
+}
+
+/*
+ * clean up after a call, once it has been answered or dropped
+ */
+void conn_call_done(conn_call * call)
+{
+    /* no reply to remember */
+    if (call->drc) {
+        drc_end(call->drc, NULL, 0);
+        call->drc = NULL;
+    }
+}
+
+/*
+ * encode a reply with the XID of its call into a malloc'd buffer,
+ * leaving head bytes in front of it for the transport
+ */
+char *conn_call_encode(conn_call * call, struct rpc_msg *msg, size_t head,
+                       size_t *len)
+{
+    XDR xdrs;
+    u_long size;
+    char *buf;
+
+    /* a retransmission gets the reply of the original */
+    if (call->replay) {
+        buf = malloc(call->replay_len + head);
+        if (!buf)
+            return NULL;
+        memcpy(buf + head, call->replay, call->replay_len);
+        *len = call->replay_len;
+        return buf;
+    }
+
+    msg->rm_xid = call->xid;
+
+    size = xdr_sizeof((xdrproc_t) xdr_replymsg, msg);
+    buf = malloc(size + head);
+    if (!buf)
+        return NULL;
+
+    xdrmem_create(&xdrs, buf + head, size, XDR_ENCODE);
+    if (!xdr_replymsg(&xdrs, msg)) {
+        xdr_destroy(&xdrs);
+        free(buf);
+        return NULL;
+    }
+    *len = xdr_getpos(&xdrs);
+    xdr_destroy(&xdrs);
+
+    if (call->drc) {
+        drc_end(call->drc, buf + head, *len);
+        call->drc = NULL;
+    }
+
+    return buf;
+}
+
+/*
+ * a request is done, free it
+ */
+static void conn_req_done(conn_req * r)
+{
+    conn *c = r->c;
+
+    conn_call_done(&r->call);
+    free(r);
+    conn_release(c, TRUE);
+}
+
+/*
+ * decode and dispatch a request, runs in a worker or in the main loop
+ */
+static void conn_serve(void *arg)
+{
+    conn_req *r = arg;
+    int deferred;
+
+    deferred = conn_call_serve(&r->call);
+
+    /* the request may be freed as soon as its I/O is submitted */
+    aio_flush();
+
+    if (!deferred)
+        conn_req_done(r);
+}
+
+/*
+ * split received data into records and start their requests
+ * returns -1 if the client sent an oversized record
+ */
+static int conn_parse(conn * c)
+{
+    conn_req *r;
+    size_t pos = 0, end, total, flen, off;
+    uint32 mark;
+    int last;
+
+    for (;;) {
+        /* find the end of the record starting at pos */
+        end = pos;
+        total = 0;
+        last = FALSE;
+        while (!last) {
+            if (c->len - end < 4)
+                goto incomplete;
+            memcpy(&mark, c->buf + end, 4);
+            mark = ntohl(mark);
+            last = (mark & 0x80000000) != 0;
+            flen = mark & 0x7fffffff;
+            total += flen;
+            if (total > CONN_MAX_RECORD)
+                return -1;
+            if (c->len - end - 4 < flen)
+                goto incomplete;
+            end += 4 + flen;
+        }
+
+        pthread_mutex_lock(&conn_mutex);
+        if (c->reqs >= CONN_MAX_REQS) {
+            c->throttled = TRUE;
+            pthread_mutex_unlock(&conn_mutex);
+            break;
+        }
+        c->reqs++;
+        c->refs++;
+        pthread_mutex_unlock(&conn_mutex);
+
+        r = malloc(sizeof(conn_req) + total);
+        if (!r) {
+            logmsg(LOG_CRIT, "Out of memory, dropping request");
+            conn_release(c, TRUE);
+            pos = end;
+            continue;
+        }
+        memset(r, 0, sizeof(conn_req));
+        r->c = c;
+        r->call.rec = (char *) (r + 1);
+        r->call.len = total;
+
+        /* join the fragments */
+        for (off = 0; pos < end; pos += 4 + flen) {
+            memcpy(&mark, c->buf + pos, 4);
+            flen = ntohl(mark) & 0x7fffffff;
+            memcpy(r->call.rec + off, c->buf + pos + 4, flen);
+            off += flen;
+        }
+
+        conn_call_init(&r->call, &conn_ops, c->fd, &c->addr, c->addrlen, r);
+
+        if (worker_active()) {
+            r->job.fn = conn_serve;
+            r->job.arg = r;
+            r->job.client = c->client;
+            worker_run(&r->job);
+        } else
+            conn_serve(r);
+    }
+
+  incomplete:
+    memmove(c->buf, c->buf + pos, c->len - pos);
+    c->len -= pos;
+    return 0;
+}
+
+/*
+ * read from a connection and start the requests received
+ */
+static void conn_input(conn * c)
+{
+    char *p;
+    ssize_t n;
+    int throttled;
+
+    if (c->len == c->size) {
+        /* one record plus the start of the next always fits */
+        if (c->size >= 2 * CONN_MAX_RECORD) {
+            conn_close(c);
+            return;
+        }
+        p = realloc(c->buf, c->size * 2);
+        if (!p) {
+            logmsg(LOG_CRIT, "Out of memory, dropping connection");
+            conn_close(c);
+            return;
+        }
+        c->buf = p;
+        c->size *= 2;
+    }
+
+    n = read(c->fd, c->buf + c->len, c->size - c->len);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        conn_close(c);
+        return;
+    }
+    c->len += n;
+
+    if (conn_parse(c) == -1) {
+        logmsg(LOG_WARNING, "Oversized record, dropping connection");
+        conn_close(c);
+        return;
+    }
+
+    pthread_mutex_lock(&conn_mutex);
+    throttled = c->throttled;
+    pthread_mutex_unlock(&conn_mutex);
+
+    if (throttled)
+        conn_watch(c, EPOLL_CTL_MOD, FALSE);
+}
+
+/*
+ * handle readiness of an fd
+ * returns FALSE if it does not belong to a connection
+ */
+int conn_event(int fd)
+{
+    if (fd >= conns_size || !conns[fd])
+        return FALSE;
+
+    conn_input(conns[fd]);
+    return TRUE;
+}
+
+/*
+ * continue reading connections that have fewer requests in progress now
+ */
+void conn_resume(void)
+{
+    uint64_t events;
+    conn *c, *next;
+
+    if (read(resume_fd, &events, sizeof(events)) == -1 && errno != EAGAIN)
+        logmsg(LOG_WARNING, "Unable to read connection event counter");
+
+    pthread_mutex_lock(&conn_mutex);
+    c = resume_list;
+    resume_list = NULL;
+    for (next = c; next; next = next->next) {
+        next->resume = FALSE;
+        next->throttled = FALSE;
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    for (; c; c = next) {
+        next = c->next;
+
+        /* records may already be waiting in the buffer */
+        if (!c->closed && conn_parse(c) == 0) {
+            pthread_mutex_lock(&conn_mutex);
+            if (!c->throttled)
+                conn_watch(c, EPOLL_CTL_MOD, TRUE);
+            pthread_mutex_unlock(&conn_mutex);
+        }
+
+        conn_release(c, FALSE);
+    }
+}
+
+/*
+ * check whether replies may still be sent on a connection
+ * returns 0 if nobody is left to answer, -1 if sending failed before
+ */
+static int conn_state(conn * c)
+{
+    int res;
+
+    pthread_mutex_lock(&conn_mutex);
+    res = c->closed ? 0 : (c->broken ? -1 : 1);
+    pthread_mutex_unlock(&conn_mutex);
+
+    return res;
+}
+
+/*
+ * give up on a connection after a failed or partial reply, the main
+ * loop notices the shutdown and closes it
+ */
+static void conn_break(conn * c)
+{
+    pthread_mutex_lock(&conn_mutex);
+    c->broken = TRUE;
+    pthread_mutex_unlock(&conn_mutex);
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+/*
+ * wait until a connection accepts more data
+ */
+static int conn_wait(conn * c)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = c->fd;
+    pfd.events = POLLOUT;
+    n = poll(&pfd, 1, CONN_SEND_TIMEOUT * 1000);
+
+    return n > 0 || (n == -1 && errno == EINTR);
+}
+
+/*
+ * send data, called with send_mutex held
+ */
+static int conn_send(conn * c, const char *buf, size_t len, int flags)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(c->fd, buf, len, flags | MSG_NOSIGNAL);
+        if (n > 0) {
+            buf += n;
+            len -= n;
+        } else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && errno == EAGAIN && conn_wait(c))
+            continue;
+        else
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * queue a reply if another request is sending on the connection,
+ * otherwise make the caller the one that sends
+ * returns TRUE if the reply was queued
+ */
+static int conn_queue(conn * c, char *buf, size_t len)
+{
+    conn_out *o = NULL;
+    int res = FALSE;
+
+    pthread_mutex_lock(&conn_mutex);
+    if (!c->sending)
+        c->sending = TRUE;
+    else if ((o = malloc(sizeof(conn_out)))) {
+        o->buf = buf;
+        o->len = len;
+        o->next = NULL;
+        if (c->out_last)
+            c->out_last->next = o;
+        else
+            c->out_first = o;
+        c->out_last = o;
+        c->reqs++;
+        c->refs++;
+        res = TRUE;
+    }
+    pthread_mutex_unlock(&conn_mutex);
+
+    return res;
+}
+
+/*
+ * take the next queued reply, or stop sending if there is none
+ */
+static conn_out *conn_dequeue(conn * c)
+{
+    conn_out *o;
+
+    pthread_mutex_lock(&conn_mutex);
+    o = c->out_first;
+    if (o) {
+        c->out_first = o->next;
+        if (!c->out_first)
+            c->out_last = NULL;
+    } else
+        c->sending = FALSE;
+    pthread_mutex_unlock(&conn_mutex);
+
+    return o;
+}
+
+/*
+ * send the replies queued while the caller was sending, or drop them if
+ * ok is FALSE, and stop sending, called with send_mutex held
+ * returns FALSE if sending failed
+ */
+static int conn_flush(conn * c, int ok)
+{
+    conn_out *o;
+
+    while ((o = conn_dequeue(c))) {
+        if (ok)
+            ok = conn_send(c, o->buf, o->len, 0);
+        free(o->buf);
+        free(o);
+        conn_release(c, TRUE);
+    }
+    return ok;
+}
+
+/*
+ * write a complete reply to a connection and free buf, together with
+ * the replies queued meanwhile
+ */
+static bool_t conn_write(conn * c, char *buf, size_t len)
+{
+    int res, ok;
+
+    res = conn_state(c);
+    if (res <= 0) {
+        free(buf);
+        return res == 0;
+    }
+
+    if (conn_queue(c, buf, len))
+        return TRUE;
+
+    pthread_mutex_lock(&c->send_mutex);
+    ok = res = conn_send(c, buf, len, 0);
+    free(buf);
+
+    /* queued replies are dropped once the connection is broken */
+    if (!conn_flush(c, ok))
+        conn_break(c);
+    pthread_mutex_unlock(&c->send_mutex);
+
+    return res;
+}
+
+#ifdef HAVE_SYS_SENDFILE_H
+/*
+ * send a range of a file, called with send_mutex held
+ */
+static int conn_send_file(conn * c, int fd, off64_t offset, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = sendfile64(c->fd, fd, &offset, len);
+        if (n > 0)
+            len -= n;
+        else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && errno == EAGAIN && conn_wait(c))
+            continue;
+        else
+            /* including the file having been truncated meanwhile */
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * write a reply whose end is a range of a file and padding, together
+ * with the replies queued meanwhile, on a connection claimed by
+ * conn_file_ok(), or only release it if head is NULL
+ */
+static int conn_write_file(conn * c, const char *head, size_t head_len,
+                           int fd, off64_t offset, size_t len, size_t pad)
+{
+    static const char zeros[4] = { 0, 0, 0, 0 };
+    int res, ok;
+
+    pthread_mutex_lock(&c->send_mutex);
+    res = conn_state(c);
+    if (res <= 0) {
+        conn_flush(c, FALSE);
+        pthread_mutex_unlock(&c->send_mutex);
+        return res == 0;
+    }
+
+    /* an incomplete record breaks the stream */
+    ok = !head || (conn_send(c, head, head_len, MSG_MORE) &&
+                   conn_send_file(c, fd, offset, len) &&
+                   conn_send(c, zeros, pad, 0));
+    res = ok;
+    if (!conn_flush(c, ok))
+        conn_break(c);
+    pthread_mutex_unlock(&c->send_mutex);
+
+    return res;
+}
+#endif				       /* HAVE_SYS_SENDFILE_H */
+
+/*
+ * encode a reply with the XID of its call and send it
+ */
+static bool_t conn_xp_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    conn_req *r = xprt->xp_p1;
+    uint32 mark;
+    size_t size;
+    char *buf;
+
+    buf = conn_call_encode(&r->call, msg, 4, &size);
+    if (!buf)
+        return FALSE;
+
+    /* single fragment record */
+    mark = htonl(0x80000000 | size);
+    memcpy(buf, &mark, 4);
+
+    return conn_write(r->c, buf, size + 4);
+}
+
+/*
+ * keep a request after its dispatcher has returned without a reply
+ * returns FALSE if the transport cannot reply later
+ */
+int conn_defer(struct svc_req *rqstp)
+{
+    conn_req *r;
+
+    if (rqstp->rq_xprt->xp_ops != &conn_ops)
+        return FALSE;
+
+    r = rqstp->rq_xprt->xp_p1;
+    r->call.deferred = TRUE;
+    return TRUE;
+}
+
+/*
+ * run fn(arg) to finish a deferred request, in a worker if there are
+ * workers, since sending the reply may block
+ */
+void conn_finish(struct svc_req *rqstp, void (*fn) (void *), void *arg)
+{
+    conn_req *r = rqstp->rq_xprt->xp_p1;
+
+    if (worker_active()) {
+        r->job.fn = fn;
+        r->job.arg = arg;
+        r->job.client = r->c->client;
+        worker_run(&r->job);
+    } else
+        fn(arg);
+}
+
+/*
+ * send the reply of a deferred request and free it
+ */
+void conn_reply(struct svc_req *rqstp, xdrproc_t xdr_result, void *result)
+{
+    conn_req *r = rqstp->rq_xprt->xp_p1;
+
+    if (!svc_sendreply(&r->call.xprt, xdr_result, result)) {
+        svcerr_systemerr(&r->call.xprt);
+        logmsg(LOG_CRIT, "Unable to send RPC reply");
+    }
+
+    conn_req_done(r);
+}
+
+/*
+ * check whether a request can be answered with conn_reply_file(), and
+ * if so, make it the one that sends on its connection, so that it has
+ * to be answered that way
+ */
+int conn_file_ok(struct svc_req *rqstp)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    conn_req *r;
+    int res;
+
+    if (rqstp->rq_xprt->xp_ops != &conn_ops)
+        return FALSE;
+
+    /* a copied reply can be queued while another one is being sent */
+    r = rqstp->rq_xprt->xp_p1;
+    pthread_mutex_lock(&conn_mutex);
+    res = !r->c->sending;
+    r->c->sending = TRUE;
+    pthread_mutex_unlock(&conn_mutex);
+
+    return res;
+#else
+    return FALSE;
+#endif
+}
+
+/*
+ * send a reply whose last item is an opaque holding len bytes of a
+ * file, which go from the page cache to the socket without a copy in
+ * user space. That opaque must be empty in the result.
+ */
+void conn_reply_file(struct svc_req *rqstp, xdrproc_t xdr_result,
+                     void *result, int fd, off64_t offset, uint32 len)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+    conn_req *r = rqstp->rq_xprt->xp_p1;
+    struct rpc_msg msg;
+    uint32 word;
+    size_t size, pad;
+    char *buf;
+
+    msg.rm_direction = REPLY;
+    msg.rm_reply.rp_stat = MSG_ACCEPTED;
+    msg.acpted_rply.ar_verf = r->call.xprt.xp_verf;
+    msg.acpted_rply.ar_stat = SUCCESS;
+    msg.acpted_rply.ar_results.where = result;
+    msg.acpted_rply.ar_results.proc = xdr_result;
+
+    buf = conn_call_encode(&r->call, &msg, 4, &size);
+    if (!buf) {
+        logmsg(LOG_CRIT, "Unable to send RPC reply");
+        conn_write_file(r->c, NULL, 0, -1, 0, 0, 0);
+        return;
+    }
+
+    /* the empty opaque is encoded as a zero length at the very end */
+    word = htonl(len);
+    memcpy(buf + 4 + size - 4, &word, 4);
+
+    pad = (4 - len % 4) % 4;
+    word = htonl(0x80000000 | (size + len + pad));
+    memcpy(buf, &word, 4);
+
+    conn_write_file(r->c, buf, size + 4, fd, offset, len, pad);
+    free(buf);
+#endif
+}
+
+#else				       /* UNFS3_CONN */
+
+int conn_init(U(int epoll_fd),
+              U(void (*dispatch) (struct svc_req *, SVCXPRT *)))
+{
+    return -1;
+}
+
+void conn_accept(U(int listen_fd))
+{
+}
+
+int conn_event(U(int fd))
+{
+    return FALSE;
+}
+
+void conn_resume(void)
+{
+}
+
+int conn_defer(U(struct svc_req *rqstp))
+{
+    return FALSE;
+}
+
+void conn_finish(U(struct svc_req *rqstp), void (*fn) (void *), void *arg)
+{
+    fn(arg);
+}
+
+void conn_reply(U(struct svc_req *rqstp), U(xdrproc_t xdr_result),
+                U(void *result))
+{
+}
+
+int conn_file_ok(U(struct svc_req *rqstp))
+{
+    return FALSE;
+}
+
+void conn_reply_file(U(struct svc_req *rqstp), U(xdrproc_t xdr_result),
+                     U(void *result), U(int fd), U(off64_t offset),
+                     U(uint32 len))
+{
+}
+
+#endif				       /* UNFS3_CONN */
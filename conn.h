@@ -0,0 +1,67 @@
+/*
+ * UNFS3 TCP connection transport
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_CONN_H
+#define UNFS3_CONN_H
+
+#include "worker.h"
+
+#if defined(UNFS3_THREADS) && defined(HAVE_SYS_EPOLL_H) && \
+    defined(HAVE_SYS_EVENTFD_H)
+#define UNFS3_CONN 1
+#endif
+
+/* largest request record accepted on a connection */
+#define CONN_MAX_RECORD	(NFS_MAXDATA_TCP + 4096)
+
+/* READ replies carrying less data are copied instead of sent from the
+   file with conn_reply_file() */
+#define CONN_FILE_MIN	16384
+
+/* requests of one connection that may be in progress at once */
+#define CONN_MAX_REQS	64
+
+/* a call received by one of the server's own transports */
+typedef struct {
+    SVCXPRT xprt;		/* must come first */
+    uint32 xid;
+    int deferred;		/* kept beyond its dispatcher */
+    struct svc_req req;
+    struct rpc_msg msg;
+    XDR xdrs;
+    char cred_area[2 * MAX_AUTH_BYTES];
+    struct authunix_parms aup;
+    char machname[MAX_MACHINE_NAME + 1];
+    gid_t gids[NGRPS];
+    size_t len;			/* the call record */
+    char *rec;
+    struct drc_entry *drc;	/* waiting for the reply */
+    char *replay;		/* reply to send again */
+    size_t replay_len;
+} conn_call;
+
+int conn_init(int epoll_fd, void (*dispatch) (struct svc_req *, SVCXPRT *));
+void conn_accept(int listen_fd);
+int conn_event(int fd);
+void conn_resume(void);
+
+void conn_call_ops(struct xp_ops *ops,
+                   bool_t (*reply) (SVCXPRT *, struct rpc_msg *));
+void conn_call_init(conn_call * call, const struct xp_ops *ops, int fd,
+                    struct sockaddr_storage *addr, socklen_t addrlen,
+                    void *owner);
+int conn_call_serve(conn_call * call);
+void conn_call_done(conn_call * call);
+char *conn_call_encode(conn_call * call, struct rpc_msg *msg, size_t head,
+                       size_t *len);
+
+int conn_defer(struct svc_req *rqstp);
+void conn_finish(struct svc_req *rqstp, void (*fn) (void *), void *arg);
+void conn_reply(struct svc_req *rqstp, xdrproc_t xdr_result, void *result);
+int conn_file_ok(struct svc_req *rqstp);
+void conn_reply_file(struct svc_req *rqstp, xdrproc_t xdr_result,
+                     void *result, int fd, off64_t offset, uint32 len);
+
+#endif
@@ -44,6 +44,11 @@
 #endif
 #if defined(HAVE_SVC_GETREQ_POLL) && HAVE_DECL_SVC_POLLFD
 # include <sys/poll.h>
+# if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_TIMERFD_H)
+#  include <sys/epoll.h>
+#  include <sys/timerfd.h>
+#  define UNFS3_EPOLL 1
+# endif
 #endif
 
 #include "nfs.h"
@@ -52,9 +57,16 @@
 #include "fh.h"
 #include "fh_cache.h"
 #include "fd_cache.h"
+#include "commit.h"
 #include "user.h"
 #include "daemon.h"
 #include "backend.h"
+#include "worker.h"
+#include "aio.h"
+#include "scheduler.h"
+#include "resolve.h"
+#include "conn.h"
+#include "udp.h"
 #include "Config/exports.h"
 
 #ifndef SIG_PF
@@ -88,6 +100,10 @@ int opt_32_bit_truncate = FALSE;
 /* Register with portmapper? */
 int opt_portmapper = TRUE;
 
+/* listening sockets, accepted by the main loop even with worker threads */
+static int listen_fds[2];
+static int listen_fds_len = 0;
+
 /*
  * output message to syslog or stdout
  */
@@ -119,12 +135,17 @@ void logmsg(int prio, const char *fmt, ...)
  */
 int get_remote(struct svc_req *rqstp, struct in6_addr *addr6)
 {
-    const struct sockaddr *saddr;
+    return get_remote_addr((const struct sockaddr *)
+                           svc_getrpccaller(rqstp->rq_xprt)->buf, addr6);
+}
 
+/*
+ * convert a socket address to an IPv6 address, mapping IPv4
+ */
+int get_remote_addr(const struct sockaddr *saddr, struct in6_addr *addr6)
+{
     memset(addr6, 0, sizeof(struct in6_addr));
 
-    saddr = (const struct sockaddr *) svc_getrpccaller(rqstp->rq_xprt)->buf;
-
     if (saddr->sa_family == AF_INET6) {
         memcpy(addr6, &((const struct sockaddr_in6*)saddr)->sin6_addr, sizeof(struct in6_addr));
         return 0;
@@ -238,7 +259,7 @@ static void remove_pid_file(void)
 static void parse_options(int argc, char **argv)
 {
     int opt = 0;
-    char *optstring = "3bcC:de:hl:m:n:prstTuwi:";
+    char *optstring = "3bcC:de:hH:Kl:m:n:Npq:rsS:tTuwi:W:";
 
 #if defined(WIN32) || defined(AFS_SUPPORT)
     /* Allways truncate to 32 bits in these cases */
@@ -303,8 +324,40 @@ static void parse_options(int argc, char **argv)
                 printf
                 ("\t-3          truncate fileid and cookie to 32 bits\n");
                 printf("\t-T          test exports file and exit\n");
+                printf("\t-H <num>    keep <num> entries in the filehandle cache\n");
+                printf("\t-S <file>   keep snapshots of the filehandle cache in <file>\n");
+                printf("\t-N          watch directories instead of checking cached paths\n");
+                printf("\t-K          use kernel file handles in filehandles\n");
+#ifdef UNFS3_THREADS
+                printf("\t-W <num>    serve requests with <num> worker threads\n");
+#endif
+#ifdef UNFS3_URING
+                printf("\t-q <depth>  do file I/O through io_uring, <depth> operations at once\n");
+#endif
                 exit(0);
                 break;
+            case 'H':
+                opt_fh_cache_size = strtol(optarg, NULL, 10);
+                if (opt_fh_cache_size < 16 ||
+                    opt_fh_cache_size > FH_CACHE_MAX) {
+                    fprintf(stderr, "Invalid filehandle cache size\n");
+                    exit(1);
+                }
+                break;
+            case 'K':
+                opt_kernel_fh = TRUE;
+                break;
+            case 'N':
+                opt_fh_watch = TRUE;
+                break;
+            case 'S':
+                if (optarg[0] != '/') {
+                    /* we are changing directory */
+                    fprintf(stderr, "Error: relative path to snapshot file\n");
+                    exit(1);
+                }
+                opt_fh_snap_file = optarg;
+                break;
             case 'l':
                 if (inet_pton(AF_INET6, optarg, &opt_bind_addr) != 1) {
                     struct in_addr in4;
@@ -337,6 +390,18 @@ static void parse_options(int argc, char **argv)
             case 'p':
                 opt_portmapper = FALSE;
                 break;
+            case 'q':
+#ifdef UNFS3_URING
+                opt_aio_depth = strtol(optarg, NULL, 10);
+                if (opt_aio_depth < 0 || opt_aio_depth > AIO_DEPTH_MAX) {
+                    fprintf(stderr, "Invalid queue depth\n");
+                    exit(1);
+                }
+#else
+                fprintf(stderr, "Asynchronous I/O is not supported\n");
+                exit(1);
+#endif
+                break;
             case 'r':
                 opt_readable_executables = TRUE;
                 break;
@@ -364,6 +429,18 @@ static void parse_options(int argc, char **argv)
             case 'i':
                 opt_pid_file = optarg;
                 break;
+            case 'W':
+#ifdef UNFS3_THREADS
+                opt_threads = strtol(optarg, NULL, 10);
+                if (opt_threads < 0 || opt_threads > WORKER_MAX) {
+                    fprintf(stderr, "Invalid number of threads\n");
+                    exit(1);
+                }
+#else
+                fprintf(stderr, "Worker threads are not supported\n");
+                exit(1);
+#endif
+                break;
             case '?':
                 exit(1);
                 break;
@@ -371,31 +448,142 @@ static void parse_options(int argc, char **argv)
     }
 }
 
+/* written to by the signal handler */
+static int signal_pipe[2] = { -1, -1 };
+
+#ifndef WIN32
+/* signals for the main loop to act on */
+static volatile sig_atomic_t signal_reload = FALSE;
+static volatile sig_atomic_t signal_stats = FALSE;
+static volatile sig_atomic_t signal_exit = 0;
+
 /*
- * signal handler and error exit function
+ * signal handler, leaves the work to daemon_signals()
  */
-void daemon_exit(int error)
+static void daemon_signal(int sig)
 {
-#ifndef WIN32
-    if (error == SIGHUP) {
-        get_squash_ids();
-        exports_parse();
-        return;
+    int err = errno;
+
+    if (sig == SIGHUP)
+        signal_reload = TRUE;
+    else if (sig == SIGUSR1)
+        signal_stats = TRUE;
+    else
+        signal_exit = sig;
+
+    /* wake up the main loop */
+    if (signal_pipe[1] != -1 && write(signal_pipe[1], "", 1) < 0) {
+        /* pipe full, the main loop is woken up already */
+    }
+    errno = err;
+}
+
+/*
+ * install the signal handlers
+ */
+static void daemon_signal_init(void)
+{
+    struct sigaction act;
+
+    if (pipe(signal_pipe) == 0) {
+        fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(signal_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(signal_pipe[1], F_SETFD, FD_CLOEXEC);
+    } else {
+        signal_pipe[0] = -1;
+        signal_pipe[1] = -1;
     }
 
-    if (error == SIGUSR1) {
-        if (fh_cache_use > 0)
-            logmsg(LOG_INFO, "fh entries %i access %i hit %i miss %i",
-                   fh_cache_max, fh_cache_use, fh_cache_hit,
-                   fh_cache_use - fh_cache_hit);
-        else
-            logmsg(LOG_INFO, "fh cache unused");
-        logmsg(LOG_INFO, "Open file descriptors: read %i, write %i",
-               fd_cache_readers, fd_cache_writers);
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = 0;
+    act.sa_handler = daemon_signal;
+    sigaction(SIGHUP, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGQUIT, &act, NULL);
+    sigaction(SIGUSR1, &act, NULL);
+
+    act.sa_handler = daemon_exit;
+    sigaction(SIGSEGV, &act, NULL);
+
+    act.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &act, NULL);
+    sigaction(SIGUSR2, &act, NULL);
+    sigaction(SIGALRM, &act, NULL);
+}
+
+/*
+ * log statistics, on SIGUSR1
+ */
+static void daemon_stats(void)
+{
+    if (fh_cache_use > 0)
+        logmsg(LOG_INFO, "fh entries %i names %i access %i hit %i miss %i",
+               fh_cache_max, fh_cache_names, fh_cache_use, fh_cache_hit,
+               fh_cache_use - fh_cache_hit);
+    else
+        logmsg(LOG_INFO, "fh cache unused");
+    if (opt_fh_snap_file)
+        logmsg(LOG_INFO, "fh snapshot hit %i", fh_cache_snap_hit);
+    logmsg(LOG_INFO, "Open file descriptors: read %i, write %i of %i",
+           fd_cache_readers, fd_cache_writers, fd_cache_entries);
+    if (fd_cache_gathered > 0)
+        logmsg(LOG_INFO, "Gathered writes %i, flushes %i",
+               fd_cache_gathered, fd_cache_flushes);
+    if (commit_requests > 0)
+        logmsg(LOG_INFO, "Stable writes and commits %i, syncs %i",
+               commit_requests, commit_syncs);
+}
+
+/*
+ * act on the signals received, called by the main loop
+ *
+ * the export list and the fd cache are only changed once no request
+ * is being served anymore. The handler wakes up the main loop through
+ * signal_pipe.
+ */
+static void daemon_signals(void)
+{
+    char buf[64];
+
+    if (signal_pipe[0] != -1)
+        while (read(signal_pipe[0], buf, sizeof(buf)) > 0);
+
+    if (!signal_reload && !signal_stats && !signal_exit)
         return;
+
+    worker_lock();
+    if (signal_exit) {
+        worker_exclusive();
+        /* clients keep using their filehandles after a restart */
+        fh_cache_checkpoint(TRUE);
+        daemon_exit(signal_exit);
+    }
+    if (signal_reload) {
+        signal_reload = FALSE;
+        worker_exclusive();
+        get_squash_ids();
+        exports_parse();
+        worker_shared();
+    }
+    if (signal_stats) {
+        signal_stats = FALSE;
+        daemon_stats();
     }
+    worker_unlock();
+}
+#else
+static void daemon_signals(void)
+{
+}
 #endif				       /* WIN32 */
 
+/*
+ * error exit function, also the handler of SIGSEGV
+ */
+void daemon_exit(int error)
+{
     if (opt_portmapper) {
         svc_unreg(MOUNTPROG, MOUNTVERS1);
         svc_unreg(MOUNTPROG, MOUNTVERS3);
@@ -451,6 +639,7 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
     char *result;
     xdrproc_t _xdr_argument, _xdr_result;
     char *(*local) (char *, struct svc_req *);
+    uint64 bytes = 0;
 
     switch (rqstp->rq_proc) {
         case NFSPROC3_NULL:
@@ -613,7 +802,16 @@ static void nfs3_program_3(struct svc_req *rqstp, register SVCXPRT * transp)
         svcerr_decode(transp);
         return;
     }
+    /* data transferred, for the request scheduler */
+    if (rqstp->rq_proc == NFSPROC3_READ)
+        bytes = argument.nfsproc3_read_3_arg.count;
+    else if (rqstp->rq_proc == NFSPROC3_WRITE)
+        bytes = argument.nfsproc3_write_3_arg.count;
+
+    worker_enter(rqstp);
     result = (*local) ((char *) &argument, rqstp);
+    sched_charge(bytes);
+    worker_leave();
     if (result != NULL &&
         !svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
         svcerr_systemerr(transp);
@@ -691,12 +889,15 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
         svcerr_decode(transp);
         return;
     }
+    /* the mount list is shared, keep the lock until the reply is out */
+    worker_enter(rqstp);
     result = (*local) ((char *) &argument, rqstp);
     if (result != NULL &&
         !svc_sendreply(transp, (xdrproc_t) _xdr_result, result)) {
         svcerr_systemerr(transp);
         logmsg(LOG_CRIT, "Unable to send RPC reply");
     }
+    worker_leave();
     if (!svc_freeargs
         (transp, (xdrproc_t) _xdr_argument, (caddr_t) & argument)) {
         logmsg(LOG_CRIT, "Unable to free XDR arguments");
@@ -704,6 +905,32 @@ static void mountprog_3(struct svc_req *rqstp, register SVCXPRT * transp)
     return;
 }
 
+#ifdef UNFS3_EPOLL
+/*
+ * dispatch a request of any of our programs
+ * used by transports that do not go through the libtirpc callout table
+ */
+static void dispatch_request(struct svc_req *rqstp, SVCXPRT * transp)
+{
+    switch (rqstp->rq_prog) {
+        case NFS3_PROGRAM:
+            if (rqstp->rq_vers == NFS_V3)
+                nfs3_program_3(rqstp, transp);
+            else
+                svcerr_progvers(transp, NFS_V3, NFS_V3);
+            break;
+        case MOUNTPROG:
+            if (rqstp->rq_vers == MOUNTVERS1 || rqstp->rq_vers == MOUNTVERS3)
+                mountprog_3(rqstp, transp);
+            else
+                svcerr_progvers(transp, MOUNTVERS1, MOUNTVERS3);
+            break;
+        default:
+            svcerr_noprog(transp);
+    }
+}
+#endif				       /* UNFS3_EPOLL */
+
 static int
 _socket_getdomain(int socket)
 {
@@ -939,6 +1166,8 @@ static SVCXPRT *create_udp_transport(unsigned int port)
         daemon_exit(0);
     }
 
+    udp_watch(sock);
+
     return transp;
 }
 
@@ -1022,6 +1251,10 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
 
     transp = svc_vc_create(sock, 0, 0);
 
+    if (transp != NULL &&
+        listen_fds_len < (int) (sizeof(listen_fds) / sizeof(int)))
+        listen_fds[listen_fds_len++] = sock;
+
     if (transp == NULL) {
         fprintf(stderr, "Cannot create tcp service.\n");
         daemon_exit(0);
@@ -1030,12 +1263,195 @@ static SVCXPRT *create_tcp_transport(unsigned int port)
     return transp;
 }
 
+/*
+ * check whether fd is one of our listening sockets
+ */
+static int is_listen_fd(int fd)
+{
+    int i;
+
+    for (i = 0; i < listen_fds_len; i++)
+        if (listen_fds[i] == fd)
+            return TRUE;
+    return FALSE;
+}
+
+#ifdef UNFS3_EPOLL
+/* epoll instance of the main loop */
+static int epoll_fd = -1;
+
+/*
+ * add transports to the epoll set
+ *
+ * libtirpc does not tell us about new or destroyed transports. Closed
+ * fds drop out of the epoll set by themselves, and new connections only
+ * appear after an accept, so the set is synced only then. Adding an fd
+ * that is already registered fails with EEXIST, which is harmless.
+ */
+static void epoll_sync(void)
+{
+    struct epoll_event ev;
+    int fd;
+
+    for (int i = 0; i < svc_max_pollfd; i++) {
+        fd = svc_pollfd[i].fd;
+        if (fd < 0)
+            continue;
+
+        /* a worker owns a transport until it re-arms it */
+        ev.events = EPOLLIN;
+        if (worker_active() && !is_listen_fd(fd))
+            ev.events |= EPOLLONESHOT;
+        ev.data.fd = fd;
+
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+            errno != EEXIST)
+            logmsg(LOG_WARNING, "Unable to add fd %i to epoll set", fd);
+    }
+}
+
+/*
+ * re-enable a transport after a worker has finished with it
+ */
+static void epoll_rearm(int fd)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    /* fails harmlessly if the transport has been destroyed meanwhile */
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*
+ * continue serving a transport after a worker is done with it
+ */
+static void transport_done(int fd)
+{
+    epoll_rearm(fd);
+}
+
+/*
+ * epoll based main loop, returns if epoll is not usable
+ *
+ * Transports are watched level-triggered, since each event only serves
+ * one accept() or one svc_getreq_common() call, and whatever is left on
+ * the socket has to be reported again. With worker threads, transports
+ * other than listen fds are registered with EPOLLONESHOT, so that only
+ * one worker reads from them, and the worker re-arms them when it is
+ * done. Re-arming checks readiness again, so data that arrived
+ * meanwhile is not lost. Listen fds are served by the main loop itself
+ * and stay plain level-triggered. Housekeeping runs from a timer
+ * instead of once per loop iteration.
+ *
+ * with worker threads, TCP connections are accepted and served by the
+ * connection transport in conn.c instead of libtirpc, so that requests
+ * pipelined on one connection run concurrently. UDP datagrams are
+ * received and answered in batches by udp.c.
+ */
+static void unfs3_epoll_run(void)
+{
+    struct epoll_event ev, events[64];
+    struct itimerspec its;
+    uint64_t expirations;
+    int timer_fd, aio_fd, conn_fd, r, fd;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1)
+        return;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+        return;
+    }
+
+    memset(&its, 0, sizeof(its));
+    its.it_interval.tv_sec = 1;
+    its.it_value.tv_sec = 1;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    aio_fd = aio_init();
+    if (aio_fd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.fd = aio_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, aio_fd, &ev);
+    }
+
+    conn_fd = conn_init(epoll_fd, dispatch_request);
+    if (conn_fd != -1) {
+        ev.events = EPOLLIN;
+        ev.data.fd = conn_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_fd, &ev);
+        udp_init(epoll_fd);
+    }
+
+    if (signal_pipe[0] != -1) {
+        ev.events = EPOLLIN;
+        ev.data.fd = signal_pipe[0];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_pipe[0], &ev);
+    }
+
+    worker_init(transport_done);
+    epoll_sync();
+
+    for (;;) {
+        daemon_signals();
+
+        r = epoll_wait(epoll_fd, events, 64, -1);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("unfs3_svc_run: epoll_wait failed");
+            return;
+        }
+
+        for (int i = 0; i < r; i++) {
+            fd = events[i].data.fd;
+
+            if (fd == signal_pipe[0])
+                daemon_signals();
+            else if (fd == timer_fd) {
+                if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    worker_lock();
+                    fd_cache_close_inactive();
+                    fh_cache_checkpoint(FALSE);
+                    worker_unlock();
+                }
+            } else if (fd == aio_fd)
+                aio_complete();
+            else if (fd == conn_fd)
+                conn_resume();
+            else if (is_listen_fd(fd)) {
+                if (conn_fd != -1)
+                    conn_accept(fd);
+                else {
+                    svc_getreq_common(fd);
+                    epoll_sync();
+                }
+            } else if (conn_event(fd) || udp_event(fd))
+                continue;
+            else if (worker_active())
+                worker_submit(fd);
+            else
+                svc_getreq_common(fd);
+        }
+    }
+}
+#endif				       /* UNFS3_EPOLL */
+
 /* Run RPC service. This is our own implementation of svc_run(), which
    allows us to handle other events as well. */
 static void unfs3_svc_run(void)
 {
 #if defined(HAVE_SVC_GETREQ_POLL) && HAVE_DECL_SVC_POLLFD
-    int r;
+    int r, n;
     struct pollfd *pollfds = NULL;
     int pollfds_len = 0;
 #else
@@ -1043,34 +1459,82 @@ static void unfs3_svc_run(void)
     struct timeval tv;
 #endif
 
+    resolve_init();
+
+#ifdef UNFS3_EPOLL
+    unfs3_epoll_run();
+    if (epoll_fd != -1)
+        return;
+#endif
+
+    worker_init(NULL);
+
     for (;;) {
+        daemon_signals();
+
+        worker_lock();
         fd_cache_close_inactive();
+        fh_cache_checkpoint(FALSE);
+        worker_unlock();
 
 #if defined(HAVE_SVC_GETREQ_POLL) && HAVE_DECL_SVC_POLLFD
-        if (pollfds_len != svc_max_pollfd) {
-            pollfds = realloc(pollfds, sizeof(struct pollfd) * svc_max_pollfd);
+        /* extra slots for the worker wakeup and signal pipes */
+        if (pollfds_len != svc_max_pollfd + 2) {
+            pollfds = realloc(pollfds,
+                              sizeof(struct pollfd) * (svc_max_pollfd + 2));
             if (pollfds == NULL) {
                 perror("unfs3_svc_run: realloc failed");
                 return;
             }
-            pollfds_len = svc_max_pollfd;
+            pollfds_len = svc_max_pollfd + 2;
         }
 
-        for (int i = 0; i < svc_max_pollfd; i++) {
+        n = svc_max_pollfd;
+        for (int i = 0; i < n; i++) {
             pollfds[i].fd = svc_pollfd[i].fd;
             pollfds[i].events = svc_pollfd[i].events;
             pollfds[i].revents = 0;
+
+            /* leave transports alone while a worker reads from them */
+            if (worker_busy(pollfds[i].fd))
+                pollfds[i].fd = -1;
+        }
+        if (worker_active()) {
+            pollfds[n].fd = worker_wakeup_fd();
+            pollfds[n].events = POLLIN;
+            pollfds[n].revents = 0;
+            n++;
         }
+        pollfds[n].fd = signal_pipe[0];
+        pollfds[n].events = POLLIN;
+        pollfds[n].revents = 0;
+        n++;
 
-        r = poll(pollfds, svc_max_pollfd, 2*1000);
+        r = poll(pollfds, n, 2*1000);
         if (r < 0) {
             if (errno == EINTR) {
                 continue;
             }
             perror("unfs3_svc_run: poll failed");
             return;
-        } else if (r)
+        } else if (r && !worker_active())
             svc_getreq_poll(pollfds, r);
+        else if (r) {
+            for (int i = 0; i < n; i++) {
+                if (pollfds[i].fd < 0 || pollfds[i].revents == 0)
+                    continue;
+                if (pollfds[i].fd == worker_wakeup_fd())
+                    worker_wakeup_drain();
+                else if (pollfds[i].fd == signal_pipe[0])
+                    continue;
+                else if (pollfds[i].revents & POLLNVAL)
+                    continue;
+                else if (is_listen_fd(pollfds[i].fd))
+                    svc_getreq_common(pollfds[i].fd);
+                else
+                    worker_submit(pollfds[i].fd);
+            }
+        }
 
 #else
         readfds = svc_fdset;
@@ -1139,10 +1603,6 @@ int main(int argc, char **argv)
     register SVCXPRT *tcptransp = NULL, *udptransp = NULL;
     pid_t pid = 0;
 
-#ifndef WIN32
-    struct sigaction act;
-    sigset_t actset;
-#endif				       /* WIN32 */
     int res;
 
     int pipefd[2];
@@ -1235,21 +1695,7 @@ int main(int argc, char **argv)
 
     if (!opt_detach || pid == 0) {
 #ifndef WIN32
-        sigemptyset(&actset);
-        act.sa_handler = daemon_exit;
-        act.sa_mask = actset;
-        act.sa_flags = 0;
-        sigaction(SIGHUP, &act, NULL);
-        sigaction(SIGTERM, &act, NULL);
-        sigaction(SIGINT, &act, NULL);
-        sigaction(SIGQUIT, &act, NULL);
-        sigaction(SIGSEGV, &act, NULL);
-        sigaction(SIGUSR1, &act, NULL);
-
-        act.sa_handler = SIG_IGN;
-        sigaction(SIGPIPE, &act, NULL);
-        sigaction(SIGUSR2, &act, NULL);
-        sigaction(SIGALRM, &act, NULL);
+        daemon_signal_init();
 
         /* don't make directory we started in busy */
         if(chdir("/") < 0) {
@@ -1276,6 +1722,7 @@ int main(int argc, char **argv)
         fh_cache_init();
         fd_cache_init();
         get_squash_ids();
+        fh_kernel_init();
         exports_parse();
 
         if (opt_detach) {
@@ -26,10 +26,11 @@ void logmsg(int, const char *, ...);
 
 /* remote address */
 int get_remote(struct svc_req *, struct in6_addr *);
+int get_remote_addr(const struct sockaddr *, struct in6_addr *);
 short get_port(struct svc_req *);
 int get_socket_type(struct svc_req *rqstp);
 
-/* write verifier */
+/* boot write verifier, see fd_verifier() for the one of a file */
 extern writeverf3 wverf;
 void regenerate_write_verifier(void);
 
@@ -0,0 +1,297 @@
+
+/*
+ * UNFS3 duplicate request cache
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "drc.h"
+
+/*
+ * intention of the duplicate request cache
+ *
+ * a client that does not get a reply in time sends its request again,
+ * with the same XID. For requests that change the filesystem, serving
+ * the retransmission is not only wasted work, it also fails: a second
+ * REMOVE finds nothing to remove and a second CREATE finds the file
+ * already there.
+ *
+ * so the transports remember these requests by client address, XID,
+ * procedure and a checksum of the arguments. A retransmission of a
+ * request that is still being served is dropped, one of a request that
+ * has been answered gets the same reply again. The client address does
+ * not include the port, as a TCP client retransmits on a new
+ * connection. The least recently used of DRC_SIZE entries is reused.
+ */
+
+#ifdef UNFS3_DRC
+
+#define DRC_HASH_SIZE	1024
+
+struct drc_entry {
+    int used;
+    int busy;			/* request still in progress */
+    struct in6_addr addr;
+    uint32 xid;
+    uint32 proc;
+    uint32 csum;
+    char *reply;		/* encoded reply */
+    size_t len;
+    struct drc_entry *hnext;	/* in hash table */
+    struct drc_entry *prev;	/* in LRU list */
+    struct drc_entry *next;
+};
+
+static pthread_mutex_t drc_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static drc_entry entries[DRC_SIZE];
+static drc_entry *table[DRC_HASH_SIZE];
+
+/* most recently used first */
+static drc_entry *lru_first = NULL;
+static drc_entry *lru_last = NULL;
+
+/*
+ * check whether a procedure changes the filesystem
+ */
+static int drc_wanted(struct rpc_msg *msg)
+{
+    if (msg->rm_call.cb_prog != NFS3_PROGRAM ||
+        msg->rm_call.cb_vers != NFS_V3)
+        return FALSE;
+
+    switch (msg->rm_call.cb_proc) {
+        case NFSPROC3_SETATTR:
+        case NFSPROC3_WRITE:
+        case NFSPROC3_CREATE:
+        case NFSPROC3_MKDIR:
+        case NFSPROC3_SYMLINK:
+        case NFSPROC3_MKNOD:
+        case NFSPROC3_REMOVE:
+        case NFSPROC3_RMDIR:
+        case NFSPROC3_RENAME:
+        case NFSPROC3_LINK:
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+/*
+ * FNV-1a over the start of the arguments and their length
+ */
+static uint32 drc_csum(const char *args, size_t len)
+{
+    uint32 h = 0x811c9dc5;
+    size_t i, n = len < DRC_CSUM_BYTES ? len : DRC_CSUM_BYTES;
+
+    for (i = 0; i < n; i++)
+        h = (h ^ (unsigned char) args[i]) * 0x01000193;
+    for (i = 0; i < sizeof(len); i++)
+        h = (h ^ ((len >> (8 * i)) & 0xff)) * 0x01000193;
+
+    return h;
+}
+
+static unsigned drc_hash(const struct in6_addr *addr, uint32 xid)
+{
+    const uint32 *w = (const uint32 *) addr;
+
+    return ((w[0] ^ w[1] ^ w[2] ^ w[3] ^ xid) * 2654435761U) %
+        DRC_HASH_SIZE;
+}
+
+/*
+ * the following are called with drc_mutex held
+ */
+
+static void lru_unlink(drc_entry * e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_first = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_last = e->prev;
+}
+
+static void lru_push_first(drc_entry * e)
+{
+    e->prev = NULL;
+    e->next = lru_first;
+    if (lru_first)
+        lru_first->prev = e;
+    else
+        lru_last = e;
+    lru_first = e;
+}
+
+static void lru_push_last(drc_entry * e)
+{
+    e->next = NULL;
+    e->prev = lru_last;
+    if (lru_last)
+        lru_last->next = e;
+    else
+        lru_first = e;
+    lru_last = e;
+}
+
+/*
+ * put all entries into the LRU list on first use
+ */
+static void drc_setup(void)
+{
+    int i;
+
+    if (lru_first)
+        return;
+    for (i = 0; i < DRC_SIZE; i++)
+        lru_push_last(&entries[i]);
+}
+
+/*
+ * remove an entry from the hash table and make it the next to reuse
+ */
+static void drc_forget(drc_entry * e)
+{
+    drc_entry **p;
+
+    if (e->used) {
+        for (p = &table[drc_hash(&e->addr, e->xid)]; *p != e;
+             p = &(*p)->hnext);
+        *p = e->hnext;
+    }
+
+    free(e->reply);
+    e->reply = NULL;
+    e->used = FALSE;
+    e->busy = FALSE;
+
+    lru_unlink(e);
+    lru_push_last(e);
+}
+
+/*
+ * look up a request before serving it
+ *
+ * with DRC_NEW, *entry is the entry to pass to drc_end() with the reply,
+ * or NULL if the request is not cached. With DRC_REPLAY, *reply is a
+ * malloc'd copy of the reply to send.
+ */
+int drc_begin(const struct sockaddr *addr, struct rpc_msg *msg,
+              const char *args, size_t len, drc_entry ** entry,
+              char **reply, size_t *reply_len)
+{
+    struct in6_addr addr6;
+    drc_entry *e;
+    uint32 csum;
+    unsigned h;
+    int res = DRC_NEW;
+
+    *entry = NULL;
+
+    if (!drc_wanted(msg) || get_remote_addr(addr, &addr6))
+        return DRC_NEW;
+
+    csum = drc_csum(args, len);
+    h = drc_hash(&addr6, msg->rm_xid);
+
+    pthread_mutex_lock(&drc_mutex);
+    drc_setup();
+
+    for (e = table[h]; e; e = e->hnext)
+        if (e->xid == msg->rm_xid && e->proc == msg->rm_call.cb_proc &&
+            e->csum == csum && memcmp(&e->addr, &addr6, sizeof(addr6)) == 0)
+            break;
+
+    if (e && e->busy)
+        res = DRC_BUSY;
+    else if (e) {
+        *reply = malloc(e->len);
+        if (*reply) {
+            memcpy(*reply, e->reply, e->len);
+            *reply_len = e->len;
+            res = DRC_REPLAY;
+        } else
+            res = DRC_BUSY;
+        lru_unlink(e);
+        lru_push_first(e);
+    } else {
+        /* reuse the least recently used entry that is not in progress */
+        for (e = lru_last; e && e->busy; e = e->prev);
+        if (e) {
+            drc_forget(e);
+            e->used = TRUE;
+            e->busy = TRUE;
+            e->addr = addr6;
+            e->xid = msg->rm_xid;
+            e->proc = msg->rm_call.cb_proc;
+            e->csum = csum;
+            e->hnext = table[h];
+            table[h] = e;
+            lru_unlink(e);
+            lru_push_first(e);
+            *entry = e;
+        }
+    }
+    pthread_mutex_unlock(&drc_mutex);
+
+    return res;
+}
+
+/*
+ * remember the reply of a request, or forget the request if reply is NULL
+ */
+void drc_end(drc_entry * e, const char *reply, size_t len)
+{
+    char *copy = NULL;
+
+    if (reply) {
+        copy = malloc(len);
+        if (copy)
+            memcpy(copy, reply, len);
+    }
+
+    pthread_mutex_lock(&drc_mutex);
+    if (copy) {
+        e->reply = copy;
+        e->len = len;
+        e->busy = FALSE;
+    } else
+        drc_forget(e);
+    pthread_mutex_unlock(&drc_mutex);
+}
+
+#else				       /* UNFS3_DRC */
+
+int drc_begin(U(const struct sockaddr *addr), U(struct rpc_msg *msg),
+              U(const char *args), U(size_t len), drc_entry ** entry,
+              U(char **reply), U(size_t *reply_len))
+{
+    *entry = NULL;
+    return DRC_NEW;
+}
+
+void drc_end(U(drc_entry * e), U(const char *reply), U(size_t len))
+{
+}
+
+#endif				       /* UNFS3_DRC */
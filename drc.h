@@ -0,0 +1,33 @@
+/*
+ * UNFS3 duplicate request cache
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_DRC_H
+#define UNFS3_DRC_H
+
+#include "conn.h"
+
+#ifdef UNFS3_CONN
+#define UNFS3_DRC 1
+#endif
+
+/* requests remembered */
+#define DRC_SIZE	1024
+
+/* argument bytes that go into the checksum */
+#define DRC_CSUM_BYTES	256
+
+/* results of drc_begin() */
+#define DRC_NEW		0	/* serve the request */
+#define DRC_BUSY	1	/* the original is still in progress */
+#define DRC_REPLAY	2	/* send the reply of the original */
+
+typedef struct drc_entry drc_entry;
+
+int drc_begin(const struct sockaddr *addr, struct rpc_msg *msg,
+              const char *args, size_t len, drc_entry ** entry,
+              char **reply, size_t *reply_len);
+void drc_end(drc_entry * entry, const char *reply, size_t len);
+
+#endif
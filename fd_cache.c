@@ -13,11 +13,17 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #ifndef WIN32
+#include <sys/select.h>
 #include <syslog.h>
 #include <unistd.h>
 #endif				       /* WIN32 */
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
 
 #include "nfs.h"
 #include "mount.h"
@@ -26,23 +32,58 @@
 #include "Config/exports.h"
 #include "fd_cache.h"
 #include "backend.h"
+#include "worker.h"
+#include "commit.h"
 
 /*
  * intention of the file descriptor cache
  *
  * for READ operations, the intent is to open() the file on the first
- * access and to close() it when we hit EOF or after two seconds of
- * inactivity.
+ * access and to close() it after two seconds of inactivity. Files that
+ * are read again and again, like headers during a build, keep their fd
+ * longer: each time a file is read anew, its heat goes up, and each
+ * degree of heat doubles the time its fd is kept, see fd_read_timeout().
+ * The heat of a file is remembered in a small table after its fd is
+ * closed, and halves every FD_HEAT_HALFLIFE seconds. Only half of the
+ * cache may be used by read fds kept longer than two seconds.
  *
  * for WRITE operations, the intent is to open() the file on the first
- * UNSTABLE access and to close() it when COMMIT is called or after
- * two seconds of inactivity.
+ * UNSTABLE access and to close() it after two seconds of inactivity.
+ * The ranges written since the last sync are remembered, merging them
+ * when there are more than FD_DIRTY_RANGES. A COMMIT syncs the file
+ * with fdatasync() only if it covers one of them, and keeps the fd open
+ * for the writes that follow. fdatasync() writes all of the file, so
+ * the ranges written before it started are clean afterwards; writes
+ * that come in while it runs are told apart by a sequence number.
+ *
+ * on exports with the wdelay option, UNSTABLE writes to a cached write
+ * fd are gathered in a buffer of FD_GATHER_SIZE bytes as long as they
+ * are adjacent to or overlap the data already there, and written out
+ * with one pwrite() when a write does not fit in, before the file is
+ * read, synced, truncated or its attributes are asked for, and once the
+ * gathered data is INACTIVE_TIMEOUT seconds old. A full buffer is
+ * written up to the last FD_GATHER_ALIGN boundary, keeping the rest
+ * for the writes that follow. If gathered data cannot be written, the
+ * write verifier of the file is changed, so that clients send it again.
  *
  * There are three states of an entry:
  * 1) Unused. use == 0.
  * 2) Open fd. use != 0, fd != -1.
  * 3) Pending fsync/close error, to be reported in next COMMIT or WRITE. use != 0, fd == -1.
  *
+ * Entries in use are found through one hash by filehandle and kind and
+ * another one by fd. The cache has room for as many files as the
+ * descriptor limit allows, up to FD_ENTRIES_MAX, and the limit is raised
+ * as far as permitted at startup. When it is large enough, cached
+ * descriptors are moved above FD_SETSIZE, as the RPC library ignores
+ * sockets with higher numbers.
+ *
+ * With worker threads, the server lock is dropped during read, write and
+ * fsync calls. An open entry is pinned by a busy count while a request
+ * uses its fd outside the lock, and it is not closed until the count
+ * drops to zero. An entry being closed is marked as such and is no
+ * longer handed out to new requests.
+ *
  * Handling fsync/close errors 100% correctly is very difficult for a
  * user space server. Although rare, fsync/close might fail, for
  * example when out of quota or closing a file on a NFS file
@@ -51,65 +92,245 @@
  * require runtime memory allocation, with no known upper bound, which
  * in turn can lead to DOS attacks etc. Our solution returns a
  * fsync/close error in the first WRITE or COMMIT
- * response. Additionally, the write verifier is changed. Subsequent
- * COMMITs may succeed even though data has been lost, but since the
- * verifier is changed, clients will notice this and re-send their
- * data. Eventually, with some luck, all clients will get an IO error.
+ * response. Additionally, the write verifier of the file is changed.
+ * Subsequent COMMITs may succeed even though data has been lost, but
+ * since the verifier is changed, clients will notice this and re-send
+ * their data. Eventually, with some luck, all clients will get an IO
+ * error.
+ *
+ * The verifier of a file is the one generated at startup, combined with
+ * an epoch. Files whose verifier changed have an epoch of their own in
+ * a table of FD_EPOCH_SIZE slots, all others share a base epoch. Epochs
+ * are never used twice. When a file has to take the slot of another
+ * one, the base epoch moves on, so that the file which loses its slot
+ * cannot go back to a verifier it had before.
  */
 
-/* number of entries in fd cache */
-#define FD_ENTRIES	256
+/* entries in the fd cache at least and at most */
+#define FD_ENTRIES_MIN	256
+#define FD_ENTRIES_MAX	65536
 
 /* The number of seconds to wait before closing inactive fd */
 #define INACTIVE_TIMEOUT 2
 
+/* inactive write fds synced and closed per call */
+#define FD_CLOSE_BATCH	256
+
+/* dirty ranges remembered per write fd */
+#define FD_DIRTY_RANGES	4
+
+/* bytes of writes gathered per write fd */
+#define FD_GATHER_SIZE	(512 * 1024)
+
+/* a full buffer is written up to a multiple of this */
+#define FD_GATHER_ALIGN	4096
+
+/* write fds gathering at the same time */
+#define FD_GATHER_BUFFERS 128
+
+/* files with a write verifier of their own */
+#define FD_EPOCH_SIZE	4096
+
+/* files whose heat is remembered */
+#define FD_HEAT_SIZE	4096
+
+/* seconds until the heat of a file halves */
+#define FD_HEAT_HALFLIFE 60
+
+/* highest heat that still lengthens the timeout */
+#define FD_HEAT_MAX	6
+
 /* The number of seconds to keep pending errors */
 #define PENDING_ERROR_TIMEOUT 7200     /* 2 hours */
 
+/* bytes written since the last sync */
 typedef struct {
+    uint64 start;
+    uint64 end;			/* first byte after the range */
+    uint32 seq;			/* of the last write to it */
+} fd_range_t;
+
+typedef struct fd_cache_t {
     int fd;			/* open file descriptor */
     int kind;			/* read or write */
     time_t use;			/* last use */
     uint32 dev;			/* device */
     uint64 ino;			/* inode */
     uint32 gen;			/* inode generation */
+    int busy;			/* requests using the fd */
+    int closing;		/* being synced and closed */
+    int eof;			/* read up to the end since last opened */
+    int heat;			/* times the file was read anew */
+    fd_range_t dirty[FD_DIRTY_RANGES];
+    int ndirty;
+    uint32 seq;			/* of the last write */
+    char *gather;		/* gathered writes, or NULL */
+    uint64 gstart;		/* file offset of the gathered data */
+    uint32 glen;
+    time_t gtime;		/* gathering started */
+    int gflush;			/* gathered data is being written */
+    struct fd_cache_t *hnext;	/* in hash by filehandle, or unused */
+    struct fd_cache_t *fnext;	/* in hash by fd */
+    struct fd_cache_t *prev;	/* in list of used entries */
+    struct fd_cache_t *next;
 } fd_cache_t;
 
-static fd_cache_t fd_cache[FD_ENTRIES];
+static fd_cache_t *fd_cache = NULL;
+
+/* both hashes have fd_hash_mask + 1 chains */
+static fd_cache_t **fd_hash_fh = NULL;
+static fd_cache_t **fd_hash_fd = NULL;
+static unsigned fd_hash_mask = 0;
+
+static fd_cache_t *fd_unused = NULL;
+static fd_cache_t *fd_used = NULL;
+
+/* cached descriptors are moved above FD_SETSIZE */
+static int fd_high = FALSE;
+
+/* heat of files recently read, indexed by a hash of the filehandle */
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+    uint32 gen;
+    int heat;
+    time_t stamp;		/* last change of heat */
+} fd_heat_t;
+
+static fd_heat_t fd_heat[FD_HEAT_SIZE];
+
+/* write verifier epochs of files, an unused slot has epoch 0 */
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+    uint32 gen;
+    uint32 epoch;
+} fd_epoch_t;
+
+static fd_epoch_t fd_epoch[FD_EPOCH_SIZE];
+
+static uint32 fd_epoch_base = 0;	/* of files not in the table */
+static uint32 fd_epoch_last = 0;	/* last epoch handed out */
+
+/* write fds with a gather buffer */
+static int fd_gather_buffers = 0;
 
 /* statistics */
+int fd_cache_entries = FD_ENTRIES_MIN;
 int fd_cache_readers = 0;
 int fd_cache_writers = 0;
+int fd_cache_gathered = 0;
+int fd_cache_flushes = 0;
+
+/*
+ * find the number of descriptors the process may have open, raising
+ * the limit as far as allowed
+ */
+static int fd_cache_limit(void)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rlimit rl;
+    rlim_t want = FD_ENTRIES_MAX + FD_SETSIZE;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return -1;
+
+    if (rl.rlim_cur < want) {
+        if (rl.rlim_max < want && geteuid() == 0) {
+            /* root may raise the hard limit as well */
+            rl.rlim_cur = want;
+            rl.rlim_max = want;
+            if (setrlimit(RLIMIT_NOFILE, &rl) == 0)
+                return want;
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+        rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    return rl.rlim_cur < want ? (int) rl.rlim_cur : (int) want;
+#else
+    return -1;
+#endif
+}
 
 /*
  * initialize the fd cache
  */
 void fd_cache_init(void)
 {
-    int i;
+    int i, limit;
+
+    limit = fd_cache_limit();
+
+    /*
+     * descriptor numbers below FD_SETSIZE are left to sockets, which the
+     * RPC library cannot serve above it
+     */
+    if (limit >= 2 * FD_SETSIZE) {
+        fd_high = TRUE;
+        fd_cache_entries = limit - FD_SETSIZE;
+    }
+    if (fd_cache_entries > FD_ENTRIES_MAX)
+        fd_cache_entries = FD_ENTRIES_MAX;
+
+    while (fd_hash_mask + 1 < (unsigned) fd_cache_entries)
+        fd_hash_mask = (fd_hash_mask << 1) | 1;
 
-    for (i = 0; i < FD_ENTRIES; i++) {
+    fd_cache = calloc(fd_cache_entries, sizeof(fd_cache_t));
+    fd_hash_fh = calloc(fd_hash_mask + 1, sizeof(fd_cache_t *));
+    fd_hash_fd = calloc(fd_hash_mask + 1, sizeof(fd_cache_t *));
+    if (!fd_cache || !fd_hash_fh || !fd_hash_fd) {
+        logmsg(LOG_CRIT, "Unable to allocate fd cache");
+        daemon_exit(CRISIS);
+    }
+
+    for (i = fd_cache_entries - 1; i >= 0; i--) {
         fd_cache[i].fd = -1;
         fd_cache[i].kind = UNFS3_FD_READ;
-        fd_cache[i].use = 0;
-        fd_cache[i].dev = 0;
-        fd_cache[i].ino = 0;
-        fd_cache[i].gen = 0;
+        fd_cache[i].hnext = fd_unused;
+        fd_unused = &fd_cache[i];
     }
 }
 
+static fd_cache_t **fd_chain_fh(uint32 dev, uint64 ino, uint32 gen,
+                                int kind)
+{
+    uint32 h = dev ^ (uint32) ino ^ (uint32) (ino >> 32) ^ gen ^ kind;
+
+    return &fd_hash_fh[(h * 2654435761U) & fd_hash_mask];
+}
+
+static fd_cache_t **fd_chain_fd(int fd)
+{
+    return &fd_hash_fd[((uint32) fd * 2654435761U) & fd_hash_mask];
+}
+
 /*
- * find cache index to use for new entry
- * returns an empty slot if found, else return error
+ * take an entry from the hash by fd, once its fd is closed
  */
-static int fd_cache_unused(void)
+static void fd_cache_unlink_fd(fd_cache_t * e)
 {
-    int i;
+    fd_cache_t **p;
+
+    for (p = fd_chain_fd(e->fd); *p != e; p = &(*p)->fnext);
+    *p = e->fnext;
+}
+
+/*
+ * get an unused entry
+ * returns NULL if all are in use
+ */
+static fd_cache_t *fd_cache_unused(void)
+{
+    fd_cache_t *e;
     static time_t last_warning = 0;
 
-    for (i = 0; i < FD_ENTRIES; i++) {
-        if (fd_cache[i].use == 0)
-            return i;
+    e = fd_unused;
+    if (e) {
+        fd_unused = e->hnext;
+        return e;
     }
 
     /* Do not print warning more than once per 10 second */
@@ -117,37 +338,92 @@ static int fd_cache_unused(void)
         last_warning = time(NULL);
         logmsg(LOG_INFO,
                "fd cache full due to more than %d active files or pending IO errors",
-               FD_ENTRIES);
+               fd_cache_entries);
     }
 
-    return -1;
+    return NULL;
+}
+
+static fd_epoch_t *fd_epoch_slot(uint32 dev, uint64 ino, uint32 gen)
+{
+    uint32 h = dev ^ (uint32) ino ^ (uint32) (ino >> 32) ^ gen;
+
+    return &fd_epoch[(h * 2654435761U) % FD_EPOCH_SIZE];
+}
+
+/*
+ * change the write verifier of a file whose data may have been lost
+ */
+static void fd_epoch_bump(const fd_cache_t * e)
+{
+    fd_epoch_t *t = fd_epoch_slot(e->dev, e->ino, e->gen);
+
+    if (t->epoch != 0 &&
+        (t->dev != e->dev || t->ino != e->ino || t->gen != e->gen))
+        /* the file losing its slot moves on with all others */
+        fd_epoch_base = ++fd_epoch_last;
+
+    t->dev = e->dev;
+    t->ino = e->ino;
+    t->gen = e->gen;
+    t->epoch = ++fd_epoch_last;
 }
 
 /*
+ * get the write verifier of a file
+ */
+void fd_verifier(nfs_fh3 nfh, writeverf3 verf)
+{
+    fd_epoch_t *t;
+    uint32 epoch = fd_epoch_base, v;
+    unfs3_fh_t fh = fh_decode(&nfh);
 
- * remove an entry from the cache. The keep_on_error variable
- * indicates if the entry should be kept in the cache upon
- * fsync/close failures. It should be set to TRUE when fd_cache_del is
- * called from a code path which cannot report an IO error back to the
- * client through WRITE or COMMIT.
+    t = fd_epoch_slot(fh.dev, fh.ino, fh.gen);
+    if (t->epoch != 0 && t->dev == fh.dev && t->ino == fh.ino &&
+        t->gen == fh.gen)
+        epoch = t->epoch;
+
+    memcpy(verf, wverf, NFS3_WRITEVERFSIZE);
+    memcpy(&v, verf + 4, sizeof(v));
+    v ^= epoch;
+    memcpy(verf + 4, &v, sizeof(v));
+}
+
+/*
+ * remove an entry from the cache whose fd has already been synced, res
+ * is the result of that sync. The keep_on_error variable indicates if
+ * the entry should be kept in the cache upon fsync/close
+ * failures. It should be set to TRUE when fd_cache_del is called from
+ * a code path which cannot report an IO error back to the client
+ * through WRITE or COMMIT.
  */
-static int fd_cache_del(int idx, int keep_on_error)
+static int fd_cache_remove(fd_cache_t * e, int keep_on_error, int res)
 {
+    fd_cache_t **p;
     int res1, res2;
 
     res1 = -1;
 
-    if (fd_cache[idx].fd != -1) {
-        if (fd_cache[idx].kind == UNFS3_FD_WRITE) {
-            /* sync file data if writing descriptor */
+    if (e->gather) {
+        /* gathered data that could not be written is lost */
+        if (e->glen > 0)
+            res = -1;
+        free(e->gather);
+        e->gather = NULL;
+        e->glen = 0;
+        fd_gather_buffers--;
+    }
+
+    if (e->fd != -1) {
+        if (e->kind == UNFS3_FD_WRITE)
             fd_cache_writers--;
-            res1 = backend_fsync(fd_cache[idx].fd);
-        } else {
+        else
             fd_cache_readers--;
-            res1 = 0;
-        }
-        res2 = backend_close(fd_cache[idx].fd);
-        fd_cache[idx].fd = -1;
+        res1 = res;
+        res2 = backend_close(e->fd);
+        fd_cache_unlink_fd(e);
+        e->fd = -1;
+        e->closing = FALSE;
 
         /* return -1 if something went wrong during sync or close */
         if (res1 == -1 || res2 == -1) {
@@ -160,77 +436,272 @@ static int fd_cache_del(int idx, int keep_on_error)
     if (res1 == -1 && !keep_on_error) {
         /* The verifier should not be changed until we actually report &
            remove the error */
-        regenerate_write_verifier();
+        fd_epoch_bump(e);
     }
 
     if (res1 != -1 || !keep_on_error) {
-        fd_cache[idx].fd = -1;
-        fd_cache[idx].use = 0;
-        fd_cache[idx].dev = 0;
-        fd_cache[idx].ino = 0;
-        fd_cache[idx].gen = 0;
+        for (p = fd_chain_fh(e->dev, e->ino, e->gen, e->kind); *p != e;
+             p = &(*p)->hnext);
+        *p = e->hnext;
+
+        if (e->prev)
+            e->prev->next = e->next;
+        else
+            fd_used = e->next;
+        if (e->next)
+            e->next->prev = e->prev;
+
+        e->use = 0;
+        e->dev = 0;
+        e->ino = 0;
+        e->gen = 0;
+        e->hnext = fd_unused;
+        fd_unused = e;
     }
 
     return res1;
 }
 
+/*
+ * write out the data gathered for an entry, all of it or only up to the
+ * last FD_GATHER_ALIGN boundary
+ * returns -1 if it could not be written, which changes the verifier
+ */
+static int fd_gather_flush(fd_cache_t * e, int all)
+{
+    uint64 end;
+    uint32 len, done = 0;
+    ssize_t res = 0;
+
+    /* wait for a flush by another request */
+    while (e->gflush && worker_active())
+        worker_wait();
+    if (e->gflush || e->glen == 0)
+        return 0;
+
+    len = e->glen;
+    end = (e->gstart + e->glen) & ~(uint64) (FD_GATHER_ALIGN - 1);
+    if (!all && end > e->gstart)
+        len = end - e->gstart;
+
+    /* the buffer is left alone by other requests while gflush is set */
+    e->gflush = TRUE;
+    e->busy++;
+    worker_io_begin();
+    while (done < len) {
+        res = backend_pwrite(e->fd, e->gather + done, len - done,
+                             (off64_t) (e->gstart + done));
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    worker_io_end();
+    e->busy--;
+    e->gflush = FALSE;
+    worker_wake();
+
+    fd_cache_flushes++;
+
+    if (done < len) {
+        /* the data is lost, make clients send it again */
+        e->glen = 0;
+        fd_epoch_bump(e);
+        return -1;
+    }
+
+    e->glen -= len;
+    e->gstart += len;
+    if (e->glen > 0)
+        memmove(e->gather, e->gather + len, e->glen);
+    return 0;
+}
+
+/*
+ * remove an entry from the cache, syncing a writing descriptor first
+ */
+static int fd_cache_del(fd_cache_t * e, int keep_on_error)
+{
+    int res = 0;
+
+    if (e->fd != -1 && e->kind == UNFS3_FD_WRITE) {
+        /* sync file data if writing descriptor */
+        e->closing = TRUE;
+        res = fd_gather_flush(e, TRUE);
+        worker_io_begin();
+        if (backend_fsync(e->fd) == -1)
+            res = -1;
+        worker_io_end();
+    }
+
+    return fd_cache_remove(e, keep_on_error, res);
+}
+
+/*
+ * sync a write fd for a request, grouped with the syncs of concurrent
+ * requests
+ */
+static int fd_cache_fsync(int fd, int datasync)
+{
+    int res;
+
+    worker_io_begin();
+    res = commit_group(fd, datasync);
+    worker_io_end();
+
+    return res;
+}
+
+/*
+ * sync an entry that is still in use by other requests
+ */
+static int fd_cache_sync(fd_cache_t * e, int datasync)
+{
+    int res;
+
+    if (e->kind != UNFS3_FD_WRITE)
+        return 0;
+
+    e->busy++;
+    res = fd_gather_flush(e, TRUE);
+    if (fd_cache_fsync(e->fd, datasync) == -1)
+        res = -1;
+    e->busy--;
+
+    return res;
+}
+
+/*
+ * move a descriptor about to be cached above FD_SETSIZE
+ * returns the descriptor to use
+ */
+static int fd_cache_high(int fd)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+    int high;
+
+    if (!fd_high || fd >= FD_SETSIZE)
+        return fd;
+
+    high = fcntl(fd, F_DUPFD, FD_SETSIZE);
+    if (high == -1)
+        return fd;
+
+    backend_close(fd);
+    return high;
+#else
+    return fd;
+#endif
+}
+
+/*
+ * note that a file is read anew, returns its heat
+ */
+static int fd_heat_bump(const fd_cache_t * e, time_t now)
+{
+    uint32 h = e->dev ^ (uint32) e->ino ^ (uint32) (e->ino >> 32) ^ e->gen;
+    fd_heat_t *t = &fd_heat[(h * 2654435761U) % FD_HEAT_SIZE];
+    time_t age = now - t->stamp;
+
+    if (t->dev != e->dev || t->ino != e->ino || t->gen != e->gen) {
+        /* forget whatever file was here before */
+        t->dev = e->dev;
+        t->ino = e->ino;
+        t->gen = e->gen;
+        t->heat = 0;
+    } else if (age >= FD_HEAT_HALFLIFE)
+        t->heat = age / FD_HEAT_HALFLIFE < 31 ?
+            t->heat >> (age / FD_HEAT_HALFLIFE) : 0;
+
+    if (t->heat < FD_HEAT_MAX)
+        t->heat++;
+    t->stamp = now;
+
+    return t->heat;
+}
+
+/*
+ * seconds an unused read fd is kept open
+ */
+static int fd_read_timeout(const fd_cache_t * e)
+{
+    /* heat only counts while there is room for it */
+    if (e->heat <= 1 || fd_cache_readers > fd_cache_entries / 2)
+        return INACTIVE_TIMEOUT;
+
+    return INACTIVE_TIMEOUT << (e->heat - 1);
+}
+
 /*
  * add an entry to the cache
  */
 static void fd_cache_add(int fd, unfs3_fh_t * ufh, int kind)
 {
-    int idx;
+    fd_cache_t *e, **chain;
 
-    idx = fd_cache_unused();
-    if (idx != -1) {
+    e = fd_cache_unused();
+    if (e) {
         /* update statistics */
         if (kind == UNFS3_FD_READ)
             fd_cache_readers++;
         else
             fd_cache_writers++;
 
-        fd_cache[idx].fd = fd;
-        fd_cache[idx].kind = kind;
-        fd_cache[idx].use = time(NULL);
-        fd_cache[idx].dev = ufh->dev;
-        fd_cache[idx].ino = ufh->ino;
-        fd_cache[idx].gen = ufh->gen;
+        e->fd = fd;
+        e->kind = kind;
+        e->use = time(NULL);
+        e->dev = ufh->dev;
+        e->ino = ufh->ino;
+        e->gen = ufh->gen;
+        e->busy = 1;
+        e->eof = FALSE;
+        e->heat = 0;
+        e->ndirty = 0;
+        e->glen = 0;
+        e->gflush = FALSE;
+        if (kind == UNFS3_FD_READ)
+            e->heat = fd_heat_bump(e, e->use);
+
+        chain = fd_chain_fh(e->dev, e->ino, e->gen, kind);
+        e->hnext = *chain;
+        *chain = e;
+        chain = fd_chain_fd(fd);
+        e->fnext = *chain;
+        *chain = e;
+
+        e->prev = NULL;
+        e->next = fd_used;
+        if (fd_used)
+            fd_used->prev = e;
+        fd_used = e;
     }
 }
 
 /*
  * find entry by operating system fd number
  */
-static int idx_by_fd(int fd, int kind)
+static fd_cache_t *entry_by_fd(int fd, int kind)
 {
-    int i;
-    int idx = -1;
+    fd_cache_t *e;
 
-    for (i = 0; i < FD_ENTRIES; i++)
-        if (fd_cache[i].fd == fd && fd_cache[i].kind == kind) {
-            idx = i;
+    for (e = *fd_chain_fd(fd); e; e = e->fnext)
+        if (e->fd == fd && e->kind == kind)
             break;
-        }
-    return idx;
+    return e;
 }
 
 /*
  * find entry by fh (device, inode, and generation number)
  */
-static int idx_by_fh(unfs3_fh_t * ufh, int kind)
+static fd_cache_t *entry_by_fh(unfs3_fh_t * ufh, int kind)
 {
-    int i;
-    int idx = -1;
-
-    for (i = 0; i < FD_ENTRIES; i++)
-        if (fd_cache[i].kind == kind) {
-            if (fd_cache[i].dev == ufh->dev && fd_cache[i].ino == ufh->ino &&
-                fd_cache[i].gen == ufh->gen) {
-                idx = i;
-                break;
-            }
-        }
-    return idx;
+    fd_cache_t *e;
+
+    for (e = *fd_chain_fh(ufh->dev, ufh->ino, ufh->gen, kind); e;
+         e = e->hnext)
+        if (e->kind == kind && !e->closing && e->dev == ufh->dev &&
+            e->ino == ufh->ino && e->gen == ufh->gen)
+            break;
+    return e;
 }
 
 /*
@@ -239,19 +710,33 @@ static int idx_by_fh(unfs3_fh_t * ufh, int kind)
  */
 int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
 {
-    int idx, res, fd;
+    fd_cache_t *e;
+    int res, fd;
     backend_statstruct buf;
     unfs3_fh_t fh = fh_decode(&nfh);
 
-    idx = idx_by_fh(&fh, kind);
+    /* reads have to see the writes gathered so far */
+    if (kind == UNFS3_FD_READ && fd_gather_buffers > 0) {
+        e = entry_by_fh(&fh, UNFS3_FD_WRITE);
+        if (e && e->fd != -1)
+            fd_gather_flush(e, TRUE);
+    }
+
+    e = entry_by_fh(&fh, kind);
 
-    if (idx != -1) {
-        if (fd_cache[idx].fd == -1) {
+    if (e) {
+        if (e->fd == -1) {
             /* pending error, report to client and remove from cache */
-            fd_cache_del(idx, FALSE);
+            fd_cache_del(e, FALSE);
             return -1;
         }
-        return fd_cache[idx].fd;
+        if (e->eof) {
+            /* read again after it was read to the end */
+            e->eof = FALSE;
+            e->heat = fd_heat_bump(e, time(NULL));
+        }
+        e->busy++;
+        return e->fd;
     } else {
         /* call open to obtain new fd */
         if (kind == UNFS3_FD_READ)
@@ -282,8 +767,10 @@ int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
         /*
          * success, add to cache for later use
          */
-        if (allow_caching)
+        if (allow_caching) {
+            fd = fd_cache_high(fd);
             fd_cache_add(fd, &fh, kind);
+        }
         return fd;
     }
 }
@@ -294,22 +781,39 @@ int fd_open(const char *path, nfs_fh3 nfh, int kind, int allow_caching)
  */
 int fd_close(int fd, int kind, int really_close)
 {
-    int idx, res1 = 0, res2 = 0;
+    fd_cache_t *e;
+    int datasync, res1 = 0, res2 = 0;
 
-    idx = idx_by_fd(fd, kind);
-    if (idx != -1) {
+    e = entry_by_fd(fd, kind);
+    if (e) {
         /* update usage time of cache entry */
-        fd_cache[idx].use = time(NULL);
+        e->use = time(NULL);
+        e->busy--;
+
+        if (really_close == FD_CLOSE_EOF) {
+            /* kept for the next time the file is read */
+            e->eof = TRUE;
+            return 0;
+        } else if (really_close != FD_CLOSE_VIRT) {
+            datasync = (really_close == FD_CLOSE_DSYNC);
+            if (e->busy > 0)
+                /* still used by other requests, just sync */
+                return fd_cache_sync(e, datasync);
 
-        if (really_close == FD_CLOSE_REAL)
             /* delete entry on real close, will close() fd */
-            return fd_cache_del(idx, FALSE);
-        else
+            if (e->kind == UNFS3_FD_WRITE) {
+                e->closing = TRUE;
+                res1 = fd_gather_flush(e, TRUE);
+                if (fd_cache_fsync(e->fd, datasync) == -1)
+                    res1 = -1;
+            }
+            return fd_cache_remove(e, FALSE, res1);
+        } else
             return 0;
     } else {
         /* not in cache, sync and close directly */
         if (kind == UNFS3_FD_WRITE)
-            res1 = backend_fsync(fd);
+            res1 = fd_cache_fsync(fd, really_close == FD_CLOSE_DSYNC);
 
         res2 = backend_close(fd);
 
@@ -321,19 +825,317 @@ int fd_close(int fd, int kind, int really_close)
 }
 
 /*
- * sync file descriptor data to disk
+ * gather a write in the buffer of an entry
+ * returns FALSE if it has to be written directly
+ */
+static int fd_gather_add(fd_cache_t * e, const char *data, uint32 count,
+                         uint64 offset, int *res)
+{
+    uint64 start, end = offset + count, gend;
+
+    *res = 0;
+    if (!e->gather) {
+        if (fd_gather_buffers >= FD_GATHER_BUFFERS)
+            return FALSE;
+        e->gather = malloc(FD_GATHER_SIZE);
+        if (!e->gather)
+            return FALSE;
+        fd_gather_buffers++;
+        e->glen = 0;
+    }
+
+    for (;;) {
+        /* the buffer is written out without the server lock */
+        if (e->gflush && worker_active()) {
+            worker_wait();
+            continue;
+        }
+
+        if (e->glen == 0) {
+            e->gstart = offset;
+            e->gtime = time(NULL);
+        }
+        gend = e->gstart + e->glen;
+
+        /* only adjacent or overlapping writes are merged */
+        if (offset > gend || end < e->gstart) {
+            if (fd_gather_flush(e, TRUE) == -1)
+                *res = -1;
+            continue;
+        }
+
+        start = offset < e->gstart ? offset : e->gstart;
+        if ((end > gend ? end : gend) - start <= FD_GATHER_SIZE)
+            break;
+
+        /* make room, writing the full blocks gathered so far */
+        if (e->glen == 0)
+            return FALSE;
+        if (fd_gather_flush(e, FALSE) == -1)
+            *res = -1;
+    }
+
+    if (offset < e->gstart) {
+        memmove(e->gather + (e->gstart - offset), e->gather, e->glen);
+        e->glen += e->gstart - offset;
+        e->gstart = offset;
+    }
+    memcpy(e->gather + (offset - e->gstart), data, count);
+    if (end > e->gstart + e->glen)
+        e->glen = end - e->gstart;
+
+    fd_cache_gathered++;
+    return TRUE;
+}
+
+/*
+ * write to a file descriptor from fd_open(), gathering the write with
+ * those before it if asked to
+ * returns like pwrite()
+ */
+int fd_write(int fd, const char *data, uint32 count, uint64 offset,
+             int gather)
+{
+    fd_cache_t *e;
+    int res = 0;
+
+    e = entry_by_fd(fd, UNFS3_FD_WRITE);
+    if (e && count > 0) {
+        if (gather && fd_gather_add(e, data, count, offset, &res)) {
+            if (res == -1)
+                /* an earlier write could not be written */
+                errno = EIO;
+            return res == -1 ? -1 : (int) count;
+        }
+
+        /* earlier writes go first */
+        if (e->glen > 0 && fd_gather_flush(e, TRUE) == -1) {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    worker_io_begin();
+    res = backend_pwrite(fd, data, count, (off64_t) offset);
+    worker_io_end();
+
+    return res;
+}
+
+/*
+ * write out the writes gathered for a file
+ * returns TRUE if there were any
+ */
+int fd_flush(nfs_fh3 nfh)
+{
+    fd_cache_t *e;
+    unfs3_fh_t fh;
+
+    if (fd_gather_buffers == 0)
+        return FALSE;
+
+    fh = fh_decode(&nfh);
+    e = entry_by_fh(&fh, UNFS3_FD_WRITE);
+    if (!e || e->fd == -1 || (e->glen == 0 && !e->gflush))
+        return FALSE;
+
+    fd_gather_flush(e, TRUE);
+    return TRUE;
+}
+
+/*
+ * remember that a cached write fd has written a range
+ */
+void fd_dirty(int fd, uint64 offset, uint32 count)
+{
+    fd_cache_t *e;
+    fd_range_t *r, *best = NULL;
+    uint64 end = offset + count, gap, best_gap = 0;
+    int i;
+
+    e = entry_by_fd(fd, UNFS3_FD_WRITE);
+    if (!e || count == 0)
+        return;
+
+    e->seq++;
+
+    /* extend a range it touches, or the nearest one if all are used */
+    for (i = 0; i < e->ndirty; i++) {
+        r = &e->dirty[i];
+        gap = offset > r->end ? offset - r->end :
+            r->start > end ? r->start - end : 0;
+        if (!best || gap < best_gap) {
+            best = r;
+            best_gap = gap;
+        }
+    }
+
+    if (!best || (best_gap > 0 && e->ndirty < FD_DIRTY_RANGES)) {
+        r = &e->dirty[e->ndirty++];
+        r->start = offset;
+        r->end = end;
+        r->seq = e->seq;
+        return;
+    }
+
+    if (offset < best->start)
+        best->start = offset;
+    if (end > best->end)
+        best->end = end;
+    best->seq = e->seq;
+}
+
+/*
+ * check whether a COMMIT of the given range has anything to sync
+ */
+static int fd_cache_dirty(fd_cache_t * e, uint64 offset, uint32 count)
+{
+    uint64 end = count ? offset + count : ~(uint64) 0;
+    int i;
+
+    for (i = 0; i < e->ndirty; i++)
+        if (e->dirty[i].start < end && e->dirty[i].end > offset)
+            return TRUE;
+    return FALSE;
+}
+
+/*
+ * forget the ranges written before a sync that succeeded
+ */
+static void fd_cache_clean(fd_cache_t * e, uint32 seq)
+{
+    int i;
+
+    for (i = 0; i < e->ndirty;)
+        if ((int32) (e->dirty[i].seq - seq) <= 0)
+            e->dirty[i] = e->dirty[--e->ndirty];
+        else
+            i++;
+}
+
+/*
+ * account for the result of an fdatasync() that started at seq
  */
-int fd_sync(nfs_fh3 nfh)
+static int fd_synced(fd_cache_t * e, uint32 seq, int res)
 {
-    int idx;
+    if (res != -1) {
+        fd_cache_clean(e, seq);
+        return 0;
+    }
+
+    /* the data may be lost, make clients send it again */
+    if (e->busy == 0 && !e->closing)
+        return fd_cache_remove(e, FALSE, -1);
+    fd_epoch_bump(e);
+    return -1;
+}
+
+/*
+ * sync file descriptor data to disk for a COMMIT of the given range
+ */
+int fd_sync(nfs_fh3 nfh, uint64 offset, uint32 count)
+{
+    fd_cache_t *e;
+    uint32 seq;
+    int res;
     unfs3_fh_t fh = fh_decode(&nfh);
 
-    idx = idx_by_fh(&fh, UNFS3_FD_WRITE);
-    if (idx != -1)
-        /* delete entry, will fsync() and close() the fd */
-        return fd_cache_del(idx, FALSE);
-    else
+    e = entry_by_fh(&fh, UNFS3_FD_WRITE);
+    if (!e)
         return 0;
+    if (e->fd == -1)
+        /* pending error, report to client and remove from cache */
+        return fd_cache_del(e, FALSE);
+    if (!fd_cache_dirty(e, offset, count))
+        return 0;
+
+    seq = e->seq;
+    e->busy++;
+    res = fd_gather_flush(e, TRUE);
+    if (res != -1)
+        res = fd_cache_fsync(e->fd, TRUE);
+    e->busy--;
+
+    return fd_synced(e, seq, res);
+}
+
+/*
+ * get the file descriptor a COMMIT of the given range has to sync with
+ * fdatasync(), pinned like one returned by fd_open(), and the sequence
+ * number to pass to fd_close_datasynced(). Returns -1 if there is
+ * nothing to sync asynchronously, fd_sync() takes care of that case.
+ */
+int fd_sync_open(nfs_fh3 nfh, uint64 offset, uint32 count, uint32 * seq)
+{
+    fd_cache_t *e;
+    unfs3_fh_t fh = fh_decode(&nfh);
+
+    e = entry_by_fh(&fh, UNFS3_FD_WRITE);
+    if (!e || e->fd == -1 || !fd_cache_dirty(e, offset, count))
+        return -1;
+
+    *seq = e->seq;
+    e->busy++;
+    if (fd_gather_flush(e, TRUE) == -1) {
+        e->busy--;
+        return -1;
+    }
+    return e->fd;
+}
+
+/*
+ * release a file descriptor from fd_sync_open() once it has been synced
+ * res is the result of that sync
+ */
+int fd_close_datasynced(int fd, uint32 seq, int res)
+{
+    fd_cache_t *e;
+
+    e = entry_by_fd(fd, UNFS3_FD_WRITE);
+    if (!e) {
+        backend_close(fd);
+        return res;
+    }
+
+    e->use = time(NULL);
+    e->busy--;
+    return fd_synced(e, seq, res);
+}
+
+/*
+ * really close a file descriptor whose data the caller has synced
+ * res is the result of that sync
+ */
+int fd_close_synced(int fd, int kind, int res)
+{
+    fd_cache_t *e;
+    int res2;
+
+    e = entry_by_fd(fd, kind);
+    if (e) {
+        e->use = time(NULL);
+        e->busy--;
+
+        /* still used by other requests, keep it open */
+        if (e->busy > 0)
+            return res;
+
+        /* writes gathered while the caller synced */
+        if (e->glen > 0 || e->gflush) {
+            e->closing = TRUE;
+            if (fd_cache_sync(e, FALSE) == -1)
+                res = -1;
+        }
+
+        return fd_cache_remove(e, FALSE, res);
+    } else {
+        res2 = backend_close(fd);
+
+        if (res != 0)
+            return res;
+        else
+            return res2;
+    }
 }
 
 /*
@@ -341,15 +1143,16 @@ int fd_sync(nfs_fh3 nfh)
  */
 void fd_cache_purge(void)
 {
-    int i;
+    fd_cache_t *e, *next;
 
     /* close any open file descriptors we still have */
-    for (i = 0; i < FD_ENTRIES; i++) {
-        if (fd_cache[i].use != 0) {
-            if (fd_cache_del(i, TRUE) == -1)
+    for (e = fd_used; e; e = next) {
+        next = e->next;
+        if (!e->closing) {
+            if (fd_cache_del(e, TRUE) == -1)
                 logmsg(LOG_CRIT,
                        "Error during shutdown fsync/close for dev %lu, inode %lu",
-                       fd_cache[i].dev, fd_cache[i].ino);
+                       e->dev, e->ino);
 
         }
     }
@@ -360,39 +1163,75 @@ void fd_cache_purge(void)
  */
 void fd_cache_close_inactive(void)
 {
+    static fd_cache_t *batch[FD_CLOSE_BATCH];
+    static int res[FD_CLOSE_BATCH];
+    fd_cache_t *e, *next;
     time_t now;
-    int i;
     int found_error = 0;
     int active_error = 0;
+    int i, n = 0;
 
     now = time(NULL);
-    for (i = 0; i < FD_ENTRIES; i++) {
+
+    /* the walk keeps the server lock, write fds are only pinned here and
+       synced below, those beyond FD_CLOSE_BATCH wait for the next call */
+    for (e = fd_used; e; e = next) {
+        next = e->next;
+
         /* Check for inactive open fds */
-        if (fd_cache[i].use && fd_cache[i].fd != -1 &&
-            fd_cache[i].use + INACTIVE_TIMEOUT < now) {
-            fd_cache_del(i, TRUE);
+        if (e->fd != -1 && e->busy == 0 && !e->closing &&
+            e->use + (e->kind == UNFS3_FD_READ ?
+                      fd_read_timeout(e) : INACTIVE_TIMEOUT) < now) {
+            if (e->kind == UNFS3_FD_READ)
+                fd_cache_del(e, TRUE);
+            else if (n < FD_CLOSE_BATCH) {
+                e->closing = TRUE;
+                e->busy++;
+                batch[n++] = e;
+            }
+        } else if (e->fd != -1 && e->glen > 0 && !e->closing &&
+                   e->gtime + INACTIVE_TIMEOUT < now && n < FD_CLOSE_BATCH) {
+            /* write out gathered data that has waited long enough */
+            e->busy++;
+            batch[n++] = e;
         }
 
         /* Check for inactive pending errors */
-        if (fd_cache[i].use && fd_cache[i].fd == -1) {
+        if (e->use && e->fd == -1) {
             found_error = 1;
-            if (fd_cache[i].use + PENDING_ERROR_TIMEOUT > now)
+            if (e->use + PENDING_ERROR_TIMEOUT > now)
                 active_error = 1;
         }
     }
 
+    for (i = 0; i < n; i++)
+        res[i] = fd_gather_flush(batch[i], TRUE);
+
+    /* one pass without the server lock for all syncs */
+    worker_io_begin();
+    for (i = 0; i < n; i++)
+        if (batch[i]->closing && backend_fsync(batch[i]->fd) == -1)
+            res[i] = -1;
+    worker_io_end();
+
+    for (i = 0; i < n; i++) {
+        batch[i]->busy--;
+        if (batch[i]->closing)
+            fd_cache_remove(batch[i], TRUE, res[i]);
+    }
+
     if (found_error && !active_error) {
-        /* All pending errors are old. Delete them all from the table and
-           generate new verifier. This is done to prevent the table from
-           filling up with old pending errors, perhaps for files that never
-           will be written again. In this case, we throw away the errors, and
-           change the server verifier. If clients has pending COMMITs, they
-           will notify the changed verifier and re-send. */
-        for (i = 0; i < FD_ENTRIES; i++) {
-            if (fd_cache[i].use && fd_cache[i].fd == -1) {
-                fd_cache_del(i, FALSE);
+        /* All pending errors are old. Delete them all from the table,
+           which changes the verifiers of their files. This is done to
+           prevent the table from filling up with old pending errors,
+           perhaps for files that never will be written again. In this
+           case, we throw away the errors. If clients has pending COMMITs,
+           they will notify the changed verifier and re-send. */
+        for (e = fd_used; e; e = next) {
+            next = e->next;
+            if (e->fd == -1) {
+                fd_cache_del(e, FALSE);
             }
         }
-        regenerate_write_verifier();
     }
 }
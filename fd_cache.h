@@ -13,16 +13,29 @@
 
 #define FD_CLOSE_VIRT 0		/* virtually close the fd */
 #define FD_CLOSE_REAL 1		/* really close the fd */
+#define FD_CLOSE_EOF  2		/* read up to the end, close when idle */
+#define FD_CLOSE_DSYNC 3		/* really close, syncing only the data */
 
 /* statistics */
+extern int fd_cache_entries;
 extern int fd_cache_readers;
 extern int fd_cache_writers;
+extern int fd_cache_gathered;
+extern int fd_cache_flushes;
 
 void fd_cache_init(void);
 
 int fd_open(const char *path, nfs_fh3 fh, int kind, int allow_caching);
 int fd_close(int fd, int kind, int really_close);
-int fd_sync(nfs_fh3 nfh);
+int fd_write(int fd, const char *data, uint32 count, uint64 offset,
+             int gather);
+int fd_flush(nfs_fh3 nfh);
+void fd_verifier(nfs_fh3 nfh, writeverf3 verf);
+void fd_dirty(int fd, uint64 offset, uint32 count);
+int fd_sync(nfs_fh3 nfh, uint64 offset, uint32 count);
+int fd_sync_open(nfs_fh3 nfh, uint64 offset, uint32 count, uint32 * seq);
+int fd_close_datasynced(int fd, uint32 seq, int res);
+int fd_close_synced(int fd, int kind, int res);
 void fd_cache_purge(void);
 void fd_cache_close_inactive(void);
 
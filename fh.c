@@ -21,6 +21,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <assert.h>
+#include <errno.h>
 
 #if HAVE_LINUX_EXT2_FS_H == 1
 
@@ -38,6 +39,9 @@
 #include "fh.h"
 #include "attr.h"
 #include "backend.h"
+#include "user.h"
+#include "search.h"
+#include "locate.h"
 #include "Config/exports.h"
 
 /*
@@ -48,8 +52,8 @@
 /*
  * stat cache
  */
-int st_cache_valid = FALSE;
-backend_statstruct st_cache;
+UNFS3_TLS int st_cache_valid = FALSE;
+UNFS3_TLS backend_statstruct st_cache;
 
 /*
  * --------------------------------
@@ -81,10 +85,9 @@ uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
     if (!S_ISREG(obuf.st_mode) && !S_ISDIR(obuf.st_mode))
         return 0;
 
-    euid = backend_geteuid();
-    egid = backend_getegid();
-    backend_setegid(0);
-    backend_seteuid(0);
+    euid = get_euid();
+    egid = get_egid();
+    switch_to_root();
 
     if (fd != FD_NONE) {
         res = ioctl(fd, EXT2_IOC_GETVERSION, &gen);
@@ -103,13 +106,7 @@ uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
         }
     }
 
-    backend_setegid(egid);
-    backend_seteuid(euid);
-
-    if (backend_geteuid() != euid || backend_getegid() != egid) {
-        logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
-        daemon_exit(CRISIS);
-    }
+    switch_ids(euid, egid);
 
     return gen;
 #endif
@@ -119,6 +116,405 @@ uint32 get_gen(backend_statstruct obuf, U(int fd), U(const char *path))
 #endif
 }
 
+/*
+ * ---------------------
+ * KERNEL FILE HANDLES
+ * ---------------------
+ */
+
+/*
+ * with -K, filehandles carry a file handle of the kernel instead of
+ * hashes of the inode numbers along the path, see name_to_handle_at(2).
+ * open_by_handle_at() finds the object again without searching, at any
+ * depth, but needs CAP_DAC_READ_SEARCH.
+ *
+ * the kernel can always tell the path of a directory opened this way,
+ * but a file may come back without one when it is not in the dentry
+ * cache. So files also carry the handle of their directory if there is
+ * room, which is read to find their name. A file that has been moved
+ * elsewhere meanwhile is searched for below its export point, which is
+ * left to the resolver if there is one. Only exported filesystems are
+ * used, so that handles still work after a restart.
+ */
+
+/* use kernel file handles, set with -K */
+int opt_kernel_fh = FALSE;
+
+/* directory entries fh_rec may still examine, -1 for no limit */
+static UNFS3_TLS int fh_rec_budget = -1;
+
+#ifdef UNFS3_KERNEL_FH
+
+/* filesystems we have opened an export point on */
+#define FH_MOUNTS 32
+
+/*
+ * entries are only appended, with the server lock held, and never
+ * change once fh_mounts_len covers them, so the resolver can look them
+ * up without the lock
+ */
+static struct {
+    uint32 dev;
+    int fd;
+    char *path;
+} fh_mounts[FH_MOUNTS];
+static int fh_mounts_len = 0;
+
+/* filesystems that are not exported, forgotten on reload */
+static uint32 fh_unexported[FH_MOUNTS];
+static int fh_unexported_len = 0;
+
+typedef union {
+    struct file_handle fh;
+    char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+} fh_kernel_t;
+
+/*
+ * check whether kernel file handles can be used
+ */
+void fh_kernel_init(void)
+{
+    fh_kernel_t h;
+    int mnt, root, fd = -1;
+
+    if (!opt_kernel_fh)
+        return;
+
+    h.fh.handle_bytes = MAX_HANDLE_SZ;
+    root = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root != -1 && name_to_handle_at(AT_FDCWD, "/", &h.fh, &mnt, 0) == 0)
+        fd = open_by_handle_at(root, &h.fh, O_RDONLY | O_DIRECTORY |
+                               O_CLOEXEC);
+
+    if (fd == -1) {
+        logmsg(LOG_WARNING, "Unable to use kernel filehandles: %s",
+               strerror(errno));
+        opt_kernel_fh = FALSE;
+    } else
+        close(fd);
+    if (root != -1)
+        close(root);
+}
+
+/*
+ * find the export point opened for a filesystem
+ * returns its index in fh_mounts, or -1
+ */
+static int fh_kernel_find(uint32 dev)
+{
+    int i, len;
+
+    len = __atomic_load_n(&fh_mounts_len, __ATOMIC_ACQUIRE);
+    for (i = 0; i < len; i++)
+        if (fh_mounts[i].dev == dev)
+            return i;
+
+    return -1;
+}
+
+/*
+ * open an export point for open_by_handle_at()
+ * called with the server lock held
+ */
+static int fh_kernel_add(uint32 dev, const char *path)
+{
+    char *copy;
+    int i, fd;
+
+    i = fh_kernel_find(dev);
+    if (i != -1 || fh_mounts_len == FH_MOUNTS)
+        return i;
+
+    fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    copy = strdup(path);
+    if (!copy) {
+        close(fd);
+        return -1;
+    }
+
+    i = fh_mounts_len;
+    fh_mounts[i].dev = dev;
+    fh_mounts[i].fd = fd;
+    fh_mounts[i].path = copy;
+    __atomic_store_n(&fh_mounts_len, i + 1, __ATOMIC_RELEASE);
+
+    return i;
+}
+
+/*
+ * open the export points of a new export list
+ * called by exports_parse() with the server lock held
+ */
+void fh_kernel_exports(struct exportnode *list)
+{
+    backend_statstruct buf;
+
+    if (!opt_kernel_fh)
+        return;
+
+    /* filesystems may be exported now */
+    fh_unexported_len = 0;
+
+    for (; list; list = list->ex_next)
+        if (backend_stat(list->ex_dir, &buf) != -1)
+            fh_kernel_add(buf.st_dev, list->ex_dir);
+}
+
+/*
+ * get the export point of a filesystem for a new filehandle
+ * called with the server lock held
+ */
+static int fh_kernel_mount(uint32 dev)
+{
+    char *path;
+    int i;
+
+    i = fh_kernel_find(dev);
+    if (i != -1)
+        return i;
+
+    for (i = 0; i < fh_unexported_len; i++)
+        if (fh_unexported[i] == dev)
+            return -1;
+
+    /* the export point may not have existed at the last reload */
+    path = export_point_from_dev(dev);
+    i = path ? fh_kernel_add(dev, path) : -1;
+
+    if (i == -1 && fh_unexported_len < FH_MOUNTS)
+        fh_unexported[fh_unexported_len++] = dev;
+
+    return i;
+}
+
+/*
+ * get the kernel file handle of a path, if it fits into room bytes
+ * together with its type
+ */
+static int fh_kernel_get(const char *path, fh_kernel_t * h, int room)
+{
+    int mnt;
+
+    h->fh.handle_bytes = MAX_HANDLE_SZ;
+    if (name_to_handle_at(AT_FDCWD, path, &h->fh, &mnt, 0) == -1 ||
+        (int) h->fh.handle_bytes + 1 > room || h->fh.handle_type < 0 ||
+        h->fh.handle_type > 0xff)
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * put a kernel file handle into a filehandle
+ *
+ * inos holds the type, length and bytes of the handle of the object,
+ * and for objects other than directories the type and bytes of the
+ * handle of their directory if there is room (FH_PARENT)
+ */
+static int fh_comp_kernel(const char *path, const backend_statstruct * buf,
+                          unfs3_fh_t * fh)
+{
+    fh_kernel_t h;
+    char dir[NFS_MAXPATHLEN];
+    char *last;
+    int len;
+
+    if (!opt_kernel_fh || fh_kernel_mount(buf->st_dev) == -1)
+        return FALSE;
+
+    if (!fh_kernel_get(path, &h, FH_MAXLEN - 1))
+        return FALSE;
+    fh->inos[0] = h.fh.handle_type;
+    fh->inos[1] = h.fh.handle_bytes;
+    memcpy(fh->inos + 2, h.fh.f_handle, h.fh.handle_bytes);
+    len = 2 + h.fh.handle_bytes;
+    fh->len = FH_KERNEL | len;
+
+    if (S_ISDIR(buf->st_mode))
+        return TRUE;
+
+    /* the directory is only used to find the name of the object */
+    strcpy(dir, path);
+    last = strrchr(dir, '/');
+    if (!last)
+        return TRUE;
+    if (last == dir)
+        last++;
+    *last = 0;
+
+    if (fh_kernel_get(dir, &h, FH_MAXLEN - len)) {
+        fh->inos[len] = h.fh.handle_type;
+        memcpy(fh->inos + len + 1, h.fh.f_handle, h.fh.handle_bytes);
+        fh->len = FH_KERNEL | FH_PARENT | (len + 1 + h.fh.handle_bytes);
+    }
+
+    return TRUE;
+}
+
+/*
+ * open a kernel file handle and get the path the kernel knows for it
+ * returns the length of the path, 0 if there is none, or -1 if the
+ * object does not exist anymore
+ */
+static int fh_kernel_open(int mfd, int type, const unsigned char *bytes,
+                          int len, char *result)
+{
+    fh_kernel_t h;
+    backend_statstruct buf;
+    char proc[32];
+    ssize_t n;
+    int fd;
+
+    h.fh.handle_type = type;
+    h.fh.handle_bytes = len;
+    memcpy(h.fh.f_handle, bytes, len);
+
+    fd = open_by_handle_at(mfd, &h.fh, O_PATH | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    /* removed, but still open somewhere */
+    if (backend_fstat(fd, &buf) == -1 || buf.st_nlink == 0) {
+        close(fd);
+        return -1;
+    }
+
+    sprintf(proc, "/proc/self/fd/%i", fd);
+    n = readlink(proc, result, NFS_MAXPATHLEN - 1);
+    close(fd);
+    if (n <= 0 || result[0] != '/')
+        return 0;
+    result[n] = 0;
+
+    return n;
+}
+
+/*
+ * check that a path leads to the object of a filehandle
+ */
+static int fh_kernel_check(const unfs3_fh_t * fh, char *result)
+{
+    backend_statstruct buf;
+
+    if (backend_lstat(result, &buf) == -1 || buf.st_dev != fh->dev ||
+        buf.st_ino != fh->ino)
+        return FALSE;
+
+    fix_dir_times(result, &buf);
+    st_cache_valid = TRUE;
+    st_cache = buf;
+
+    return TRUE;
+}
+
+/*
+ * look for the object of a filehandle in the directory at result, of
+ * path length len
+ */
+static int fh_kernel_scan(const unfs3_fh_t * fh, char *result, int len)
+{
+    backend_dirstream *search;
+    struct dirent *entry;
+    int found = FALSE;
+
+    search = backend_opendir(result);
+    if (!search)
+        return FALSE;
+
+    while ((entry = backend_readdir(search)) != NULL) {
+        if (fh_rec_budget == 0)
+            break;
+        if (fh_rec_budget > 0)
+            fh_rec_budget--;
+
+        if (entry->d_ino == fh->ino &&
+            len + strlen(entry->d_name) + 2 < NFS_MAXPATHLEN) {
+            if (len > 1)
+                result[len++] = '/';
+            strcpy(result + len, entry->d_name);
+            found = TRUE;
+            break;
+        }
+    }
+    backend_closedir(search);
+
+    return found;
+}
+
+/*
+ * resolve a filehandle with a kernel file handle into a path
+ */
+static char *fh_decomp_kernel(const unfs3_fh_t * fh, char *result)
+{
+    char *path;
+    int i, len, pos;
+
+    i = fh_kernel_find(fh->dev);
+    if (i == -1 || FH_INOS(fh) < 2 || fh->inos[1] + 2 > FH_INOS(fh))
+        return NULL;
+
+    /* the object itself, when the kernel knows its path */
+    len = fh_kernel_open(fh_mounts[i].fd, fh->inos[0], fh->inos + 2,
+                         fh->inos[1], result);
+    if (len == -1)
+        return NULL;
+    if (len > 0 && fh_kernel_check(fh, result))
+        return result;
+
+    /* its name in the directory it was looked up in */
+    pos = fh->inos[1] + 2;
+    if ((fh->len & FH_PARENT) && FH_INOS(fh) > pos) {
+        len = fh_kernel_open(fh_mounts[i].fd, fh->inos[pos],
+                             fh->inos + pos + 1, FH_INOS(fh) - pos - 1,
+                             result);
+        if (len > 0 && fh_kernel_scan(fh, result, len) &&
+            fh_kernel_check(fh, result))
+            return result;
+    }
+
+    /* moved to another directory, search the export point for it,
+       unless the caller has to keep it short */
+    if (fh_rec_budget != -1) {
+        fh_rec_budget = 0;
+        return NULL;
+    }
+    path = locate_file_below(fh_mounts[i].path, fh->dev, fh->ino);
+    if (!path)
+        return NULL;
+
+    return strcpy(result, path);
+}
+
+#else				       /* UNFS3_KERNEL_FH */
+
+void fh_kernel_init(void)
+{
+    if (opt_kernel_fh) {
+        logmsg(LOG_WARNING, "Kernel filehandles are not supported");
+        opt_kernel_fh = FALSE;
+    }
+}
+
+static int fh_comp_kernel(U(const char *path),
+                          U(const backend_statstruct * buf),
+                          U(unfs3_fh_t * fh))
+{
+    return FALSE;
+}
+
+void fh_kernel_exports(U(struct exportnode *list))
+{
+}
+
+static char *fh_decomp_kernel(U(const unfs3_fh_t * fh), U(char *result))
+{
+    return NULL;
+}
+
+#endif				       /* UNFS3_KERNEL_FH */
+
 /*
  * --------------------------------
  * FILEHANDLE COMPOSITION FUNCTIONS
@@ -163,6 +559,42 @@ static const unfs3_fh_t invalid_fh = {.dev = 0,.ino = 0,.gen = 0,.len =
 static const unfs3_fh_t invalid_fh = { 0, 0, 0, 0, 0, {0} };
 #endif
 
+/*
+ * put the hashes of the inode numbers along a path into a filehandle
+ */
+static int fh_comp_hashes(const char *path, unfs3_fh_t * fh)
+{
+    char work[NFS_MAXPATHLEN];
+    backend_statstruct buf;
+    char *last;
+    int pos = 0;
+
+    strcpy(work, path);
+    last = work;
+
+    do {
+        *last = '/';
+        last = strchr(last + 1, '/');
+        if (last != NULL)
+            *last = 0;
+
+        if (backend_lstat(work, &buf) == -1)
+            return FALSE;
+
+        /* store 8 bit hash of the component's inode */
+        fh->inos[pos] = FH_HASH(buf.st_ino);
+        pos++;
+
+    } while (last && pos < FH_MAXLEN);
+
+    if (last)			       /* path too deep for filehandle */
+        return FALSE;
+
+    fh->len = pos;
+
+    return TRUE;
+}
+
 /*
  * compose a filehandle for a given path
  * path:     path to compose fh for
@@ -171,12 +603,9 @@ static const unfs3_fh_t invalid_fh = { 0, 0, 0, 0, 0, {0} };
  */
 unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
 {
-    char work[NFS_MAXPATHLEN];
     unfs3_fh_t fh;
     backend_statstruct buf;
     int res;
-    char *last;
-    int pos = 0;
 
     fh.len = 0;
 
@@ -226,31 +655,12 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
     if (strcmp(path, "/") == 0)
         return fh;
 
-    strcpy(work, path);
-    last = work;
-
-    do {
-        *last = '/';
-        last = strchr(last + 1, '/');
-        if (last != NULL)
-            *last = 0;
-
-        res = backend_lstat(work, &buf);
-        if (res == -1) {
-            return invalid_fh;
-        }
-
-        /* store 8 bit hash of the component's inode */
-        fh.inos[pos] = FH_HASH(buf.st_ino);
-        pos++;
-
-    } while (last && pos < FH_MAXLEN);
+    if (fh_comp_kernel(path, &buf, &fh))
+        return fh;
 
-    if (last)			       /* path too deep for filehandle */
+    if (!fh_comp_hashes(path, &fh))
         return invalid_fh;
 
-    fh.len = pos;
-
     return fh;
 }
 
@@ -259,19 +669,32 @@ unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir)
  */
 u_int fh_length(const unfs3_fh_t * fh)
 {
-    return fh->len + sizeof(fh->len) + sizeof(fh->dev) + sizeof(fh->ino) +
+    return FH_INOS(fh) + sizeof(fh->len) + sizeof(fh->dev) + sizeof(fh->ino) +
            sizeof(fh->gen) + sizeof(fh->pwhash);
 }
 
 /*
- * extend a filehandle with a given device, inode, and generation number
+ * extend a filehandle for an object in its directory
+ * path: path to the object
+ * buf:  stat buffer of the object
  */
-unfs3_fh_t *fh_extend(nfs_fh3 nfh, uint32 dev, uint64 ino, uint32 gen)
+unfs3_fh_t *fh_extend(nfs_fh3 nfh, const char *path,
+                      const backend_statstruct * buf, uint32 gen)
 {
-    static unfs3_fh_t new;
+    static UNFS3_TLS unfs3_fh_t new;
 
     new = fh_decode(&nfh);
 
+    if (fh_comp_kernel(path, buf, &new))
+        goto done;
+
+    if (new.len & FH_KERNEL) {
+        /* no hashes to extend, get them from the path */
+        if (!fh_comp_hashes(path, &new))
+            return NULL;
+        goto done;
+    }
+
     if (new.len == 0) {
         char *path;
 
@@ -289,12 +712,14 @@ unfs3_fh_t *fh_extend(nfs_fh3 nfh, uint32 dev, uint64 ino, uint32 gen)
     if (new.len == FH_MAXLEN)
         return NULL;
 
-    new.dev = dev;
-    new.ino = ino;
+    new.inos[new.len] = FH_HASH(buf->st_ino);
+    new.len++;
+
+  done:
+    new.dev = buf->st_dev;
+    new.ino = buf->st_ino;
     new.gen = gen;
     new.pwhash = export_password_hash;
-    new.inos[new.len] = FH_HASH(ino);
-    new.len++;
 
     return &new;
 }
@@ -302,13 +727,14 @@ unfs3_fh_t *fh_extend(nfs_fh3 nfh, uint32 dev, uint64 ino, uint32 gen)
 /*
  * get post_op_fh3 extended by device, inode, and generation number
  */
-post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen)
+post_op_fh3 fh_extend_post(nfs_fh3 fh, const char *path,
+                           const backend_statstruct * buf, uint32 gen)
 {
     post_op_fh3 post;
     unfs3_fh_t *new;
-    static char buffer[FH_MAXBUF];
+    static UNFS3_TLS char buffer[FH_MAXBUF];
 
-    new = fh_extend(fh, dev, ino, gen);
+    new = fh_extend(fh, path, buf, gen);
 
     if (new) {
         post.handle_follows = TRUE;
@@ -340,7 +766,7 @@ post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type)
     st_cache_valid = TRUE;
     st_cache = buf;
 
-    return fh_extend_post(fh, buf.st_dev, buf.st_ino,
+    return fh_extend_post(fh, path, &buf,
                           backend_get_gen(buf, FD_NONE, path));
 }
 
@@ -396,6 +822,11 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
     entry = backend_readdir(search);
 
     while (entry) {
+        if (fh_rec_budget == 0)
+            break;
+        if (fh_rec_budget > 0)
+            fh_rec_budget--;
+
         if (strlen(lead) + strlen(entry->d_name) + 1 < NFS_MAXPATHLEN) {
 
             sprintf(obj, "%s/%s", lead, entry->d_name);
@@ -451,22 +882,58 @@ static int fh_rec(const unfs3_fh_t * fh, int pos, const char *lead,
     }
 }
 
+#ifdef UNFS3_SEARCH
+/*
+ * the fh_rec rules for a parallel search
+ */
+static int fh_rec_visit(const backend_statstruct * buf, int level, void *arg)
+{
+    const unfs3_fh_t *fh = arg;
+
+    if (buf->st_dev == fh->dev && buf->st_ino == fh->ino)
+        return SEARCH_FOUND;
+
+    if (level + 1 < fh->len && FH_HASH(buf->st_ino) == fh->inos[level])
+        return SEARCH_DESCEND;
+
+    return SEARCH_SKIP;
+}
+#endif
+
 /*
  * resolve a filehandle into a path
  */
 char *fh_decomp_raw(const unfs3_fh_t * fh)
 {
     int rec = 0;
-    static char result[NFS_MAXPATHLEN];
+    static UNFS3_TLS char result[NFS_MAXPATHLEN];
+#ifdef UNFS3_SEARCH
+    backend_statstruct buf;
+#endif
 
     /* valid fh? */
     if (!fh)
         return NULL;
 
+    if (fh->len & FH_KERNEL)
+        return fh_decomp_kernel(fh, result);
+
     /* special case for root directory */
     if (fh->len == 0)
         return "/";
 
+#ifdef UNFS3_SEARCH
+    /* searches without a limit may use several threads */
+    if (fh_rec_budget == -1) {
+        if (!search_tree("/", fh_rec_visit, (void *) fh, result, &buf))
+            return NULL;
+        fix_dir_times(result, &buf);
+        st_cache_valid = TRUE;
+        st_cache = buf;
+        return result;
+    }
+#endif
+
     rec = fh_rec(fh, 0, "/", result);
 
     if (rec)
@@ -476,6 +943,23 @@ char *fh_decomp_raw(const unfs3_fh_t * fh)
     return NULL;
 }
 
+/*
+ * resolve a filehandle into a path, examining at most limit directory
+ * entries
+ * sets *exceeded if the search was cut short
+ */
+char *fh_decomp_limited(const unfs3_fh_t * fh, int limit, int *exceeded)
+{
+    char *res;
+
+    fh_rec_budget = limit;
+    res = fh_decomp_raw(fh);
+    *exceeded = (!res && fh_rec_budget == 0);
+    fh_rec_budget = -1;
+
+    return res;
+}
+
 /*
  * Convert a nfs_fh3 to a unfs3_fh_t
  */
@@ -502,10 +986,10 @@ unfs3_fh_t fh_decode(const nfs_fh3 *fh)
     memcpy(&obj.len, buf, sizeof(obj.len));
     buf += sizeof(obj.len);
 
-    assert(fh->data.data_len == (FH_MINLEN + obj.len));
+    assert(fh->data.data_len == (FH_MINLEN + FH_INOS(&obj)));
 
-    if (obj.len)
-        memcpy(obj.inos, buf, obj.len);
+    if (FH_INOS(&obj))
+        memcpy(obj.inos, buf, FH_INOS(&obj));
 
     return obj;
 }
@@ -536,8 +1020,8 @@ nfs_fh3 fh_encode(const unfs3_fh_t *fh, char *buffer)
     buf += sizeof(fh->pwhash);
     memcpy(buf, &fh->len, sizeof(fh->len));
     buf += sizeof(fh->len);
-    if (fh->len)
-        memcpy(buf, fh->inos, fh->len);
+    if (FH_INOS(fh))
+        memcpy(buf, fh->inos, FH_INOS(fh));
 
     return handle;
 }
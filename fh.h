@@ -8,6 +8,7 @@
 #define UNFS3_FH_H
 
 #include "backend.h"
+#include "worker.h"
 
 /* minimum length of complete filehandle */
 #define FH_MINLEN 21
@@ -18,6 +19,17 @@
 /* maximum depth of pathname described by filehandle */
 #define FH_MAXLEN (FH_MAXBUF - FH_MINLEN)
 
+#if defined(HAVE_NAME_TO_HANDLE_AT) && defined(HAVE_OPEN_BY_HANDLE_AT)
+#define UNFS3_KERNEL_FH 1
+#endif
+
+/* flags in len, inos holds a kernel file handle instead of hashes */
+#define FH_KERNEL	0x80
+#define FH_PARENT	0x40	/* followed by the handle of its directory */
+
+/* bytes used in inos */
+#define FH_INOS(fh)	((fh)->len & ~(FH_KERNEL | FH_PARENT))
+
 typedef struct {
     uint32			dev;
     uint64			ino;
@@ -32,8 +44,10 @@ typedef struct {
 
 #define FD_NONE (-1)			/* used for get_gen */
 
-extern int st_cache_valid;		/* stat value is valid */
-extern backend_statstruct st_cache;	/* cached stat value */
+extern int opt_kernel_fh;
+
+extern UNFS3_TLS int st_cache_valid;		/* stat value is valid */
+extern UNFS3_TLS backend_statstruct st_cache;	/* cached stat value */
 
 uint32 get_gen(backend_statstruct obuf, int fd, const char *path);
 
@@ -43,11 +57,18 @@ int fh_valid(unfs3_fh_t fh);
 unfs3_fh_t fh_comp_raw(const char *path, struct svc_req *rqstp, int need_dir);
 u_int fh_length(const unfs3_fh_t *fh);
 
-unfs3_fh_t *fh_extend(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
-post_op_fh3 fh_extend_post(nfs_fh3 fh, uint32 dev, uint64 ino, uint32 gen);
+void fh_kernel_init(void);
+struct exportnode;
+void fh_kernel_exports(struct exportnode *list);
+
+unfs3_fh_t *fh_extend(nfs_fh3 fh, const char *path,
+                      const backend_statstruct *buf, uint32 gen);
+post_op_fh3 fh_extend_post(nfs_fh3 fh, const char *path,
+                           const backend_statstruct *buf, uint32 gen);
 post_op_fh3 fh_extend_type(nfs_fh3 fh, const char *path, unsigned int type);
 
 char *fh_decomp_raw(const unfs3_fh_t *fh);
+char *fh_decomp_limited(const unfs3_fh_t *fh, int limit, int *exceeded);
 
 unfs3_fh_t fh_decode(const nfs_fh3 *fh);
 nfs_fh3 fh_encode(const unfs3_fh_t *fh, char *buffer);
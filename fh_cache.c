@@ -12,9 +12,21 @@
 #include <rpc/rpc.h>
 #include <limits.h>
 #include <stdio.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "nfs.h"
 #include "fh.h"
@@ -25,45 +37,107 @@
 #include "attr.h"
 #include "Config/exports.h"
 #include "backend.h"
+#include "resolve.h"
 
-/* number of entries in fh cache */
-#define CACHE_ENTRIES	4096
+/*
+ * the cache is a hash table over device and inode number, with all
+ * entries in a list ordered by last use. Unused entries are at the end
+ * of that list, so the entry to reuse is always the last one.
+ *
+ * paths are not stored as strings. Each path component is interned
+ * once as a name with a pointer to the name of its parent directory,
+ * so the entries for all files of a directory share the names leading
+ * to it, and a path is put together again when it is looked up. Names
+ * are reference counted by their children and by cache entries.
+ *
+ * the names form a tree like the one of the filesystem, so when a
+ * directory is renamed, moving its name fixes the paths of all entries
+ * below it. A name that is removed is marked dead, and entries below a
+ * dead name are dropped on lookup.
+ */
 
-typedef struct {
+/* flags of names */
+#define FH_NAME_DEAD	1	/* removed, not in name hash */
+#define FH_NAME_OWN	2	/* name is allocated separately */
+#define FH_NAME_NOWATCH	4	/* directory could not be watched */
+
+typedef struct fh_watch fh_watch;
+
+typedef struct fh_name {
+    struct fh_name *parent;	/* NULL for the first component */
+    struct fh_name *hnext;	/* in name hash */
+    char *name;			/* not terminated */
+    fh_watch *watch;		/* if the directory is watched, see below */
+    uint32 refs;
+    unsigned short len;
+    unsigned short flags;
+    uint32 gen;			/* changes of the object named */
+    uint32 agen;		/* changes of its attributes */
+} fh_name;
+
+typedef struct unfs3_cache_t {
     uint32 dev;			/* device */
     uint64 ino;			/* inode */
-    char path[NFS_MAXPATHLEN];	/* pathname */
-    unsigned int use;		/* last use */
+    fh_name *name;		/* last component of path, NULL if unused */
+    struct unfs3_cache_t *hnext;	/* in hash chain */
+    struct unfs3_cache_t *prev;	/* in LRU list, most recent first */
+    struct unfs3_cache_t *next;
 } unfs3_cache_t;
 
-static unfs3_cache_t fh_cache[CACHE_ENTRIES];
+/* number of entries in fh cache, set with -H */
+int opt_fh_cache_size = FH_CACHE_DEFAULT;
+
+static unfs3_cache_t *fh_cache = NULL;
+static unfs3_cache_t **fh_hash = NULL;
+static int fh_hash_bits = 0;
+
+static unfs3_cache_t *lru_first = NULL;
+static unfs3_cache_t *lru_last = NULL;
+
+/* interned names */
+static fh_name **names = NULL;
+static unsigned names_size = 0;
 
 /* statistics */
 int fh_cache_max = 0;
 int fh_cache_use = 0;
 int fh_cache_hit = 0;
+int fh_cache_names = 0;
+int fh_cache_snap_hit = 0;
+
+/* file for snapshots of the cache, set with -S */
+char *opt_fh_snap_file = NULL;
+
+/* cache changed since the last snapshot */
+static int fh_snap_dirty = FALSE;
+
+/* watch directories instead of checking paths, set with -N */
+int opt_fh_watch = FALSE;
 
-/* counter for LRU */
-static unsigned int fh_cache_time = 0;
+static void fh_snap_open(void);
+static void fh_watch_init(void);
+static void fh_watch_drop(fh_name * dir);
+static void fh_watch_forget(const unfs3_cache_t * e);
+static int fh_watch_check(const unfs3_cache_t * e);
+static void fh_watch_remember(const unfs3_cache_t * e,
+                              const backend_statstruct * buf);
+
+/* last fh_decomp() left the search to the resolver */
+UNFS3_TLS int fh_decomp_pending = FALSE;
 
 /*
- * last returned entry
- *
- * this entry must not be overwritten before the next lookup, because
- * operations such as CREATE may still be needing the path inside the
- * entry for getting directory attributes
+ * paths returned by fh_decomp()
  *
- * this is needed since fh_cache_time can roll around to 0, thus
- * making the entry evictable
+ * a request may need the paths of two filehandles at once, like for
+ * RENAME, so each one stays valid until the second next call
  */
-static int fh_last_entry = -1;
+static UNFS3_TLS char fh_paths[2][NFS_MAXPATHLEN];
+static UNFS3_TLS int fh_paths_next = 0;
 
-/*
- * return next pseudo-time value for LRU counter
- */
-static unsigned int fh_cache_next(void)
+static char *fh_cache_path_buf(void)
 {
-    return ++fh_cache_time;
+    fh_paths_next = !fh_paths_next;
+    return fh_paths[fh_paths_next];
 }
 
 /*
@@ -71,90 +145,391 @@ static unsigned int fh_cache_next(void)
  */
 void fh_cache_init(void)
 {
-    memset(fh_cache, 0, sizeof(unfs3_cache_t) * CACHE_ENTRIES);
+    int i;
+
+    while ((1 << fh_hash_bits) < opt_fh_cache_size)
+        fh_hash_bits++;
+
+    names_size = 1024;
+    names = calloc(names_size, sizeof(fh_name *));
+    fh_cache = calloc(opt_fh_cache_size, sizeof(unfs3_cache_t));
+    fh_hash = calloc((size_t) 1 << fh_hash_bits, sizeof(unfs3_cache_t *));
+    if (!names || !fh_cache || !fh_hash) {
+        logmsg(LOG_CRIT, "Unable to allocate fh cache");
+        daemon_exit(CRISIS);
+    }
+
+    for (i = 0; i < opt_fh_cache_size; i++) {
+        fh_cache[i].prev = i > 0 ? &fh_cache[i - 1] : NULL;
+        fh_cache[i].next =
+            i < opt_fh_cache_size - 1 ? &fh_cache[i + 1] : NULL;
+    }
+    lru_first = &fh_cache[0];
+    lru_last = &fh_cache[opt_fh_cache_size - 1];
+
+    if (opt_fh_snap_file)
+        fh_snap_open();
+    if (opt_fh_watch)
+        fh_watch_init();
+}
+
+static unsigned fh_name_hash(const fh_name * parent, const char *name,
+                             uint32 len)
+{
+    uint32 h = 0x811c9dc5 ^ (uint32) (uintptr_t) parent;
+    uint32 i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char) name[i]) * 0x01000193;
+
+    return h & (names_size - 1);
+}
+
+static void fh_name_link(fh_name * n)
+{
+    unsigned h = fh_name_hash(n->parent, n->name, n->len);
+
+    n->hnext = names[h];
+    names[h] = n;
+}
+
+static void fh_name_unlink(fh_name * n)
+{
+    fh_name **p;
+
+    for (p = &names[fh_name_hash(n->parent, n->name, n->len)]; *p != n;
+         p = &(*p)->hnext);
+    *p = n->hnext;
 }
 
 /*
- * find cache index to use for new entry
- * returns either an empty slot or the least recently used slot if no
- * empty slot is present
+ * double the size of the name hash
  */
-static int fh_cache_lru(void)
+static void fh_name_grow(void)
 {
-    unsigned int best = UINT_MAX;
-    int best_idx = 0;
-    int i;
+    fh_name **old = names, *n, *next;
+    unsigned old_size = names_size, i;
 
-    /* if cache is not full, we simply hand out the next slot */
-    if (fh_cache_max < CACHE_ENTRIES - 1)
-        return fh_cache_max++;
+    names = calloc(old_size * 2, sizeof(fh_name *));
+    if (!names) {
+        /* longer chains are fine, too */
+        names = old;
+        return;
+    }
+    names_size = old_size * 2;
 
-    for (i = 0; i < CACHE_ENTRIES; i++) {
-        if (i == fh_last_entry)
-            continue;
-        if (fh_cache[i].use == 0)
-            return i;
-        if (fh_cache[i].use < best) {
-            best = fh_cache[i].use;
-            best_idx = i;
+    for (i = 0; i < old_size; i++)
+        for (n = old[i]; n; n = next) {
+            next = n->hnext;
+            fh_name_link(n);
         }
+    free(old);
+}
+
+/*
+ * find a name, does not take a reference
+ */
+static fh_name *fh_name_find(const fh_name * parent, const char *name,
+                             uint32 len)
+{
+    fh_name *n;
+
+    for (n = names[fh_name_hash(parent, name, len)]; n; n = n->hnext)
+        if (n->parent == parent && n->len == len &&
+            memcmp(n->name, name, len) == 0)
+            return n;
+
+    return NULL;
+}
+
+/*
+ * find or create a name, takes a reference
+ */
+static fh_name *fh_name_get(fh_name * parent, const char *name, uint32 len)
+{
+    fh_name *n = fh_name_find(parent, name, len);
+
+    if (n) {
+        n->refs++;
+        return n;
     }
 
-    /* avoid stomping over last returned entry */
-    if (best_idx == 0 && fh_last_entry == 0)
-        best_idx = 1;
+    n = malloc(sizeof(fh_name) + len);
+    if (!n) {
+        logmsg(LOG_CRIT, "Out of memory in fh cache");
+        daemon_exit(CRISIS);
+    }
+    n->parent = parent;
+    n->name = (char *) (n + 1);
+    n->refs = 1;
+    n->len = len;
+    n->flags = 0;
+    n->watch = NULL;
+    n->gen = 0;
+    n->agen = 0;
+    memcpy(n->name, name, len);
+    fh_name_link(n);
 
-    return best_idx;
+    if (parent)
+        parent->refs++;
+
+    if ((unsigned) ++fh_cache_names > names_size)
+        fh_name_grow();
+
+    return n;
+}
+
+/*
+ * drop a reference to a name, freeing it and unused parents
+ */
+static void fh_name_put(fh_name * n)
+{
+    fh_name *parent;
+
+    while (n && --n->refs == 0) {
+        if (!(n->flags & FH_NAME_DEAD))
+            fh_name_unlink(n);
+        if (n->flags & FH_NAME_OWN)
+            free(n->name);
+        fh_watch_drop(n);
+
+        parent = n->parent;
+        free(n);
+        fh_cache_names--;
+        n = parent;
+    }
+}
+
+/*
+ * call fn for each component of an absolute path, a component follows
+ * every slash, even an empty one
+ * stops and returns FALSE when fn does
+ */
+static int fh_name_split(const char *path, size_t len,
+                         int (*fn) (void *, const char *, uint32), void *arg)
+{
+    const char *end, *stop = path + len;
+
+    do {
+        path++;
+        end = memchr(path, '/', stop - path);
+        if (!end)
+            end = stop;
+
+        if (!fn(arg, path, end - path))
+            return FALSE;
+
+        path = end;
+    } while (path < stop);
+
+    return TRUE;
+}
+
+static int fh_name_intern_one(void *arg, const char *name, uint32 len)
+{
+    fh_name **n = arg, *next;
+
+    next = fh_name_get(*n, name, len);
+    fh_name_put(*n);
+    *n = next;
+
+    return TRUE;
+}
+
+static int fh_name_find_one(void *arg, const char *name, uint32 len)
+{
+    fh_name **n = arg;
+
+    *n = fh_name_find(*n, name, len);
+
+    return *n != NULL;
+}
+
+/*
+ * intern the components of the first len bytes of an absolute path
+ * returns the name of the last component with a reference
+ */
+static fh_name *fh_name_intern(const char *path, size_t len)
+{
+    fh_name *n = NULL;
+
+    fh_name_split(path, len, fh_name_intern_one, &n);
+
+    return n;
+}
+
+/*
+ * find the name of an absolute path, does not take a reference
+ */
+static fh_name *fh_name_lookup(const char *path)
+{
+    fh_name *n = NULL;
+
+    if (path[0] != '/' ||
+        !fh_name_split(path, strlen(path), fh_name_find_one, &n))
+        return NULL;
+
+    return n;
+}
+
+/*
+ * mark a name as removed, along with everything below it
+ */
+static void fh_name_kill(fh_name * n)
+{
+    fh_name_unlink(n);
+    n->flags |= FH_NAME_DEAD;
+}
+
+/*
+ * length of the path of a name, 0 if it cannot be used
+ */
+static size_t fh_name_size(const fh_name * n)
+{
+    size_t len = 0;
+
+    for (; n; n = n->parent) {
+        if (n->flags & FH_NAME_DEAD)
+            return 0;
+        len += 1 + n->len;
+    }
+
+    return len < NFS_MAXPATHLEN ? len : 0;
+}
+
+/*
+ * put a path together again
+ */
+static char *fh_name_path(const fh_name * n, char *buf)
+{
+    const fh_name *p;
+    size_t len = fh_name_size(n);
+
+    if (len == 0)
+        return NULL;
+
+    buf[len] = 0;
+    for (p = n; p; p = p->parent) {
+        len -= p->len;
+        memcpy(buf + len, p->name, p->len);
+        buf[--len] = '/';
+    }
+
+    return buf;
+}
+
+static unsigned fh_cache_hash(uint32 dev, uint64 ino)
+{
+    uint32 h = dev * 0x9e3779b1U ^ (uint32) ino ^ (uint32) (ino >> 32);
+
+    return (h * 2654435761U) >> (32 - fh_hash_bits);
+}
+
+/*
+ * move an entry to the front or the end of the LRU list
+ */
+static void fh_cache_move(unfs3_cache_t * e, int front)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_first = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_last = e->prev;
+
+    if (front) {
+        e->prev = NULL;
+        e->next = lru_first;
+        if (lru_first)
+            lru_first->prev = e;
+        else
+            lru_last = e;
+        lru_first = e;
+    } else {
+        e->next = NULL;
+        e->prev = lru_last;
+        if (lru_last)
+            lru_last->next = e;
+        else
+            lru_first = e;
+        lru_last = e;
+    }
 }
 
 /*
  * invalidate (clear) a cache entry
  */
-static void fh_cache_inval(int idx)
+static void fh_cache_inval(unfs3_cache_t * e)
 {
-    fh_cache[idx].dev = 0;
-    fh_cache[idx].ino = 0;
-    fh_cache[idx].use = 0;
-    fh_cache[idx].path[0] = 0;
+    unfs3_cache_t **p;
+
+    if (!e->name)
+        return;
+
+    for (p = &fh_hash[fh_cache_hash(e->dev, e->ino)]; *p != e;
+         p = &(*p)->hnext);
+    *p = e->hnext;
+
+    fh_name_put(e->name);
+    e->name = NULL;
+    fh_cache_max--;
+    fh_watch_forget(e);
+
+    fh_cache_move(e, FALSE);
 }
 
 /*
- * find index given device and inode number
+ * find entry given device and inode number
  */
-static int fh_cache_index(uint32 dev, uint64 ino)
+static unfs3_cache_t *fh_cache_index(uint32 dev, uint64 ino)
 {
-    int i, res = -1;
+    unfs3_cache_t *e;
 
-    for (i = 0; i < fh_cache_max + 1; i++)
-        if (fh_cache[i].dev == dev && fh_cache[i].ino == ino) {
-            res = i;
-            break;
-        }
+    for (e = fh_hash[fh_cache_hash(dev, ino)]; e; e = e->hnext)
+        if (e->dev == dev && e->ino == ino)
+            return e;
 
-    return res;
+    return NULL;
 }
 
 /*
  * add an entry to the filehandle cache
  */
-char *fh_cache_add(uint32 dev, uint64 ino, const char *path)
+void fh_cache_add(uint32 dev, uint64 ino, const char *path)
 {
-    int idx;
+    unfs3_cache_t *e;
+    fh_name *n;
+    unsigned h;
 
-    /* if we already have a matching entry, overwrite that */
-    idx = fh_cache_index(dev, ino);
+    if (path[0] != '/')
+        return;
 
-    /* otherwise overwrite least recently used entry */
-    if (idx == -1)
-        idx = fh_cache_lru();
+    n = fh_name_intern(path, strlen(path));
 
-    fh_cache[idx].dev = dev;
-    fh_cache[idx].ino = ino;
-    fh_cache[idx].use = fh_cache_next();
+    /* if we already have a matching entry, overwrite that */
+    e = fh_cache_index(dev, ino);
 
-    strcpy(fh_cache[idx].path, path);
+    /* otherwise overwrite least recently used entry */
+    if (!e) {
+        e = lru_last;
+        fh_cache_inval(e);
+        e->dev = dev;
+        e->ino = ino;
+        h = fh_cache_hash(dev, ino);
+        e->hnext = fh_hash[h];
+        fh_hash[h] = e;
+        fh_cache_max++;
+    }
 
-    return fh_cache[idx].path;
+    if (e->name != n) {
+        fh_snap_dirty = TRUE;
+        fh_watch_forget(e);
+    }
+    fh_name_put(e->name);
+    e->name = n;
+    fh_cache_move(e, TRUE);
 }
 
 /*
@@ -162,35 +537,48 @@ char *fh_cache_add(uint32 dev, uint64 ino, const char *path)
  */
 static char *fh_cache_lookup(uint32 dev, uint64 ino)
 {
-    int i, res;
+    unfs3_cache_t *e;
+    int res;
     backend_statstruct buf;
+    char *path;
 
-    i = fh_cache_index(dev, ino);
+    e = fh_cache_index(dev, ino);
+
+    if (e) {
+        path = fh_name_path(e->name, fh_cache_path_buf());
+        if (!path) {
+            /* below a name that was removed */
+            fh_cache_inval(e);
+            return NULL;
+        }
+
+        /* nothing has changed along the path since it was checked */
+        if (fh_watch_check(e)) {
+            fh_cache_move(e, TRUE);
+            return path;
+        }
 
-    if (i != -1) {
         /* check whether path to <dev,ino> relation still holds */
-        res = backend_lstat(fh_cache[i].path, &buf);
+        res = backend_lstat(path, &buf);
         if (res == -1) {
             /* object does not exist any more */
-            fh_cache_inval(i);
+            fh_cache_inval(e);
             return NULL;
         }
         if (buf.st_dev == dev && buf.st_ino == ino) {
-            /* cache hit, update time on cache entry */
-            fh_cache[i].use = fh_cache_next();
+            /* cache hit, move entry to the front */
+            fh_cache_move(e, TRUE);
+            fh_watch_remember(e, &buf);
 
             /* update stat cache */
-            fix_dir_times(fh_cache[i].path, &buf);
+            fix_dir_times(path, &buf);
             st_cache_valid = TRUE;
             st_cache = buf;
 
-            /* prevent next fh_cache_add from overwriting entry */
-            fh_last_entry = i;
-
-            return fh_cache[i].path;
+            return path;
         } else {
             /* path to <dev,ino> relation has changed */
-            fh_cache_inval(i);
+            fh_cache_inval(e);
             return NULL;
         }
     }
@@ -198,6 +586,711 @@ static char *fh_cache_lookup(uint32 dev, uint64 ino)
     return NULL;
 }
 
+/*
+ * coherence through inotify
+ *
+ * with -N, the directories leading to cached files are watched with
+ * inotify. Each name counts the changes reported for it: gen when it is
+ * created, removed or renamed, agen when the attributes of the object
+ * or the entries of a directory change. When an entry's path is checked,
+ * its attributes are remembered along with a stamp summing these
+ * counters over the path. While the stamp stays the same, nothing along
+ * the path has changed, and a hit is served without lstat(). The stamp
+ * also changes every FH_WATCH_INTERVAL seconds, so that changes that are
+ * not reported, like those through a hard link in a directory that is
+ * not watched, are noticed eventually.
+ */
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define FH_WATCH_HASH	1024
+
+#define FH_WATCH_EVENTS	(IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+			 IN_MOVED_TO | IN_ATTRIB | IN_MODIFY | \
+			 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+			 IN_DONT_FOLLOW)
+
+struct fh_watch {
+    int wd;
+    fh_name *dir;		/* NULL for the root directory */
+    struct fh_watch *next;	/* in watch hash */
+};
+
+/* what an entry looked like when its path was checked */
+typedef struct {
+    int valid;
+    int stamped;		/* the path can be watched */
+    uint32 stamp;		/* valid */
+    uint32 next;		/* stamp for the next check */
+    backend_statstruct buf;
+} fh_known;
+
+static int fh_watch_fd = -1;
+static fh_watch *fh_watches[FH_WATCH_HASH];
+static fh_watch *fh_root_watch = NULL;
+static fh_known *fh_knowns = NULL;
+
+/* queue overflows, when changes may have been missed */
+static uint32 fh_watch_lost = 0;
+
+static void fh_watch_link(fh_watch * w)
+{
+    fh_watch **p = &fh_watches[(unsigned) w->wd % FH_WATCH_HASH];
+
+    w->next = *p;
+    *p = w;
+}
+
+/*
+ * unlink and free a watch
+ * returns TRUE if another name shares the inotify watch
+ */
+static int fh_watch_free(fh_watch * w)
+{
+    fh_watch **p, *o;
+    int shared = FALSE;
+
+    for (p = &fh_watches[(unsigned) w->wd % FH_WATCH_HASH]; *p != w;
+         p = &(*p)->next);
+    *p = w->next;
+
+    for (o = fh_watches[(unsigned) w->wd % FH_WATCH_HASH]; o; o = o->next)
+        if (o->wd == w->wd)
+            shared = TRUE;
+
+    if (w->dir)
+        w->dir->watch = NULL;
+    else
+        fh_root_watch = NULL;
+    free(w);
+
+    return shared;
+}
+
+static void fh_watch_init(void)
+{
+    fh_watch *w;
+
+    fh_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    fh_knowns = calloc(opt_fh_cache_size, sizeof(fh_known));
+    w = malloc(sizeof(fh_watch));
+
+    if (fh_watch_fd != -1 && fh_knowns && w) {
+        w->dir = NULL;
+        w->wd = inotify_add_watch(fh_watch_fd, "/", FH_WATCH_EVENTS);
+        if (w->wd != -1) {
+            fh_watch_link(w);
+            fh_root_watch = w;
+            return;
+        }
+    }
+
+    logmsg(LOG_WARNING, "Unable to watch directories, checking paths");
+    if (fh_watch_fd != -1)
+        close(fh_watch_fd);
+    fh_watch_fd = -1;
+    free(fh_knowns);
+    fh_knowns = NULL;
+    free(w);
+}
+
+/*
+ * start watching a directory, only tried once
+ */
+static void fh_watch_add(fh_name * dir)
+{
+    char path[NFS_MAXPATHLEN];
+    fh_watch *w;
+
+    if (dir->watch || dir->flags & FH_NAME_NOWATCH)
+        return;
+    dir->flags |= FH_NAME_NOWATCH;
+
+    if (!fh_name_path(dir, path))
+        return;
+    w = malloc(sizeof(fh_watch));
+    if (!w)
+        return;
+
+    w->wd = inotify_add_watch(fh_watch_fd, path, FH_WATCH_EVENTS);
+    if (w->wd == -1) {
+        if (errno == ENOSPC)
+            logmsg(LOG_WARNING, "Out of inotify watches, checking paths");
+        free(w);
+        return;
+    }
+
+    w->dir = dir;
+    fh_watch_link(w);
+    dir->watch = w;
+    dir->flags &= ~FH_NAME_NOWATCH;
+
+    /* changes before now were not seen */
+    dir->gen++;
+    dir->agen++;
+}
+
+/*
+ * stop watching a directory whose name is freed
+ */
+static void fh_watch_drop(fh_name * dir)
+{
+    int wd;
+
+    if (!dir->watch)
+        return;
+
+    wd = dir->watch->wd;
+    if (!fh_watch_free(dir->watch))
+        inotify_rm_watch(fh_watch_fd, wd);
+}
+
+static void fh_watch_event(const struct inotify_event *ev)
+{
+    fh_watch *w, *next;
+    fh_name *n;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        fh_watch_lost++;
+        return;
+    }
+
+    for (w = fh_watches[(unsigned) ev->wd % FH_WATCH_HASH]; w; w = next) {
+        next = w->next;
+        if (w->wd != ev->wd)
+            continue;
+
+        if (ev->len > 0) {
+            /* an entry of the directory */
+            n = fh_name_find(w->dir, ev->name, strlen(ev->name));
+            if (ev->mask & (IN_ATTRIB | IN_MODIFY)) {
+                if (n)
+                    n->agen++;
+            } else {
+                if (n)
+                    n->gen++;
+                if (w->dir)
+                    w->dir->agen++;
+            }
+        } else if (w->dir) {
+            /* the directory itself */
+            if (ev->mask & IN_ATTRIB)
+                w->dir->agen++;
+            else
+                w->dir->gen++;
+        }
+
+        /* the kernel has removed the watch */
+        if (ev->mask & IN_IGNORED) {
+            if (w->dir)
+                w->dir->gen++;
+            fh_watch_free(w);
+        }
+    }
+}
+
+/*
+ * handle the changes reported so far
+ */
+static void fh_watch_poll(void)
+{
+    union {
+        struct inotify_event ev;
+        char buf[4096];
+    } u;
+    const struct inotify_event *ev;
+    ssize_t len, pos;
+
+    for (;;) {
+        len = read(fh_watch_fd, u.buf, sizeof(u.buf));
+        if (len <= 0)
+            return;
+
+        for (pos = 0; pos < len;
+             pos += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *) (u.buf + pos);
+            fh_watch_event(ev);
+        }
+    }
+}
+
+/*
+ * sum the change counters along the path of an entry
+ * returns FALSE if a change could go unnoticed
+ */
+static int fh_watch_stamp(const unfs3_cache_t * e, uint32 * stamp)
+{
+    const fh_known *k = &fh_knowns[e - fh_cache];
+    fh_name *n = e->name, *p;
+    uint32 sum = fh_watch_lost + (uint32) (time(NULL) / FH_WATCH_INTERVAL);
+
+    if (!fh_root_watch)
+        return FALSE;
+
+    /* the entries of a directory are part of its attributes */
+    if (k->valid && S_ISDIR(k->buf.st_mode)) {
+        fh_watch_add(n);
+        if (!n->watch)
+            return FALSE;
+    }
+    sum += n->agen;
+
+    for (p = n; p; p = p->parent) {
+        if (p != n) {
+            fh_watch_add(p);
+            if (!p->watch)
+                return FALSE;
+        }
+        sum += p->gen;
+    }
+
+    *stamp = sum;
+    return TRUE;
+}
+
+/*
+ * check whether an entry is unchanged, filling the stat cache if so
+ */
+static int fh_watch_check(const unfs3_cache_t * e)
+{
+    fh_known *k;
+
+    if (fh_watch_fd == -1)
+        return FALSE;
+
+    fh_watch_poll();
+
+    k = &fh_knowns[e - fh_cache];
+    k->stamped = fh_watch_stamp(e, &k->next);
+    if (!k->valid || !k->stamped || k->stamp != k->next)
+        return FALSE;
+
+    st_cache_valid = TRUE;
+    st_cache = k->buf;
+    return TRUE;
+}
+
+/*
+ * remember the attributes of an entry whose path was just checked
+ */
+static void fh_watch_remember(const unfs3_cache_t * e,
+                              const backend_statstruct * buf)
+{
+    fh_known *k;
+
+    if (fh_watch_fd == -1)
+        return;
+
+    k = &fh_knowns[e - fh_cache];
+    k->valid = k->stamped;
+    k->stamp = k->next;
+    k->buf = *buf;
+
+    /* times of broken directories are made up, see fix_dir_times() */
+    if (S_ISDIR(buf->st_mode) && (buf->st_mtime == 0 || buf->st_ctime == 0))
+        k->valid = FALSE;
+}
+
+static void fh_watch_forget(const unfs3_cache_t * e)
+{
+    if (fh_watch_fd != -1)
+        fh_knowns[e - fh_cache].valid = FALSE;
+}
+
+#else				       /* HAVE_SYS_INOTIFY_H */
+
+static void fh_watch_init(void)
+{
+    logmsg(LOG_WARNING, "Unable to watch directories, checking paths");
+}
+
+static void fh_watch_drop(U(fh_name * dir))
+{
+}
+
+static void fh_watch_forget(U(const unfs3_cache_t * e))
+{
+}
+
+static int fh_watch_check(U(const unfs3_cache_t * e))
+{
+    return FALSE;
+}
+
+static void fh_watch_remember(U(const unfs3_cache_t * e),
+                              U(const backend_statstruct * buf))
+{
+}
+
+#endif				       /* HAVE_SYS_INOTIFY_H */
+
+/*
+ * snapshots of the cache
+ *
+ * with -S, the entries of the cache are written to a file once in a
+ * while, so that a restarted server knows the paths of the filehandles
+ * its clients still use. The file is mapped at startup and only looked
+ * at when a filehandle is not in the cache. As the filesystem may have
+ * changed in between, a path from the snapshot is checked like one from
+ * the cache before it is used.
+ *
+ * the file starts with a header, followed by one record per entry,
+ * sorted by device and inode number, and the paths of the records.
+ */
+
+#ifdef HAVE_SYS_MMAN_H
+
+#define FH_SNAP_MAGIC	"UNFS3FHS"
+#define FH_SNAP_VERSION	1
+
+typedef struct {
+    char magic[8];
+    uint32 version;
+    uint32 count;		/* records */
+} fh_snap_head;
+
+typedef struct {
+    uint64 ino;
+    uint32 dev;
+    uint32 pad;
+    uint64 off;			/* of the path, from start of file */
+} fh_snap_rec;
+
+/* a record of the next snapshot */
+typedef struct {
+    uint64 ino;
+    uint32 dev;
+    size_t len;
+    const fh_name *name;	/* from the cache */
+    const char *path;		/* or from the current snapshot */
+} fh_snap_item;
+
+static const char *fh_snap = NULL;
+static size_t fh_snap_size = 0;
+static uint32 fh_snap_count = 0;
+
+static time_t fh_snap_time = 0;
+
+static const fh_snap_rec *fh_snap_recs(void)
+{
+    return (const fh_snap_rec *) (fh_snap + sizeof(fh_snap_head));
+}
+
+/*
+ * map the snapshot file
+ */
+static void fh_snap_open(void)
+{
+    const fh_snap_head *head;
+    struct stat buf;
+    void *map;
+    int fd;
+
+    fd = open(opt_fh_snap_file, O_RDONLY);
+    if (fd == -1)
+        return;
+
+    if (fstat(fd, &buf) == -1 || buf.st_size < (off_t) sizeof(fh_snap_head)) {
+        close(fd);
+        return;
+    }
+
+    map = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return;
+
+    head = map;
+    if (memcmp(head->magic, FH_SNAP_MAGIC, 8) != 0 ||
+        head->version != FH_SNAP_VERSION ||
+        head->count > (buf.st_size - sizeof(fh_snap_head)) /
+        sizeof(fh_snap_rec)) {
+        logmsg(LOG_WARNING, "Ignoring invalid fh cache snapshot %s",
+               opt_fh_snap_file);
+        munmap(map, buf.st_size);
+        return;
+    }
+
+    fh_snap = map;
+    fh_snap_size = buf.st_size;
+    fh_snap_count = head->count;
+}
+
+static void fh_snap_close(void)
+{
+    if (fh_snap)
+        munmap((void *) fh_snap, fh_snap_size);
+    fh_snap = NULL;
+    fh_snap_size = 0;
+    fh_snap_count = 0;
+}
+
+/*
+ * path of a record, NULL if the file is damaged
+ */
+static const char *fh_snap_path(const fh_snap_rec * r)
+{
+    size_t max;
+
+    if (r->off < sizeof(fh_snap_head) || r->off >= fh_snap_size)
+        return NULL;
+
+    max = fh_snap_size - r->off;
+    if (max > NFS_MAXPATHLEN)
+        max = NFS_MAXPATHLEN;
+    if (!memchr(fh_snap + r->off, 0, max))
+        return NULL;
+
+    return fh_snap + r->off;
+}
+
+static const fh_snap_rec *fh_snap_find(uint32 dev, uint64 ino)
+{
+    const fh_snap_rec *recs = fh_snap_recs();
+    uint32 lo = 0, hi = fh_snap_count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (recs[mid].dev < dev ||
+            (recs[mid].dev == dev && recs[mid].ino < ino))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < fh_snap_count && recs[lo].dev == dev && recs[lo].ino == ino)
+        return &recs[lo];
+
+    return NULL;
+}
+
+/*
+ * look up a filehandle in the snapshot, adding it to the cache
+ */
+static char *fh_snap_lookup(uint32 dev, uint64 ino)
+{
+    const fh_snap_rec *r;
+    const char *path;
+    backend_statstruct buf;
+
+    if (!fh_snap)
+        return NULL;
+
+    r = fh_snap_find(dev, ino);
+    if (!r || !(path = fh_snap_path(r)))
+        return NULL;
+
+    if (backend_lstat(path, &buf) == -1 || buf.st_dev != dev ||
+        buf.st_ino != ino)
+        return NULL;
+
+    fh_cache_add(dev, ino, path);
+    fh_cache_snap_hit++;
+
+    fix_dir_times(path, &buf);
+    st_cache_valid = TRUE;
+    st_cache = buf;
+
+    return strcpy(fh_cache_path_buf(), path);
+}
+
+static int fh_snap_cmp(const void *a, const void *b)
+{
+    const fh_snap_item *x = a, *y = b;
+
+    if (x->dev != y->dev)
+        return x->dev < y->dev ? -1 : 1;
+    if (x->ino != y->ino)
+        return x->ino < y->ino ? -1 : 1;
+    return 0;
+}
+
+/*
+ * collect the records of the next snapshot, the cache first and then
+ * what is left of the current snapshot
+ */
+static size_t fh_snap_collect(fh_snap_item * items)
+{
+    const fh_snap_rec *recs = fh_snap_recs();
+    unfs3_cache_t *e;
+    size_t n = 0, max = opt_fh_cache_size;
+    uint32 i;
+
+    for (e = lru_first; e && e->name; e = e->next) {
+        items[n].len = fh_name_size(e->name);
+        if (items[n].len == 0)
+            continue;
+        items[n].dev = e->dev;
+        items[n].ino = e->ino;
+        items[n].name = e->name;
+        items[n].path = NULL;
+        n++;
+    }
+
+    for (i = 0; i < fh_snap_count && n < max; i++) {
+        if (fh_cache_index(recs[i].dev, recs[i].ino))
+            continue;
+        items[n].path = fh_snap_path(&recs[i]);
+        if (!items[n].path)
+            continue;
+        items[n].len = strlen(items[n].path);
+        items[n].dev = recs[i].dev;
+        items[n].ino = recs[i].ino;
+        items[n].name = NULL;
+        n++;
+    }
+
+    qsort(items, n, sizeof(fh_snap_item), fh_snap_cmp);
+
+    return n;
+}
+
+/*
+ * put a snapshot together in memory
+ * returns NULL if out of memory
+ */
+static char *fh_snap_build(const fh_snap_item * items, size_t n,
+                           size_t * size)
+{
+    fh_snap_head *head;
+    fh_snap_rec *rec;
+    uint64 off = sizeof(fh_snap_head) + n * sizeof(fh_snap_rec);
+    char *image;
+    size_t i;
+
+    *size = off;
+    for (i = 0; i < n; i++)
+        *size += items[i].len + 1;
+
+    image = calloc(1, *size);
+    if (!image)
+        return NULL;
+
+    head = (fh_snap_head *) image;
+    memcpy(head->magic, FH_SNAP_MAGIC, 8);
+    head->version = FH_SNAP_VERSION;
+    head->count = n;
+
+    rec = (fh_snap_rec *) (head + 1);
+    for (i = 0; i < n; i++) {
+        rec[i].dev = items[i].dev;
+        rec[i].ino = items[i].ino;
+        rec[i].off = off;
+        if (items[i].name)
+            fh_name_path(items[i].name, image + off);
+        else
+            strcpy(image + off, items[i].path);
+        off += items[i].len + 1;
+    }
+
+    return image;
+}
+
+/*
+ * write a snapshot to a new file and make it stable, so that it never
+ * replaces the current one incomplete
+ */
+static int fh_snap_store(const char *path, const char *image, size_t size)
+{
+    ssize_t res;
+    int fd, ok = TRUE;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return FALSE;
+
+    while (ok && size > 0) {
+        res = write(fd, image, size);
+        if (res > 0) {
+            image += res;
+            size -= res;
+        } else if (res == -1 && errno == EINTR)
+            continue;
+        else
+            ok = FALSE;
+    }
+
+    if (ok && fsync(fd) == -1)
+        ok = FALSE;
+    if (close(fd) == -1)
+        ok = FALSE;
+
+    return ok;
+}
+
+/*
+ * write a snapshot if the cache has changed for a while, or at once if
+ * force is set
+ * called by the main loop with the server lock held, which is dropped
+ * while the file is written
+ */
+void fh_cache_checkpoint(int force)
+{
+    char tmp[NFS_MAXPATHLEN];
+    fh_snap_item *items;
+    char *image;
+    size_t n, size;
+    int ok, err = 0;
+
+    if (!opt_fh_snap_file || !fh_snap_dirty ||
+        (!force && time(NULL) - fh_snap_time < FH_SNAP_INTERVAL))
+        return;
+    fh_snap_time = time(NULL);
+
+    items = malloc(((size_t) opt_fh_cache_size + 1) * sizeof(fh_snap_item));
+    image = NULL;
+    if (items) {
+        n = fh_snap_collect(items);
+        image = fh_snap_build(items, n, &size);
+        free(items);
+    }
+    if (!image) {
+        logmsg(LOG_WARNING, "Out of memory, no fh cache snapshot");
+        return;
+    }
+
+    /* changes made while the file is written go into the next one */
+    fh_snap_dirty = FALSE;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", opt_fh_snap_file);
+    worker_io_begin();
+    ok = fh_snap_store(tmp, image, size) &&
+        rename(tmp, opt_fh_snap_file) == 0;
+    if (!ok) {
+        err = errno;
+        remove(tmp);
+    }
+    worker_io_end();
+    free(image);
+
+    if (!ok) {
+        logmsg(LOG_WARNING, "Unable to write fh cache snapshot %s: %s",
+               opt_fh_snap_file, strerror(err));
+        fh_snap_dirty = TRUE;
+        return;
+    }
+
+    fh_snap_close();
+    fh_snap_open();
+}
+
+#else				       /* HAVE_SYS_MMAN_H */
+
+static void fh_snap_open(void)
+{
+}
+
+static char *fh_snap_lookup(U(uint32 dev), U(uint64 ino))
+{
+    return NULL;
+}
+
+void fh_cache_checkpoint(U(int force))
+{
+}
+
+#endif				       /* HAVE_SYS_MMAN_H */
+
 /*
  * update a fh inode cache for an operation like rename
  */
@@ -210,6 +1303,66 @@ void fh_cache_update(nfs_fh3 fh, char *path)
         fh_cache_add(obj->dev, buf.st_ino, path);
     }
 }
+/*
+ * move the name of a renamed object, which moves all entries below it
+ */
+void fh_cache_rename(const char *from, const char *to)
+{
+    fh_name *n, *old, *parent = NULL;
+    const char *last = strrchr(to, '/');
+    uint32 len;
+    char *name;
+
+    n = fh_name_lookup(from);
+    if (!n || !last || to[0] != '/')
+        return;
+
+    /* an object that was replaced is gone */
+    old = fh_name_lookup(to);
+    if (old == n)
+        return;
+    if (old)
+        fh_name_kill(old);
+
+    last++;
+    len = strlen(last);
+    if (last - 1 > to)
+        parent = fh_name_intern(to, last - 1 - to);
+
+    fh_name_unlink(n);
+    if (len > n->len) {
+        name = malloc(len);
+        if (!name) {
+            /* give up on the entries below */
+            fh_name_put(parent);
+            n->flags |= FH_NAME_DEAD;
+            return;
+        }
+        if (n->flags & FH_NAME_OWN)
+            free(n->name);
+        n->name = name;
+        n->flags |= FH_NAME_OWN;
+    }
+    memcpy(n->name, last, len);
+    n->len = len;
+
+    /* the reference to the new parent is moved into n */
+    fh_name_put(n->parent);
+    n->parent = parent;
+    fh_name_link(n);
+}
+
+/*
+ * drop the name of a removed object, and all entries below it
+ */
+void fh_cache_remove(const char *path)
+{
+    fh_name *n = fh_name_lookup(path);
+
+    if (n)
+        fh_name_kill(n);
+}
+
 /*
  * resolve a filename into a path
  * cache-using wrapper for fh_decomp_raw
@@ -219,6 +1372,8 @@ char *fh_decomp(nfs_fh3 fh)
     char *result;
     unfs3_fh_t obj = fh_decode(&fh);
 
+    fh_decomp_pending = FALSE;
+
     if (!nfh_valid(fh)) {
         st_cache_valid = FALSE;
         return NULL;
@@ -271,18 +1426,27 @@ char *fh_decomp(nfs_fh3 fh)
     result = fh_cache_lookup(obj.dev, obj.ino);
     fh_cache_use++;
 
+    if (!result)
+        result = fh_snap_lookup(obj.dev, obj.ino);
+
     if (!result) {
-        /* not found, resolve the hard way */
-        result = fh_decomp_raw(&obj);
+        if (resolve_active())
+            /* long searches are left to the resolver */
+            result = resolve_fh(&obj, &fh_decomp_pending);
+        else {
+            /* not found, resolve the hard way */
+            result = fh_decomp_raw(&obj);
 
-        /* if still not found, do full recursive search) */
-        if (!result)
-            result = backend_locate_file(obj.dev, obj.ino);
+            /* if still not found, do full recursive search) */
+            if (!result)
+                result = backend_locate_file(obj.dev, obj.ino);
+        }
 
-        if (result)
+        if (result) {
             /* add to cache for later use if resolution ok */
-            result = fh_cache_add(obj.dev, obj.ino, result);
-        else
+            fh_cache_add(obj.dev, obj.ino, result);
+            result = strcpy(fh_cache_path_buf(), result);
+        } else
             /* could not resolve in any way */
             st_cache_valid = FALSE;
     } else
@@ -317,7 +1481,7 @@ unfs3_fh_t fh_comp(const char *path, struct svc_req * rqstp, int need_dir)
 unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req * rqstp,
                         int need_dir)
 {
-    static unfs3_fh_t res;
+    static UNFS3_TLS unfs3_fh_t res;
 
     res = fh_comp(path, rqstp, need_dir);
     if (fh_valid(res))
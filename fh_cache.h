@@ -7,18 +7,39 @@
 #ifndef UNFS3_FH_CACHE_H
 #define UNFS3_FH_CACHE_H
 
+/* default and upper limit for -H */
+#define FH_CACHE_DEFAULT	4096
+#define FH_CACHE_MAX		(1 << 26)
+
+/* seconds between snapshots of a changing cache */
+#define FH_SNAP_INTERVAL	60
+
+/* seconds after which watched entries are checked anyway */
+#define FH_WATCH_INTERVAL	30
+
+extern int opt_fh_cache_size;
+extern char *opt_fh_snap_file;
+extern int opt_fh_watch;
+
 /* statistics */
 extern int fh_cache_max;
 extern int fh_cache_use;
 extern int fh_cache_hit;
+extern int fh_cache_names;
+extern int fh_cache_snap_hit;
+
+extern UNFS3_TLS int fh_decomp_pending;
 
 void fh_cache_init(void);
+void fh_cache_checkpoint(int force);
 
 char *fh_decomp(nfs_fh3 fh);
 unfs3_fh_t fh_comp(const char *path, struct svc_req *rqstp, int need_dir);
 unfs3_fh_t *fh_comp_ptr(const char *path, struct svc_req *rqstp, int need_dir);
 
-char *fh_cache_add(uint32 dev, uint64 ino, const char *path);
+void fh_cache_add(uint32 dev, uint64 ino, const char *path);
 void fh_cache_update(nfs_fh3 fh, char *path);
+void fh_cache_rename(const char *from, const char *to);
+void fh_cache_remove(const char *path);
 
 #endif
@@ -28,6 +28,7 @@
 #include "fh.h"
 #include "daemon.h"
 #include "attr.h"
+#include "search.h"
 
 /*
  * these are the brute-force file searching routines that are used
@@ -42,6 +43,50 @@
 
 #if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
 
+#ifdef UNFS3_SEARCH
+/* object searched for by locate_pfx */
+typedef struct {
+    uint32 dev;
+    uint64 ino;
+} locate_target;
+
+/*
+ * what the brute force search descends into
+ */
+static int locate_visit(const backend_statstruct * buf, U(int level),
+                        void *arg)
+{
+    locate_target *t = arg;
+
+    if (buf->st_dev != t->dev)
+        return SEARCH_SKIP;
+    if (buf->st_ino == t->ino)
+        return SEARCH_FOUND;
+    return SEARCH_DESCEND;
+}
+
+/*
+ * locate file given prefix, device, and inode number
+ * with several threads
+ */
+static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
+{
+    backend_statstruct buf;
+    locate_target t;
+
+    t.dev = dev;
+    t.ino = ino;
+    if (!search_tree(pfx, locate_visit, &t, result, &buf))
+        return FALSE;
+
+    fix_dir_times(result, &buf);
+    st_cache = buf;
+    st_cache_valid = TRUE;
+    return TRUE;
+}
+
+#else				       /* UNFS3_SEARCH */
+
 /*
  * locate file given prefix, device, and inode number
  */
@@ -91,6 +136,7 @@ static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
     closedir(search);
     return FALSE;
 }
+#endif				       /* UNFS3_SEARCH */
 #endif
 
 /*
@@ -101,7 +147,7 @@ static int locate_pfx(const char *pfx, uint32 dev, uint64 ino, char *result)
 char *locate_file(U(uint32 dev), U(uint64 ino))
 {
 #if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
-    static char path[NFS_MAXPATHLEN];
+    static UNFS3_TLS char path[NFS_MAXPATHLEN];
     FILE *mtab;
     struct stat buf;
     int res;
@@ -171,3 +217,20 @@ char *locate_file(U(uint32 dev), U(uint64 ino))
 
     return NULL;
 }
+
+/*
+ * locate file given device and inode number below a directory
+ *
+ * also done without -b, for objects known to exist somewhere
+ */
+char *locate_file_below(U(const char *dir), U(uint32 dev), U(uint64 ino))
+{
+#if HAVE_MNTENT_H == 1 || HAVE_SYS_MNTTAB_H == 1
+    static UNFS3_TLS char path[NFS_MAXPATHLEN];
+
+    if (locate_pfx(dir, dev, ino, path) == TRUE)
+        return path;
+#endif
+
+    return NULL;
+}
@@ -9,5 +9,6 @@
 #define UNFS3_LOCATE_H
 
 char *locate_file(uint32 dev, uint64 ino);
+char *locate_file_below(const char *dir, uint32 dev, uint64 ino);
 
 #endif
@@ -161,8 +161,8 @@ mountres3 *mountproc_mnt_3_svc(dirpath * argp, struct svc_req * rqstp)
     char buf[PATH_MAX];
     unfs3_fh_t fh;
     nfs_fh3 nfh;
-    static char fhbuf[FH_MAXBUF];
-    static mountres3 result;
+    static UNFS3_TLS char fhbuf[FH_MAXBUF];
+    static UNFS3_TLS mountres3 result;
     static int auth = AUTH_UNIX;
     int authenticated = 0;
     char *password;
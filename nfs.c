@@ -38,6 +38,7 @@
 
 #include "nfs.h"
 #include "mount.h"
+#include "xdr.h"
 #include "fh.h"
 #include "fh_cache.h"
 #include "attr.h"
@@ -47,6 +48,9 @@
 #include "fd_cache.h"
 #include "daemon.h"
 #include "backend.h"
+#include "worker.h"
+#include "aio.h"
+#include "conn.h"
 #include "Config/exports.h"
 #include "Extras/cluster.h"
 
@@ -62,6 +66,8 @@
                           memset(&result, 0, sizeof(result));	\
                           if (p)				\
                               result.status = NFS3ERR_ACCES;	\
+                          else if (fh_decomp_pending)		\
+                              result.status = NFS3ERR_JUKEBOX;	\
                           else					\
                               result.status = NFS3ERR_STALE;	\
                           return &result;			\
@@ -131,13 +137,17 @@ void *nfsproc3_null_3_svc(U(void *argp), U(struct svc_req *rqstp))
 GETATTR3res *nfsproc3_getattr_3_svc(GETATTR3args * argp,
                                     struct svc_req * rqstp)
 {
-    static GETATTR3res result;
+    static UNFS3_TLS GETATTR3res result;
     char *path;
     post_op_attr post;
 
     PREP(path, argp->object);
     post = get_post_cached(rqstp);
 
+    /* the size has to include gathered writes */
+    if (fd_flush(argp->object))
+        post = get_post_stat(path, rqstp);
+
     result.status = NFS3_OK;
     result.GETATTR3res_u.resok.obj_attributes =
         post.post_op_attr_u.attributes;
@@ -166,7 +176,7 @@ static nfsstat3 in_sync(sattrguard3 guard, pre_op_attr pre)
 SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
                                     struct svc_req * rqstp)
 {
-    static SETATTR3res result;
+    static UNFS3_TLS SETATTR3res result;
     pre_op_attr pre;
     char *path;
 
@@ -174,8 +184,11 @@ SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
     pre = get_pre_cached();
     result.status = join(in_sync(argp->guard, pre), exports_rw());
 
-    if (result.status == NFS3_OK)
+    if (result.status == NFS3_OK) {
+        /* gathered writes must not extend the file after a truncate */
+        fd_flush(argp->object);
         result.status = set_attr(path, argp->object, argp->new_attributes);
+    }
 
     /* overlaps with resfail */
     result.SETATTR3res_u.resok.obj_wcc.before = pre;
@@ -186,9 +199,9 @@ SETATTR3res *nfsproc3_setattr_3_svc(SETATTR3args * argp,
 
 LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 {
-    static LOOKUP3res result;
+    static UNFS3_TLS LOOKUP3res result;
     unfs3_fh_t *fh;
-    static char fhbuf[FH_MAXBUF];
+    static UNFS3_TLS char fhbuf[FH_MAXBUF];
     char *path;
     char obj[NFS_MAXPATHLEN];
     backend_statstruct buf;
@@ -210,7 +223,7 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
                 fh = fh_comp_ptr(obj, rqstp, 0);
             } else {
                 gen = backend_get_gen(buf, FD_NONE, obj);
-                fh = fh_extend(argp->what.dir, buf.st_dev, buf.st_ino, gen);
+                fh = fh_extend(argp->what.dir, obj, &buf, gen);
                 fh_cache_add(buf.st_dev, buf.st_ino, obj);
             }
 
@@ -234,7 +247,7 @@ LOOKUP3res *nfsproc3_lookup_3_svc(LOOKUP3args * argp, struct svc_req * rqstp)
 
 ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
 {
-    static ACCESS3res result;
+    static UNFS3_TLS ACCESS3res result;
     char *path;
     post_op_attr post;
     mode_t mode;
@@ -279,9 +292,9 @@ ACCESS3res *nfsproc3_access_3_svc(ACCESS3args * argp, struct svc_req * rqstp)
 READLINK3res *nfsproc3_readlink_3_svc(READLINK3args * argp,
                                       struct svc_req * rqstp)
 {
-    static READLINK3res result;
+    static UNFS3_TLS READLINK3res result;
     char *path;
-    static char buf[NFS_MAXPATHLEN];
+    static UNFS3_TLS char buf[NFS_MAXPATHLEN];
     int res;
 
     PREP(path, argp->symlink);
@@ -304,12 +317,458 @@ READLINK3res *nfsproc3_readlink_3_svc(READLINK3args * argp,
     return &result;
 }
 
+/*
+ * asynchronous READ, WRITE and COMMIT
+ *
+ * with io_uring enabled, these hand their file operation to the ring
+ * and return without a reply. The completion handler runs in the main
+ * loop and passes the request on to a worker, which finishes it and
+ * sends the reply, so a slow client cannot hold up the main loop.
+ * Everything the handler would have kept on its stack lives in a
+ * request structure instead.
+ */
+
+/* state common to all asynchronous requests */
+typedef struct {
+    struct svc_req *req;	/* kept alive by the transport */
+    int fd;
+    char path[NFS_MAXPATHLEN];
+    char fh_data[NFS3_FHSIZE];
+    nfs_fh3 fh;
+} async_req;
+
+/*
+ * check whether a request may wait for asynchronous I/O
+ *
+ * only requests on connections are deferred, UDP requests are answered
+ * right away
+ */
+static int async_ok(struct svc_req *rqstp)
+{
+    return aio_active() && get_socket_type(rqstp) == SOCK_STREAM;
+}
+
+/*
+ * claim ring slots and defer the reply of a request
+ */
+static int async_start(async_req * a, struct svc_req *rqstp, int ops,
+                       const char *path, nfs_fh3 fh, int fd)
+{
+    if (!aio_reserve(ops))
+        return FALSE;
+
+    if (!conn_defer(rqstp)) {
+        aio_release(ops);
+        return FALSE;
+    }
+
+    a->req = rqstp;
+    a->fd = fd;
+    strcpy(a->path, path);
+    memcpy(a->fh_data, fh.data.data_val, fh.data.data_len);
+    a->fh.data.data_len = fh.data.data_len;
+    a->fh.data.data_val = a->fh_data;
+
+    return TRUE;
+}
+
+/*
+ * post-operation attributes for a finished asynchronous request
+ */
+static post_op_attr async_post_attr(async_req * a)
+{
+    const char *path = a->path;
+
+    /* restore the export options of the request */
+    switch_to_root();
+    if (exports_options(path, a->req, NULL, NULL) == -1)
+        path = NULL;
+
+    return get_post_attr(path, a->fh, a->req);
+}
+
+/* READ waiting for its data */
+typedef struct {
+    async_req a;
+    aio_op op;
+    READ3res result;
+    count3 count;
+    char *buf;
+    int res;			/* result of the read */
+} read_req;
+
+/*
+ * fill in the result of a READ from the return value of pread()
+ */
+static void read_result(READ3res * result, int fd, count3 count, int res,
+                        char *buf)
+{
+    /* eof if we could not read one more */
+    result->READ3res_u.resok.eof = (res <= (int64) count);
+
+    /* the fd cache decides how long to keep the fd after eof */
+    if (result->READ3res_u.resok.eof)
+        fd_close(fd, UNFS3_FD_READ, FD_CLOSE_EOF);
+    else {
+        fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
+        res--;
+    }
+
+    if (res >= 0) {
+        result->READ3res_u.resok.count = res;
+        result->READ3res_u.resok.data.data_len = res;
+        result->READ3res_u.resok.data.data_val = buf;
+    } else {
+        /* error during read() */
+
+        /* EINVAL means unreadable object */
+        if (errno == EINVAL)
+            result->status = NFS3ERR_INVAL;
+        else
+            result->status = NFS3ERR_IO;
+    }
+}
+
+static void read_finish(void *arg)
+{
+    read_req *r = arg;
+    int res = r->res;
+
+    worker_lock();
+    if (res < 0) {
+        errno = -res;
+        res = -1;
+    }
+    read_result(&r->result, r->a.fd, r->count, res, r->buf);
+    r->result.READ3res_u.resok.file_attributes = async_post_attr(&r->a);
+    worker_unlock();
+
+    conn_reply(r->a.req, (xdrproc_t) xdr_READ3res, &r->result);
+    free(r);
+}
+
+static void read_done(aio_op * op, int res)
+{
+    read_req *r = op->arg;
+
+    r->res = res;
+    conn_finish(r->a.req, read_finish, r);
+}
+
+/*
+ * start reading through the ring, read_done() sends the reply
+ */
+static int read_async(READ3args * argp, struct svc_req *rqstp,
+                      const char *path, int fd)
+{
+    read_req *r;
+
+    if (!async_ok(rqstp))
+        return FALSE;
+
+    r = malloc(sizeof(read_req) + argp->count + 1);
+    if (!r)
+        return FALSE;
+
+    if (!async_start(&r->a, rqstp, 1, path, argp->file, fd)) {
+        free(r);
+        return FALSE;
+    }
+
+    r->result.status = NFS3_OK;
+    r->count = argp->count;
+    r->buf = (char *) (r + 1);
+
+    /* read one more to check for eof */
+    r->op.opcode = AIO_READ;
+    r->op.fd = fd;
+    r->op.iov.iov_base = r->buf;
+    r->op.iov.iov_len = argp->count + 1;
+    r->op.offset = argp->offset;
+    r->op.link = FALSE;
+    r->op.done = read_done;
+    r->op.arg = r;
+    aio_queue(&r->op);
+
+    return TRUE;
+}
+
+/*
+ * answer a READ with data sent straight from the file to the connection
+ * returns FALSE if the request has to be served by copying the data
+ */
+static int read_file(READ3res * result, READ3args * argp,
+                     struct svc_req *rqstp, const char *path, int fd)
+{
+    backend_statstruct buf;
+    count3 count = 0;
+
+    if (argp->count < CONN_FILE_MIN)
+        return FALSE;
+
+    /* io_uring keeps the main loop from blocking, it is preferred there */
+    if (aio_active() && !worker_active())
+        return FALSE;
+
+    /* the data length is part of the header, so it has to be known
+       before anything is sent */
+    if (backend_fstat(fd, &buf) == -1)
+        return FALSE;
+
+    /* from here on, the reply has to go through conn_reply_file() */
+    if (!conn_file_ok(rqstp))
+        return FALSE;
+    if (argp->offset < (uint64) buf.st_size)
+        count = buf.st_size - argp->offset;
+    if (count > argp->count)
+        count = argp->count;
+
+    result->READ3res_u.resok.file_attributes = get_post_stat(path, rqstp);
+    result->READ3res_u.resok.count = count;
+    result->READ3res_u.resok.eof =
+        (argp->offset + count >= (uint64) buf.st_size);
+    result->READ3res_u.resok.data.data_len = 0;
+    result->READ3res_u.resok.data.data_val = NULL;
+
+    worker_io_begin();
+    conn_reply_file(rqstp, (xdrproc_t) xdr_READ3res, result, fd,
+                    (off64_t) argp->offset, count);
+    worker_io_end();
+
+    /* the fd cache decides how long to keep the fd after eof */
+    fd_close(fd, UNFS3_FD_READ,
+             result->READ3res_u.resok.eof ? FD_CLOSE_EOF : FD_CLOSE_VIRT);
+
+    return TRUE;
+}
+
+/* WRITE waiting for its data to be written and maybe synced */
+typedef struct {
+    async_req a;
+    aio_op op;
+    aio_op sync;
+    WRITE3res result;
+    stable_how stable;		/* how the data is written */
+    stable_how committed;	/* what the reply says */
+    char *data;
+    int pending;		/* ops not completed yet */
+    int res;			/* result of the write */
+    int sync_res;		/* result of the fsync */
+} write_req;
+
+/*
+ * fill in the result of a WRITE from the return values of pwrite()
+ * and fd_close()
+ */
+static void write_result(WRITE3res * result, nfs_fh3 fh, stable_how stable,
+                         int res, int res_close)
+{
+    if (res != -1 && res_close != -1) {
+        result->WRITE3res_u.resok.count = res;
+        result->WRITE3res_u.resok.committed = stable;
+        fd_verifier(fh, result->WRITE3res_u.resok.verf);
+    } else {
+        /* error during write or close */
+        result->status = write_write_err();
+    }
+}
+
+static void write_finish(void *arg)
+{
+    write_req *w = arg;
+    int res_close, err = 0;
+
+    worker_lock();
+    if (w->stable == UNSTABLE) {
+        if (w->res > 0)
+            fd_dirty(w->a.fd, w->op.offset, w->res);
+        res_close = fd_close(w->a.fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
+    }
+    else if (w->sync_res == -ECANCELED)
+        /* a short or failed write broke the link to the fsync */
+        res_close = fd_close(w->a.fd, UNFS3_FD_WRITE,
+                             w->stable == DATA_SYNC ? FD_CLOSE_DSYNC :
+                             FD_CLOSE_REAL);
+    else {
+        if (w->sync_res < 0)
+            err = -w->sync_res;
+        res_close = fd_close_synced(w->a.fd, UNFS3_FD_WRITE,
+                                    w->sync_res < 0 ? -1 : 0);
+    }
+
+    if (w->res < 0)
+        errno = -w->res;
+    else if (res_close == -1 && err)
+        errno = err;
+
+    write_result(&w->result, w->a.fh, w->committed,
+                 w->res < 0 ? -1 : w->res, res_close);
+    w->result.WRITE3res_u.resok.file_wcc.after = async_post_attr(&w->a);
+    worker_unlock();
+
+    conn_reply(w->a.req, (xdrproc_t) xdr_WRITE3res, &w->result);
+    free(w);
+}
+
+static void write_done(aio_op * op, int res)
+{
+    write_req *w = op->arg;
+
+    if (op == &w->op)
+        w->res = res;
+    else
+        w->sync_res = res;
+
+    if (--w->pending == 0)
+        conn_finish(w->a.req, write_finish, w);
+}
+
+/*
+ * start writing through the ring, write_done() sends the reply
+ * stable writes are followed by an fsync linked to the write
+ */
+static int write_async(WRITE3args * argp, struct svc_req *rqstp,
+                       const char *path, int fd, stable_how stable)
+{
+    write_req *w;
+    int ops = (stable == UNSTABLE) ? 1 : 2;
+
+    /* gathered writes are done synchronously */
+    if (!async_ok(rqstp) ||
+        (stable == UNSTABLE && (exports_opts & OPT_WDELAY)))
+        return FALSE;
+
+    /* earlier writes go first */
+    fd_flush(argp->file);
+
+    w = malloc(sizeof(write_req));
+    if (!w)
+        return FALSE;
+
+    if (!async_start(&w->a, rqstp, ops, path, argp->file, fd)) {
+        free(w);
+        return FALSE;
+    }
+
+    w->result.status = NFS3_OK;
+    w->result.WRITE3res_u.resok.file_wcc.before = get_pre_cached();
+    w->stable = stable;
+    w->committed = argp->stable;
+    w->pending = ops;
+    w->res = 0;
+    w->sync_res = 0;
+
+    /* the data is left in the request record, which is kept until the
+       reply has been sent */
+    w->data = argp->data.data_val;
+
+    w->op.opcode = AIO_WRITE;
+    w->op.fd = fd;
+    w->op.iov.iov_base = w->data;
+    w->op.iov.iov_len = argp->data.data_len;
+    w->op.offset = argp->offset;
+    w->op.link = (ops == 2);
+    w->op.done = write_done;
+    w->op.arg = w;
+    aio_queue(&w->op);
+
+    if (ops == 2) {
+        w->sync.opcode =
+            (stable == DATA_SYNC) ? AIO_FDATASYNC : AIO_FSYNC;
+        w->sync.fd = fd;
+        w->sync.link = FALSE;
+        w->sync.done = write_done;
+        w->sync.arg = w;
+        aio_queue(&w->sync);
+    }
+
+    return TRUE;
+}
+
+/* COMMIT waiting for its fdatasync */
+typedef struct {
+    async_req a;
+    aio_op op;
+    COMMIT3res result;
+    uint32 seq;			/* for fd_close_datasynced() */
+    int res;			/* result of the fdatasync */
+} commit_req;
+
+static void commit_finish(void *arg)
+{
+    commit_req *c = arg;
+    int res;
+
+    worker_lock();
+    res = fd_close_datasynced(c->a.fd, c->seq, c->res < 0 ? -1 : 0);
+    if (res != -1)
+        fd_verifier(c->a.fh, c->result.COMMIT3res_u.resok.verf);
+    else
+        /* error during fsync() or close() */
+        c->result.status = NFS3ERR_IO;
+    c->result.COMMIT3res_u.resfail.file_wcc.after = async_post_attr(&c->a);
+    worker_unlock();
+
+    conn_reply(c->a.req, (xdrproc_t) xdr_COMMIT3res, &c->result);
+    free(c);
+}
+
+static void commit_done(aio_op * op, int res)
+{
+    commit_req *c = op->arg;
+
+    c->res = res;
+    conn_finish(c->a.req, commit_finish, c);
+}
+
+/*
+ * start syncing through the ring, commit_done() sends the reply
+ */
+static int commit_async(COMMIT3args * argp, struct svc_req *rqstp,
+                        const char *path)
+{
+    commit_req *c;
+    int fd;
+
+    if (!async_ok(rqstp))
+        return FALSE;
+
+    c = malloc(sizeof(commit_req));
+    if (!c)
+        return FALSE;
+
+    fd = fd_sync_open(argp->file, argp->offset, argp->count, &c->seq);
+    if (fd == -1) {
+        free(c);
+        return FALSE;
+    }
+
+    if (!async_start(&c->a, rqstp, 1, path, argp->file, fd)) {
+        fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
+        free(c);
+        return FALSE;
+    }
+
+    c->result.status = NFS3_OK;
+    c->result.COMMIT3res_u.resfail.file_wcc.before = get_pre_cached();
+
+    c->op.opcode = AIO_FDATASYNC;
+    c->op.fd = fd;
+    c->op.link = FALSE;
+    c->op.done = commit_done;
+    c->op.arg = c;
+    aio_queue(&c->op);
+
+    return TRUE;
+}
+
 READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 {
-    static READ3res result;
+    static UNFS3_TLS READ3res result;
     char *path;
+    char pathbuf[NFS_MAXPATHLEN];
     int fd, res;
-    static char buf[NFS_MAXDATA_TCP + 1];
+    static UNFS3_TLS char buf[NFS_MAXDATA_TCP + 1];
     unsigned int maxdata;
 
     if (get_socket_type(rqstp) == SOCK_STREAM)
@@ -320,6 +779,9 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
     PREP(path, argp->file);
     result.status = is_reg();
 
+    /* the cache entry may be reused while the server lock is dropped */
+    path = strcpy(pathbuf, path);
+
     /* handle reading of executables */
     read_executable(rqstp, st_cache);
 
@@ -332,34 +794,20 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 
     if (result.status == NFS3_OK) {
         fd = fd_open(path, argp->file, UNFS3_FD_READ, TRUE);
+        if (fd != -1 && read_file(&result, argp, rqstp, path, fd))
+            /* reply has been sent from the file */
+            return NULL;
+        if (fd != -1 && read_async(argp, rqstp, path, fd))
+            /* reply is sent when the data has been read */
+            return NULL;
+
         if (fd != -1) {
             /* read one more to check for eof */
+            worker_io_begin();
             res = backend_pread(fd, buf, argp->count + 1, (off64_t)argp->offset);
+            worker_io_end();
 
-            /* eof if we could not read one more */
-            result.READ3res_u.resok.eof = (res <= (int64) argp->count);
-
-            /* close for real when hitting eof */
-            if (result.READ3res_u.resok.eof)
-                fd_close(fd, UNFS3_FD_READ, FD_CLOSE_REAL);
-            else {
-                fd_close(fd, UNFS3_FD_READ, FD_CLOSE_VIRT);
-                res--;
-            }
-
-            if (res >= 0) {
-                result.READ3res_u.resok.count = res;
-                result.READ3res_u.resok.data.data_len = res;
-                result.READ3res_u.resok.data.data_val = buf;
-            } else {
-                /* error during read() */
-
-                /* EINVAL means unreadable object */
-                if (errno == EINVAL)
-                    result.status = NFS3ERR_INVAL;
-                else
-                    result.status = NFS3ERR_IO;
-            }
+            read_result(&result, fd, argp->count, res, buf);
         } else
             /* opening for read failed */
             result.status = read_err();
@@ -373,13 +821,23 @@ READ3res *nfsproc3_read_3_svc(READ3args * argp, struct svc_req * rqstp)
 
 WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
 {
-    static WRITE3res result;
+    static UNFS3_TLS WRITE3res result;
     char *path;
-    int fd, res, res_close;
+    char pathbuf[NFS_MAXPATHLEN];
+    int fd, res, res_close, gather;
+    stable_how stable;
+    uint64 end = 0;
 
     PREP(path, argp->file);
     result.status = join(is_reg(), exports_rw());
 
+    /* async exports write all data like UNSTABLE writes */
+    stable = (exports_opts & OPT_ASYNC) ? UNSTABLE : argp->stable;
+    gather = (stable == UNSTABLE && (exports_opts & OPT_WDELAY));
+
+    /* the cache entry may be reused while the server lock is dropped */
+    path = strcpy(pathbuf, path);
+
     /* handle write of owned files */
     write_by_owner(rqstp, st_cache);
 
@@ -390,32 +848,29 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
            fd will be removed from the cache by fd_close() below, so adding
            it to and removing it from the cache is just a waste of CPU cycles
          */
-        fd = fd_open(path, argp->file, UNFS3_FD_WRITE,
-                     (argp->stable == UNSTABLE));
+        fd = fd_open(path, argp->file, UNFS3_FD_WRITE, (stable == UNSTABLE));
+        if (fd != -1 && write_async(argp, rqstp, path, fd, stable))
+            /* reply is sent when the data has been written */
+            return NULL;
+
         if (fd != -1) {
-            res =
-                backend_pwrite(fd, argp->data.data_val, argp->data.data_len,
-                               (off64_t)argp->offset);
+            res = fd_write(fd, argp->data.data_val, argp->data.data_len,
+                           argp->offset, gather);
+            if (gather && res > 0)
+                end = argp->offset + res;
 
             /* close for real if not UNSTABLE write */
-            if (argp->stable == UNSTABLE)
+            if (stable == UNSTABLE) {
+                if (res > 0)
+                    fd_dirty(fd, argp->offset, res);
                 res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_VIRT);
+            }
+            else if (stable == DATA_SYNC)
+                res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_DSYNC);
             else
                 res_close = fd_close(fd, UNFS3_FD_WRITE, FD_CLOSE_REAL);
 
-            /* we always do fsync(), never fdatasync() */
-            if (argp->stable == DATA_SYNC)
-                argp->stable = FILE_SYNC;
-
-            if (res != -1 && res_close != -1) {
-                result.WRITE3res_u.resok.count = res;
-                result.WRITE3res_u.resok.committed = argp->stable;
-                memcpy(result.WRITE3res_u.resok.verf, wverf,
-                       NFS3_WRITEVERFSIZE);
-            } else {
-                /* error during write or close */
-                result.status = write_write_err();
-            }
+            write_result(&result, argp->file, argp->stable, res, res_close);
         } else
             /* could not open for writing */
             result.status = write_open_err();
@@ -425,6 +880,15 @@ WRITE3res *nfsproc3_write_3_svc(WRITE3args * argp, struct svc_req * rqstp)
     result.WRITE3res_u.resok.file_wcc.before = get_pre_cached();
     result.WRITE3res_u.resok.file_wcc.after = get_post_stat(path, rqstp);
 
+    /* a gathered write may not have reached the file yet */
+    if (end > 0 && result.WRITE3res_u.resok.file_wcc.after.attributes_follow) {
+        fattr3 *attr =
+            &result.WRITE3res_u.resok.file_wcc.after.post_op_attr_u.attributes;
+
+        if (attr->size < end)
+            attr->size = end;
+    }
+
     return &result;
 }
 
@@ -495,7 +959,7 @@ static int check_create_verifier(backend_statstruct * buf, createverf3 verf)
 
 CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 {
-    static CREATE3res result;
+    static UNFS3_TLS CREATE3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     sattr3 new_attr;
@@ -550,7 +1014,7 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
             fh_cache_add(buf.st_dev, buf.st_ino, obj);
 
             result.CREATE3res_u.resok.obj =
-                fh_extend_post(argp->where.dir, buf.st_dev, buf.st_ino, gen);
+                fh_extend_post(argp->where.dir, obj, &buf, gen);
             result.CREATE3res_u.resok.obj_attributes =
                 get_post_buf(buf, rqstp);
         }
@@ -577,8 +1041,7 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
                         fh_cache_add(buf.st_dev, buf.st_ino, obj);
 
                         result.CREATE3res_u.resok.obj =
-                            fh_extend_post(argp->where.dir, buf.st_dev,
-                                           buf.st_ino, gen);
+                            fh_extend_post(argp->where.dir, obj, &buf, gen);
                         result.CREATE3res_u.resok.obj_attributes =
                             get_post_buf(buf, rqstp);
                     } else {
@@ -604,7 +1067,7 @@ CREATE3res *nfsproc3_create_3_svc(CREATE3args * argp, struct svc_req * rqstp)
 
 MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
 {
-    static MKDIR3res result;
+    static UNFS3_TLS MKDIR3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -642,7 +1105,7 @@ MKDIR3res *nfsproc3_mkdir_3_svc(MKDIR3args * argp, struct svc_req * rqstp)
 SYMLINK3res *nfsproc3_symlink_3_svc(SYMLINK3args * argp,
                                     struct svc_req * rqstp)
 {
-    static SYMLINK3res result;
+    static UNFS3_TLS SYMLINK3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -765,7 +1228,7 @@ static nfsstat3 mknod_args(mknoddata3 what, const char *obj, mode_t * mode,
 
 MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
 {
-    static MKNOD3res result;
+    static UNFS3_TLS MKNOD3res result;
     char *path;
     pre_op_attr pre;
     post_op_attr post;
@@ -811,7 +1274,7 @@ MKNOD3res *nfsproc3_mknod_3_svc(MKNOD3args * argp, struct svc_req * rqstp)
 
 REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
 {
-    static REMOVE3res result;
+    static UNFS3_TLS REMOVE3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
@@ -827,6 +1290,8 @@ REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
         res = backend_remove(obj);
         if (res == -1)
             result.status = remove_err();
+        else
+            fh_cache_remove(obj);
     }
 
     /* overlaps with resfail */
@@ -838,7 +1303,7 @@ REMOVE3res *nfsproc3_remove_3_svc(REMOVE3args * argp, struct svc_req * rqstp)
 
 RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
 {
-    static RMDIR3res result;
+    static UNFS3_TLS RMDIR3res result;
     char *path;
     char obj[NFS_MAXPATHLEN];
     int res;
@@ -854,6 +1319,8 @@ RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
         res = backend_rmdir(obj);
         if (res == -1)
             result.status = rmdir_err();
+        else
+            fh_cache_remove(obj);
     }
 
     /* overlaps with resfail */
@@ -865,7 +1332,7 @@ RMDIR3res *nfsproc3_rmdir_3_svc(RMDIR3args * argp, struct svc_req * rqstp)
 
 RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 {
-    static RENAME3res result;
+    static UNFS3_TLS RENAME3res result;
     char *from;
     char *to;
     char from_obj[NFS_MAXPATHLEN];
@@ -882,6 +1349,8 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
     cluster_lookup(from_obj, rqstp, &result.status);
 
     to = fh_decomp(argp->to.dir);
+    if (!to && fh_decomp_pending && result.status == NFS3_OK)
+        result.status = NFS3ERR_JUKEBOX;
 
     if (result.status == NFS3_OK) {
         result.status =
@@ -895,6 +1364,8 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
             res = backend_rename(from_obj, to_obj);
             if (res == -1)
                 result.status = rename_err();
+            else
+                fh_cache_rename(from_obj, to_obj);
             /* Update the fh_cache with moved inode value */
             fh_cache_update(argp->to.dir, to_obj);
         }
@@ -913,7 +1384,7 @@ RENAME3res *nfsproc3_rename_3_svc(RENAME3args * argp, struct svc_req * rqstp)
 
 LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
 {
-    static LINK3res result;
+    static UNFS3_TLS LINK3res result;
     char *path, *old;
     pre_op_attr pre;
     post_op_attr post;
@@ -937,7 +1408,7 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
                 result.status = link_err();
         }
     } else if (!old)
-        result.status = NFS3ERR_STALE;
+        result.status = fh_decomp_pending ? NFS3ERR_JUKEBOX : NFS3ERR_STALE;
 
     post = get_post_attr(path, argp->link.dir, rqstp);
 
@@ -952,7 +1423,7 @@ LINK3res *nfsproc3_link_3_svc(LINK3args * argp, struct svc_req * rqstp)
 READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp,
                                     struct svc_req * rqstp)
 {
-    static READDIR3res result;
+    static UNFS3_TLS READDIR3res result;
     char *path;
 
     PREP(path, argp->dir);
@@ -966,7 +1437,7 @@ READDIR3res *nfsproc3_readdir_3_svc(READDIR3args * argp,
 READDIRPLUS3res *nfsproc3_readdirplus_3_svc(U(READDIRPLUS3args * argp),
         U(struct svc_req * rqstp))
 {
-    static READDIRPLUS3res result;
+    static UNFS3_TLS READDIRPLUS3res result;
 
     /*
      * we don't do READDIRPLUS since it involves filehandle and
@@ -981,7 +1452,7 @@ READDIRPLUS3res *nfsproc3_readdirplus_3_svc(U(READDIRPLUS3args * argp),
 
 FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
 {
-    static FSSTAT3res result;
+    static UNFS3_TLS FSSTAT3res result;
     char *path;
     backend_statvfsstruct buf;
     int res;
@@ -1027,7 +1498,7 @@ FSSTAT3res *nfsproc3_fsstat_3_svc(FSSTAT3args * argp, struct svc_req * rqstp)
 
 FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
 {
-    static FSINFO3res result;
+    static UNFS3_TLS FSINFO3res result;
     char *path;
     unsigned int maxdata;
 
@@ -1059,7 +1530,7 @@ FSINFO3res *nfsproc3_fsinfo_3_svc(FSINFO3args * argp, struct svc_req * rqstp)
 PATHCONF3res *nfsproc3_pathconf_3_svc(PATHCONF3args * argp,
                                       struct svc_req * rqstp)
 {
-    static PATHCONF3res result;
+    static UNFS3_TLS PATHCONF3res result;
     char *path;
 
     PREP(path, argp->object);
@@ -1080,17 +1551,28 @@ PATHCONF3res *nfsproc3_pathconf_3_svc(PATHCONF3args * argp,
 
 COMMIT3res *nfsproc3_commit_3_svc(COMMIT3args * argp, struct svc_req * rqstp)
 {
-    static COMMIT3res result;
+    static UNFS3_TLS COMMIT3res result;
     char *path;
+    char pathbuf[NFS_MAXPATHLEN];
     int res;
 
     PREP(path, argp->file);
     result.status = join(is_reg(), exports_rw());
 
-    if (result.status == NFS3_OK) {
-        res = fd_sync(argp->file);
+    /* the cache entry may be reused while the server lock is dropped */
+    path = strcpy(pathbuf, path);
+
+    if (result.status == NFS3_OK && (exports_opts & OPT_ASYNC))
+        /* the data is left to the writeback of the fd cache */
+        fd_verifier(argp->file, result.COMMIT3res_u.resok.verf);
+    else if (result.status == NFS3_OK) {
+        if (commit_async(argp, rqstp, path))
+            /* reply is sent when the data is on disk */
+            return NULL;
+
+        res = fd_sync(argp->file, argp->offset, argp->count);
         if (res != -1)
-            memcpy(result.COMMIT3res_u.resok.verf, wverf, NFS3_WRITEVERFSIZE);
+            fd_verifier(argp->file, result.COMMIT3res_u.resok.verf);
         else
             /* error during fsync() or close() */
             result.status = NFS3ERR_IO;
@@ -67,13 +67,13 @@ READDIR3res read_dir(const char *path, cookie3 cookie, cookieverf3 verf,
     READDIR3res result;
     READDIR3resok resok;
     cookie3 upper;
-    static entry3 entry[MAX_ENTRIES];
+    static UNFS3_TLS entry3 entry[MAX_ENTRIES];
     backend_statstruct buf;
     int res;
     backend_dirstream *search;
     struct dirent *this;
     count3 i, real_count;
-    static char obj[NFS_MAXPATHLEN * MAX_ENTRIES];
+    static UNFS3_TLS char obj[NFS_MAXPATHLEN * MAX_ENTRIES];
     char scratch[NFS_MAXPATHLEN];
 
     /* check upper part of cookie */
@@ -0,0 +1,258 @@
+
+/*
+ * UNFS3 background filehandle resolver
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "fh.h"
+#include "fh_cache.h"
+#include "user.h"
+#include "worker.h"
+#include "backend.h"
+#include "locate.h"
+#include "resolve.h"
+
+/*
+ * intention of the background resolver
+ *
+ * a filehandle that is not in the fh cache has to be found by searching
+ * directories, guided by the inode hashes stored in the handle, and with
+ * -b by a search of the whole filesystem. Such a search can take seconds
+ * and used to hold the server lock all that time.
+ *
+ * now a request first tries the guided search itself, but gives up
+ * after RESOLVE_INLINE_LIMIT directory entries. The rest of the work is
+ * queued to the resolver thread, and the request is answered with
+ * NFS3ERR_JUKEBOX, which makes the client retry later. The resolver
+ * runs without the server lock and puts what it finds into the fh cache,
+ * where the retried request picks it up. A search that failed is
+ * remembered for RESOLVE_KEEP seconds, so retries get NFS3ERR_STALE
+ * instead of starting over.
+ *
+ * the resolver looks at the filesystem as root, so it needs per-thread
+ * filesystem ids.
+ */
+
+#ifdef UNFS3_RESOLVER
+
+#define RESOLVE_QUEUED	0
+#define RESOLVE_RUNNING	1
+#define RESOLVE_FAILED	2
+
+typedef struct resolve_entry {
+    unfs3_fh_t fh;
+    int state;
+    time_t failed;		/* time of failure */
+    struct resolve_entry *next;
+} resolve_entry;
+
+static pthread_mutex_t resolve_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+
+/* searches queued, running, and recently failed */
+static resolve_entry *entries = NULL;
+static int entries_len = 0;
+
+static int resolver_running = FALSE;
+
+/*
+ * find the entry for a filehandle, dropping expired failures on the way
+ * called with resolve_mutex held
+ */
+static resolve_entry *resolve_find(uint32 dev, uint64 ino)
+{
+    resolve_entry **p, *e;
+    time_t now = time(NULL);
+
+    p = &entries;
+    while (*p) {
+        e = *p;
+        if (e->state == RESOLVE_FAILED && now - e->failed > RESOLVE_KEEP) {
+            *p = e->next;
+            entries_len--;
+            free(e);
+            continue;
+        }
+        if (e->fh.dev == dev && e->fh.ino == ino)
+            return e;
+        p = &e->next;
+    }
+    return NULL;
+}
+
+/*
+ * remove an entry
+ * called with resolve_mutex held
+ */
+static void resolve_remove(resolve_entry * e)
+{
+    resolve_entry **p;
+
+    for (p = &entries; *p != e; p = &(*p)->next);
+    *p = e->next;
+    entries_len--;
+    free(e);
+}
+
+/*
+ * resolver thread main function
+ */
+static void *resolve_main(U(void *arg))
+{
+    resolve_entry *e;
+    unfs3_fh_t fh;
+    char *res;
+    char path[NFS_MAXPATHLEN];
+
+    /* this thread's filesystem ids are its own */
+    switch_to_root();
+
+    for (;;) {
+        pthread_mutex_lock(&resolve_mutex);
+        for (;;) {
+            for (e = entries; e; e = e->next)
+                if (e->state == RESOLVE_QUEUED)
+                    break;
+            if (e)
+                break;
+            pthread_cond_wait(&resolve_cond, &resolve_mutex);
+        }
+        e->state = RESOLVE_RUNNING;
+        fh = e->fh;
+        pthread_mutex_unlock(&resolve_mutex);
+
+        res = fh_decomp_raw(&fh);
+        if (!res)
+            res = backend_locate_file(fh.dev, fh.ino);
+        if (res)
+            strcpy(path, res);
+
+        if (res) {
+            worker_lock();
+            fh_cache_add(fh.dev, fh.ino, path);
+            worker_unlock();
+        }
+
+        pthread_mutex_lock(&resolve_mutex);
+        if (res)
+            resolve_remove(e);
+        else {
+            e->state = RESOLVE_FAILED;
+            e->failed = time(NULL);
+        }
+        pthread_mutex_unlock(&resolve_mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * start the resolver thread
+ */
+void resolve_init(void)
+{
+    pthread_t thread;
+    sigset_t all, old;
+
+    /* signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    if (pthread_create(&thread, NULL, resolve_main, NULL) == 0) {
+        pthread_detach(thread);
+        resolver_running = TRUE;
+    } else
+        logmsg(LOG_WARNING, "Unable to start resolver thread");
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * check whether expensive searches are done in the background
+ */
+int resolve_active(void)
+{
+    return resolver_running;
+}
+
+/*
+ * resolve a filehandle that is not in the fh cache
+ * returns NULL and sets *pending if the client should retry later
+ */
+char *resolve_fh(const unfs3_fh_t * fh, int *pending)
+{
+    resolve_entry *e;
+    char *res;
+    int exceeded;
+
+    *pending = FALSE;
+
+    pthread_mutex_lock(&resolve_mutex);
+    e = resolve_find(fh->dev, fh->ino);
+    if (e && e->state != RESOLVE_FAILED)
+        *pending = TRUE;
+    pthread_mutex_unlock(&resolve_mutex);
+
+    if (e)
+        return NULL;
+
+    res = fh_decomp_limited(fh, RESOLVE_INLINE_LIMIT, &exceeded);
+    if (res || (!exceeded && !opt_brute_force))
+        return res;
+
+    pthread_mutex_lock(&resolve_mutex);
+    /* another request may have queued it meanwhile */
+    if (!resolve_find(fh->dev, fh->ino)) {
+        e = entries_len < RESOLVE_MAX ? malloc(sizeof(resolve_entry)) : NULL;
+        if (e) {
+            e->fh = *fh;
+            e->state = RESOLVE_QUEUED;
+            e->next = entries;
+            entries = e;
+            entries_len++;
+            pthread_cond_signal(&resolve_cond);
+        }
+    }
+    pthread_mutex_unlock(&resolve_mutex);
+
+    /* with a full queue, the client just has to try again later */
+    *pending = TRUE;
+    return NULL;
+}
+
+#else				       /* UNFS3_RESOLVER */
+
+void resolve_init(void)
+{
+}
+
+int resolve_active(void)
+{
+    return FALSE;
+}
+
+char *resolve_fh(U(const unfs3_fh_t * fh), int *pending)
+{
+    *pending = FALSE;
+    return NULL;
+}
+
+#endif				       /* UNFS3_RESOLVER */
@@ -0,0 +1,30 @@
+/*
+ * UNFS3 background filehandle resolver
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_RESOLVE_H
+#define UNFS3_RESOLVE_H
+
+#include "fh.h"
+#include "user.h"
+
+#if defined(UNFS3_THREADS) && defined(UNFS3_FSUID)
+#define UNFS3_RESOLVER 1
+#endif
+
+/* directory entries examined by a search before it is moved to the
+   resolver */
+#define RESOLVE_INLINE_LIMIT 1024
+
+/* searches queued or running at once */
+#define RESOLVE_MAX 64
+
+/* seconds a failed search is remembered */
+#define RESOLVE_KEEP 30
+
+void resolve_init(void);
+int resolve_active(void);
+char *resolve_fh(const unfs3_fh_t * fh, int *pending);
+
+#endif
@@ -0,0 +1,460 @@
+
+/*
+ * UNFS3 request scheduler
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "worker.h"
+#include "scheduler.h"
+#include "Config/exports.h"
+
+/*
+ * intention of the request scheduler
+ *
+ * requests waiting for a worker are queued per client address, and the
+ * clients take turns in deficit round robin order. Each request costs
+ * one unit plus one per SCHED_UNIT bytes it reads or writes, which is
+ * only known once it has been served, so the cost is charged afterwards
+ * and a client in debt sits out rounds until its quantum has made up
+ * for it. A client running many large transfers thus cannot starve the
+ * others, and the weight export option gives clients a larger share.
+ *
+ * the iops and bandwidth export options limit an export entry as a
+ * whole, the client_ variants limit each client using the entry. Both
+ * are enforced by not picking requests of a client until it is back
+ * within its limits. A client is held back by the export entry it has
+ * used last.
+ *
+ * requests read from transports that are shared by all clients, like
+ * the UDP socket when it is served by libtirpc, are queued as one
+ * additional client and not limited. The UDP transport in udp.c queues
+ * each request by its source address instead.
+ */
+
+#ifdef UNFS3_THREADS
+
+#define CLIENT_HASH_SIZE 256
+
+/* rate limit state of an export entry */
+typedef struct sched_bucket {
+    uint32 key;
+    double iops_tat;		/* theoretical arrival times */
+    double bw_tat;
+    struct sched_bucket *next;
+} sched_bucket;
+
+struct sched_client {
+    struct in6_addr addr;
+    int refs;			/* connections of the client */
+    int queued;			/* in round robin list */
+    int deficit;
+    uint32 weight;
+    sched_job *first;		/* queued requests */
+    sched_job *last;
+    double iops_tat;		/* theoretical arrival times */
+    double bw_tat;
+    sched_bucket *bucket;	/* export entry used last */
+    struct sched_client *next;	/* in round robin list */
+    struct sched_client *hnext;	/* in hash table */
+};
+
+static pthread_mutex_t sched_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond;
+
+static sched_client *clients[CLIENT_HASH_SIZE];
+static sched_bucket *buckets = NULL;
+
+/* transports shared by all clients */
+static sched_client shared;
+
+/* clients with queued requests */
+static sched_client *rr_first = NULL;
+static sched_client *rr_last = NULL;
+static int rr_len = 0;
+
+/* client of the request served by this thread */
+static UNFS3_TLS sched_client *sched_current = NULL;
+
+/*
+ * set up the scheduler, called before the workers start
+ */
+void sched_init(void)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    shared.weight = 1;
+}
+
+/*
+ * current time in seconds
+ */
+static double sched_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * check whether a client entry can go, which is once nothing uses it and
+ * it no longer holds back requests from its address
+ * called with sched_mutex held
+ */
+static int client_unused(const sched_client * c, double now)
+{
+    return c->refs == 0 && !c->queued && c->iops_tat <= now &&
+        c->bw_tat <= now;
+}
+
+static unsigned client_hash(const struct in6_addr *addr)
+{
+    const uint32_t *w = (const uint32_t *) addr;
+
+    return ((w[0] ^ w[1] ^ w[2] ^ w[3]) * 2654435761U) >> 24;
+}
+
+/*
+ * find or create the client entry for an address, takes a reference
+ * returns NULL if the requests are to be queued as shared
+ */
+sched_client *sched_client_get(const struct sockaddr *addr)
+{
+    struct in6_addr addr6;
+    sched_client *c, **p;
+    double now;
+    unsigned h;
+
+    if (get_remote_addr(addr, &addr6))
+        return NULL;
+    h = client_hash(&addr6);
+    now = sched_now();
+
+    /* entries kept for their rate limits go once those have run out */
+    pthread_mutex_lock(&sched_mutex);
+    for (p = &clients[h]; (c = *p);) {
+        if (memcmp(&c->addr, &addr6, sizeof(addr6)) == 0)
+            break;
+        if (client_unused(c, now)) {
+            *p = c->hnext;
+            free(c);
+        } else
+            p = &c->hnext;
+    }
+
+    if (!c) {
+        c = calloc(1, sizeof(sched_client));
+        if (c) {
+            c->addr = addr6;
+            c->weight = 1;
+            c->hnext = clients[h];
+            clients[h] = c;
+        }
+    }
+    if (c)
+        c->refs++;
+    pthread_mutex_unlock(&sched_mutex);
+
+    return c;
+}
+
+/*
+ * drop a reference to a client entry, which is kept while it limits the
+ * rate of its address, for clients that do not stay connected like
+ * those over UDP
+ */
+void sched_client_put(sched_client * c)
+{
+    sched_client **p;
+    double now;
+
+    if (!c)
+        return;
+
+    now = sched_now();
+    pthread_mutex_lock(&sched_mutex);
+    c->refs--;
+    if (client_unused(c, now)) {
+        for (p = &clients[client_hash(&c->addr)]; *p != c; p = &(*p)->hnext);
+        *p = c->hnext;
+        free(c);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * append a client to the round robin list
+ * called with sched_mutex held
+ */
+static void rr_push(sched_client * c)
+{
+    c->next = NULL;
+    if (rr_last)
+        rr_last->next = c;
+    else
+        rr_first = c;
+    rr_last = c;
+    rr_len++;
+}
+
+/*
+ * remove the first client from the round robin list
+ * called with sched_mutex held
+ */
+static sched_client *rr_pop(void)
+{
+    sched_client *c = rr_first;
+
+    rr_first = c->next;
+    if (!rr_first)
+        rr_last = NULL;
+    rr_len--;
+
+    return c;
+}
+
+/*
+ * queue a job for the workers
+ */
+void sched_queue(sched_job * job)
+{
+    sched_client *c = job->client ? job->client : &shared;
+
+    pthread_mutex_lock(&sched_mutex);
+    job->next = NULL;
+    if (c->last)
+        c->last->next = job;
+    else
+        c->first = job;
+    c->last = job;
+
+    if (!c->queued) {
+        c->queued = TRUE;
+        rr_push(c);
+    }
+    pthread_cond_signal(&sched_cond);
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+/*
+ * seconds until a client is within its rate limits again
+ * called with sched_mutex held
+ */
+static double client_delay(sched_client * c, double now)
+{
+    double tat = c->iops_tat;
+
+    if (c->bw_tat > tat)
+        tat = c->bw_tat;
+    if (c->bucket && c->bucket->iops_tat > tat)
+        tat = c->bucket->iops_tat;
+    if (c->bucket && c->bucket->bw_tat > tat)
+        tat = c->bucket->bw_tat;
+
+    return tat - SCHED_BURST - now;
+}
+
+/*
+ * pick the next job in deficit round robin order
+ * returns NULL and sets wait if all clients are over their limits
+ * called with sched_mutex held
+ */
+static sched_job *sched_pick(double *wait)
+{
+    sched_client *c;
+    sched_job *job;
+    double now, delay;
+    int i, n, ready;
+
+    now = sched_now();
+    *wait = 0;
+
+    do {
+        ready = FALSE;
+        n = rr_len;
+        for (i = 0; i < n; i++) {
+            c = rr_pop();
+
+            delay = client_delay(c, now);
+            if (delay > 0) {
+                if (*wait == 0 || delay < *wait)
+                    *wait = delay;
+                rr_push(c);
+                continue;
+            }
+            ready = TRUE;
+
+            /* in debt, sit out this round */
+            if (c->deficit <= 0) {
+                c->deficit += SCHED_QUANTUM * c->weight;
+                rr_push(c);
+                continue;
+            }
+
+            job = c->first;
+            c->first = job->next;
+            if (c->first)
+                rr_push(c);
+            else {
+                c->last = NULL;
+                c->queued = FALSE;
+                /* credit does not accumulate while idle */
+                if (c->deficit > 0)
+                    c->deficit = 0;
+            }
+            return job;
+        }
+    } while (ready);
+
+    return NULL;
+}
+
+/*
+ * wait for the next job, called by the workers
+ */
+sched_job *sched_next(void)
+{
+    struct timespec ts;
+    sched_job *job;
+    double wait;
+
+    pthread_mutex_lock(&sched_mutex);
+    for (;;) {
+        job = sched_pick(&wait);
+        if (job)
+            break;
+
+        if (wait > 0) {
+            wait += sched_now();
+            ts.tv_sec = (time_t) wait;
+            ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+            pthread_cond_timedwait(&sched_cond, &sched_mutex, &ts);
+        } else
+            pthread_cond_wait(&sched_cond, &sched_mutex);
+    }
+    pthread_mutex_unlock(&sched_mutex);
+
+    sched_current = job->client;
+    return job;
+}
+
+/*
+ * advance a theoretical arrival time
+ */
+static void gcra(double *tat, double now, double inc)
+{
+    if (*tat < now)
+        *tat = now;
+    *tat += inc;
+}
+
+/*
+ * find or create the rate limit state of an export entry
+ * called with sched_mutex held
+ */
+static sched_bucket *bucket_get(uint32 key)
+{
+    sched_bucket *b;
+
+    for (b = buckets; b; b = b->next)
+        if (b->key == key)
+            return b;
+
+    b = calloc(1, sizeof(sched_bucket));
+    if (b) {
+        b->key = key;
+        b->next = buckets;
+        buckets = b;
+    }
+    return b;
+}
+
+/*
+ * charge the request served by this thread to its client
+ * called after the request has been served, the export options
+ * looked up for it must still be in effect
+ */
+void sched_charge(uint64 bytes)
+{
+    sched_client *c = sched_current;
+    sched_bucket *b = NULL;
+    double now;
+
+    if (!c)
+        return;
+
+    now = sched_now();
+
+    pthread_mutex_lock(&sched_mutex);
+    c->weight = export_limits.weight ? export_limits.weight : 1;
+    c->deficit -= 1 + bytes / SCHED_UNIT;
+
+    if (export_limits.client_iops)
+        gcra(&c->iops_tat, now, 1.0 / export_limits.client_iops);
+    if (export_limits.client_bandwidth)
+        gcra(&c->bw_tat, now,
+             (double) bytes / export_limits.client_bandwidth);
+
+    if (export_limits.iops || export_limits.bandwidth)
+        b = bucket_get(export_limits.key);
+    if (b && export_limits.iops)
+        gcra(&b->iops_tat, now, 1.0 / export_limits.iops);
+    if (b && export_limits.bandwidth)
+        gcra(&b->bw_tat, now, (double) bytes / export_limits.bandwidth);
+    c->bucket = b;
+    pthread_mutex_unlock(&sched_mutex);
+}
+
+#else				       /* UNFS3_THREADS */
+
+void sched_init(void)
+{
+}
+
+sched_client *sched_client_get(U(const struct sockaddr *addr))
+{
+    return NULL;
+}
+
+void sched_client_put(U(sched_client * c))
+{
+}
+
+void sched_queue(U(sched_job * job))
+{
+}
+
+sched_job *sched_next(void)
+{
+    return NULL;
+}
+
+void sched_charge(U(uint64 bytes))
+{
+}
+
+#endif				       /* UNFS3_THREADS */
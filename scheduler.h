@@ -0,0 +1,36 @@
+/*
+ * UNFS3 request scheduler
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_SCHED_H
+#define UNFS3_SCHED_H
+
+/* cost units per request, plus one per SCHED_UNIT bytes transferred */
+#define SCHED_UNIT	4096
+
+/* cost units a client of weight 1 may use per round */
+#define SCHED_QUANTUM	32
+
+/* seconds of rate limit a client may use up ahead of time */
+#define SCHED_BURST	1.0
+
+typedef struct sched_client sched_client;
+
+/* work for a worker thread, either a transport fd or a function */
+typedef struct sched_job {
+    int fd;
+    void (*fn) (void *arg);
+    void *arg;
+    sched_client *client;	/* NULL for transports shared by clients */
+    struct sched_job *next;
+} sched_job;
+
+void sched_init(void);
+sched_client *sched_client_get(const struct sockaddr *addr);
+void sched_client_put(sched_client * c);
+void sched_queue(sched_job * job);
+sched_job *sched_next(void);
+void sched_charge(uint64 bytes);
+
+#endif
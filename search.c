@@ -0,0 +1,343 @@
+
+/*
+ * UNFS3 parallel directory search
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <rpc/rpc.h>
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "backend.h"
+#include "search.h"
+
+/*
+ * intention of the parallel directory search
+ *
+ * when a filehandle has to be found by searching directories, one
+ * opendir(), readdir() and lstat() at a time leaves most of the disks
+ * of a large array idle, and a search of a whole filesystem takes
+ * minutes. search_tree() spreads such a search over up to
+ * SEARCH_THREADS threads, one directory at a time.
+ *
+ * each thread keeps the directories it still has to search in a list of
+ * its own and takes the newest one next, so that it stays deep in the
+ * tree and the lists stay short. A thread that runs out of work takes
+ * the oldest directory of another thread, which is the one closest to
+ * the root and likely to hold the most work. Threads are only started
+ * once there is more than one directory waiting, so a search that only
+ * ever follows a single path stays in the calling thread. All of them
+ * stop as soon as one finds the entry searched for.
+ *
+ * the threads inherit the filesystem ids of the caller.
+ */
+
+#ifdef UNFS3_SEARCH
+
+/* a directory still to be searched */
+typedef struct search_dir {
+    struct search_dir *prev;	/* older */
+    struct search_dir *next;	/* newer */
+    int level;
+    char path[1];
+} search_dir;
+
+typedef struct search_state search_state;
+
+typedef struct {
+    search_state *s;
+    int id;
+    pthread_t thread;
+    search_dir *oldest;
+    search_dir *newest;
+} search_worker;
+
+/* fields below lock are protected by it */
+struct search_state {
+    search_fn fn;
+    void *arg;
+    int found;			/* read without lock while searching */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    search_worker workers[SEARCH_THREADS];
+    int threads;		/* started, including the caller */
+    int queued;			/* directories in the lists */
+    int busy;			/* threads searching a directory */
+    int waiting;		/* threads waiting for work */
+    char *result;
+    backend_statstruct *buf;
+};
+
+static void *search_main(void *arg);
+
+/*
+ * the following are called with the lock held
+ */
+
+/*
+ * take the next directory for a thread, stealing from another if needed
+ */
+static search_dir *search_take(search_state * s, int id)
+{
+    search_worker *w = &s->workers[id];
+    search_dir *d;
+    int i;
+
+    if (__atomic_load_n(&s->found, __ATOMIC_RELAXED) || s->queued == 0)
+        return NULL;
+
+    d = w->newest;
+    if (d) {
+        w->newest = d->prev;
+        if (w->newest)
+            w->newest->next = NULL;
+        else
+            w->oldest = NULL;
+    } else {
+        for (i = 1; i < s->threads; i++) {
+            w = &s->workers[(id + i) % s->threads];
+            d = w->oldest;
+            if (d)
+                break;
+        }
+        w->oldest = d->next;
+        if (w->oldest)
+            w->oldest->prev = NULL;
+        else
+            w->newest = NULL;
+    }
+
+    s->queued--;
+    return d;
+}
+
+/*
+ * add a directory to the list of a thread
+ */
+static void search_put(search_state * s, int id, search_dir * d)
+{
+    search_worker *w = &s->workers[id];
+    sigset_t all, old;
+
+    d->next = NULL;
+    d->prev = w->newest;
+    if (w->newest)
+        w->newest->next = d;
+    else
+        w->oldest = d;
+    w->newest = d;
+    s->queued++;
+
+    if (s->waiting) {
+        pthread_cond_signal(&s->cond);
+        return;
+    }
+    if (s->queued < 2 || s->threads == SEARCH_THREADS)
+        return;
+
+    /* signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    w = &s->workers[s->threads];
+    w->s = s;
+    w->id = s->threads;
+    w->oldest = NULL;
+    w->newest = NULL;
+    if (pthread_create(&w->thread, NULL, search_main, w) == 0)
+        s->threads++;
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * search one directory
+ */
+static void search_one(search_state * s, int id, search_dir * dir)
+{
+    backend_dirstream *search;
+    struct dirent *entry;
+    backend_statstruct buf;
+    search_dir *d;
+    size_t len, plen = strlen(dir->path);
+    char path[NFS_MAXPATHLEN];
+    int res;
+
+    search = backend_opendir(dir->path);
+    if (!search)
+        return;
+
+    /* the root of the search may end with a slash */
+    if (plen > 0 && dir->path[plen - 1] == '/')
+        plen--;
+    memcpy(path, dir->path, plen);
+    path[plen] = '/';
+
+    while ((entry = backend_readdir(search))) {
+        if (__atomic_load_n(&s->found, __ATOMIC_RELAXED))
+            break;
+
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0)
+            continue;
+
+        len = strlen(entry->d_name);
+        if (plen + len + 2 > NFS_MAXPATHLEN)
+            continue;
+        memcpy(path + plen + 1, entry->d_name, len + 1);
+
+        if (backend_lstat(path, &buf) != 0)
+            continue;
+
+        res = s->fn(&buf, dir->level, s->arg);
+
+        if (res == SEARCH_FOUND) {
+            pthread_mutex_lock(&s->lock);
+            if (!s->found) {
+                __atomic_store_n(&s->found, TRUE, __ATOMIC_RELAXED);
+                strcpy(s->result, path);
+                *s->buf = buf;
+                pthread_cond_broadcast(&s->cond);
+            }
+            pthread_mutex_unlock(&s->lock);
+            break;
+        }
+
+        if (res == SEARCH_DESCEND && S_ISDIR(buf.st_mode)) {
+            d = malloc(sizeof(search_dir) + plen + len + 1);
+            if (!d) {
+                logmsg(LOG_CRIT, "Out of memory, search incomplete");
+                continue;
+            }
+            d->level = dir->level + 1;
+            memcpy(d->path, path, plen + len + 2);
+
+            pthread_mutex_lock(&s->lock);
+            search_put(s, id, d);
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+
+    backend_closedir(search);
+}
+
+/*
+ * search directories until the entry is found or none are left
+ */
+static void search_run(search_state * s, int id)
+{
+    search_dir *d;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        d = search_take(s, id);
+        if (d) {
+            s->busy++;
+            pthread_mutex_unlock(&s->lock);
+
+            search_one(s, id, d);
+            free(d);
+
+            pthread_mutex_lock(&s->lock);
+            s->busy--;
+            if (s->busy == 0 && s->queued == 0)
+                pthread_cond_broadcast(&s->cond);
+            continue;
+        }
+
+        if (s->found || s->busy == 0)
+            break;
+
+        s->waiting++;
+        pthread_cond_wait(&s->cond, &s->lock);
+        s->waiting--;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * search thread main function
+ */
+static void *search_main(void *arg)
+{
+    search_worker *w = arg;
+
+    search_run(w->s, w->id);
+    return NULL;
+}
+
+/*
+ * search the tree below root for an entry fn accepts
+ * returns TRUE and fills in result and buf if it was found
+ */
+int search_tree(const char *root, search_fn fn, void *arg, char *result,
+                backend_statstruct * buf)
+{
+    search_state s;
+    search_dir *d, *next;
+    size_t len = strlen(root);
+    int i;
+
+    if (len >= NFS_MAXPATHLEN)
+        return FALSE;
+
+    d = malloc(sizeof(search_dir) + len);
+    if (!d)
+        return FALSE;
+    d->level = 0;
+    memcpy(d->path, root, len + 1);
+
+    memset(&s, 0, sizeof(s));
+    s.fn = fn;
+    s.arg = arg;
+    s.result = result;
+    s.buf = buf;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    s.threads = 1;
+
+    pthread_mutex_lock(&s.lock);
+    search_put(&s, 0, d);
+    pthread_mutex_unlock(&s.lock);
+
+    search_run(&s, 0);
+
+    for (i = 1; i < s.threads; i++)
+        pthread_join(s.workers[i].thread, NULL);
+
+    /* directories left over after the entry was found */
+    for (i = 0; i < s.threads; i++)
+        for (d = s.workers[i].oldest; d; d = next) {
+            next = d->next;
+            free(d);
+        }
+
+    pthread_cond_destroy(&s.cond);
+    pthread_mutex_destroy(&s.lock);
+
+    return s.found;
+}
+
+#else				       /* UNFS3_SEARCH */
+
+int search_tree(U(const char *root), U(search_fn fn), U(void *arg),
+                U(char *result), U(backend_statstruct * buf))
+{
+    return FALSE;
+}
+
+#endif				       /* UNFS3_SEARCH */
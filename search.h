@@ -0,0 +1,34 @@
+/*
+ * UNFS3 parallel directory search
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_SEARCH_H
+#define UNFS3_SEARCH_H
+
+#include "backend.h"
+#include "worker.h"
+
+#ifdef UNFS3_THREADS
+#define UNFS3_SEARCH 1
+#endif
+
+/* threads searching one tree, including the caller */
+#define SEARCH_THREADS	8
+
+/* what to do with a directory entry, returned by a search_fn */
+#define SEARCH_SKIP	0
+#define SEARCH_DESCEND	1	/* search the directory as well */
+#define SEARCH_FOUND	2	/* the entry is the one searched for */
+
+/*
+ * called for each entry of a directory at the given level below the
+ * root of the search, possibly by several threads at once
+ */
+typedef int (*search_fn) (const backend_statstruct * buf, int level,
+                          void *arg);
+
+int search_tree(const char *root, search_fn fn, void *arg, char *result,
+                backend_statstruct * buf);
+
+#endif
@@ -0,0 +1,423 @@
+
+/*
+ * UNFS3 batched UDP transport
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <syslog.h>
+#include <unistd.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+#include <sys/epoll.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "worker.h"
+#include "scheduler.h"
+#include "conn.h"
+#include "udp.h"
+
+/*
+ * intention of the batched UDP transport
+ *
+ * libtirpc receives one datagram per system call and sends each reply
+ * with another one, so a UDP client that keeps many requests in flight
+ * costs two system calls per request. Here, the main loop receives up to
+ * UDP_BATCH datagrams at once with recvmmsg(), and the requests of such
+ * a batch are served like those of a TCP connection, see conn.c. A
+ * request that finishes sends its reply with one sendmmsg(), together
+ * with those of the batch that are ready and not sent yet. While one
+ * request sends, the replies finished meanwhile wait for it, so that
+ * they go out with its next sendmmsg(). Replies are never kept for the
+ * rest of the batch, since a batch mixes unrelated clients, and one slow
+ * request like a FILE_SYNC write would hold up the replies of all of
+ * them. Without workers, the requests of a batch are served one after
+ * another, so each reply is sent on its own.
+ *
+ * with worker threads, the socket is not read while UDP_BATCHES of its
+ * batches are in progress, so that a flood of datagrams waits in the
+ * socket buffer instead of in memory. Requests are queued for the
+ * scheduler by the address they came from, like those of a TCP
+ * connection, and are always answered before their batch is done.
+ */
+
+#ifdef UNFS3_UDP
+
+/* space for one datagram */
+#define UDP_BUF_SIZE	NFS_MAX_UDP_PACKET
+
+typedef struct udp_batch udp_batch;
+
+/* a socket served by this transport */
+typedef struct {
+    int fd;
+    int batches;		/* in progress, protected by udp_mutex */
+    int stalled;		/* not watched until a batch is done */
+} udp_sock;
+
+/* a request received in a batch */
+typedef struct {
+    conn_call call;
+    sched_job job;
+    udp_batch *b;
+    struct sockaddr_storage addr;	/* address of the client */
+    socklen_t addrlen;
+    char *reply;		/* encoded reply */
+    size_t reply_len;
+    int ready;			/* reply to be sent, protected by udp_mutex */
+} udp_req;
+
+struct udp_batch {
+    udp_sock *s;
+    int len;			/* datagrams received */
+    int pending;		/* references, protected by udp_mutex */
+    int sending;		/* replies are being sent, likewise */
+    udp_req reqs[UDP_BATCH];
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    char *bufs;			/* UDP_BATCH datagram buffers */
+    struct udp_batch *next;	/* in free list */
+};
+
+static pthread_mutex_t udp_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* unused batches, protected by udp_mutex */
+static udp_batch *free_batches = NULL;
+
+static udp_sock socks[2];
+static int socks_len = 0;
+
+static int udp_epoll_fd = -1;
+
+static bool_t udp_xp_reply(SVCXPRT *, struct rpc_msg *);
+
+/* transport ops of requests received over UDP */
+static struct xp_ops udp_ops;
+
+/*
+ * serve a UDP socket with this transport once udp_init() has been called
+ */
+void udp_watch(int fd)
+{
+    if (socks_len < (int) (sizeof(socks) / sizeof(udp_sock)))
+        socks[socks_len++].fd = fd;
+}
+
+/*
+ * set up the transport, must be called after conn_init()
+ */
+void udp_init(int epoll_fd)
+{
+    udp_epoll_fd = epoll_fd;
+    conn_call_ops(&udp_ops, udp_xp_reply);
+}
+
+/*
+ * watch a socket again, which is registered one-shot with workers
+ */
+static void udp_rearm(udp_sock * s)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = s->fd;
+    epoll_ctl(udp_epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+/*
+ * get an unused batch
+ */
+static udp_batch *udp_batch_get(udp_sock * s)
+{
+    udp_batch *b;
+
+    pthread_mutex_lock(&udp_mutex);
+    b = free_batches;
+    if (b)
+        free_batches = b->next;
+    pthread_mutex_unlock(&udp_mutex);
+
+    if (!b) {
+        b = malloc(sizeof(udp_batch));
+        if (!b)
+            return NULL;
+        b->bufs = malloc((size_t) UDP_BATCH * UDP_BUF_SIZE);
+        if (!b->bufs) {
+            free(b);
+            return NULL;
+        }
+    }
+
+    b->s = s;
+    return b;
+}
+
+/*
+ * send the replies of a batch that are ready, and those that become
+ * ready meanwhile
+ */
+static void udp_send(udp_batch * b)
+{
+    struct msghdr *hdr;
+    udp_req *r;
+    int i, n, sent;
+
+    pthread_mutex_lock(&udp_mutex);
+    if (b->sending) {
+        pthread_mutex_unlock(&udp_mutex);
+        return;
+    }
+    b->sending = TRUE;
+
+    for (;;) {
+        /* the receive headers are no longer needed */
+        for (i = 0, n = 0; i < b->len; i++) {
+            r = &b->reqs[i];
+            if (!r->ready)
+                continue;
+            r->ready = FALSE;
+
+            b->iov[n].iov_base = r->reply;
+            b->iov[n].iov_len = r->reply_len;
+            hdr = &b->msgs[n].msg_hdr;
+            memset(hdr, 0, sizeof(struct msghdr));
+            hdr->msg_name = &r->addr;
+            hdr->msg_namelen = r->addrlen;
+            hdr->msg_iov = &b->iov[n];
+            hdr->msg_iovlen = 1;
+            n++;
+        }
+        if (n == 0)
+            break;
+        pthread_mutex_unlock(&udp_mutex);
+
+        /* sendmmsg() stops at the first reply that cannot be sent */
+        for (i = 0; i < n;) {
+            sent = sendmmsg(b->s->fd, b->msgs + i, n - i, 0);
+            if (sent > 0)
+                i += sent;
+            else if (sent == -1 && errno == EINTR)
+                continue;
+            else {
+                logmsg(LOG_WARNING, "Unable to send UDP reply: %s",
+                       sent == -1 ? strerror(errno) : "nothing sent");
+                i++;
+            }
+        }
+
+        for (i = 0; i < n; i++)
+            free(b->iov[i].iov_base);
+
+        pthread_mutex_lock(&udp_mutex);
+    }
+
+    b->sending = FALSE;
+    pthread_mutex_unlock(&udp_mutex);
+}
+
+/*
+ * drop a reference to a batch
+ */
+static void udp_release(udp_batch * b)
+{
+    udp_sock *s = b->s;
+    int last, resume = FALSE;
+
+    pthread_mutex_lock(&udp_mutex);
+    last = (--b->pending == 0);
+    pthread_mutex_unlock(&udp_mutex);
+
+    if (!last)
+        return;
+
+    pthread_mutex_lock(&udp_mutex);
+    s->batches--;
+    if (s->stalled) {
+        s->stalled = FALSE;
+        resume = TRUE;
+    }
+    b->next = free_batches;
+    free_batches = b;
+    pthread_mutex_unlock(&udp_mutex);
+
+    if (resume)
+        udp_rearm(s);
+}
+
+/*
+ * decode and dispatch a request and send its reply, runs in a worker or
+ * in the main loop
+ */
+static void udp_serve(void *arg)
+{
+    udp_req *r = arg;
+    udp_batch *b = r->b;
+
+    /* requests over UDP are never deferred, see conn_defer() */
+    conn_call_serve(&r->call);
+    conn_call_done(&r->call);
+    sched_client_put(r->job.client);
+
+    if (r->reply) {
+        pthread_mutex_lock(&udp_mutex);
+        r->ready = TRUE;
+        pthread_mutex_unlock(&udp_mutex);
+        udp_send(b);
+    }
+    udp_release(b);
+}
+
+/*
+ * receive a batch of datagrams and start their requests
+ * returns FALSE if fd is not served by this transport
+ */
+int udp_event(int fd)
+{
+    udp_sock *s = NULL;
+    udp_batch *b;
+    udp_req *r;
+    int i, n, resume;
+
+    if (udp_epoll_fd == -1)
+        return FALSE;
+    for (i = 0; i < socks_len; i++)
+        if (socks[i].fd == fd)
+            s = &socks[i];
+    if (!s)
+        return FALSE;
+
+    b = udp_batch_get(s);
+    if (!b) {
+        logmsg(LOG_CRIT, "Out of memory, not reading UDP requests");
+        if (worker_active())
+            udp_rearm(s);
+        return TRUE;
+    }
+
+    for (i = 0; i < UDP_BATCH; i++) {
+        b->iov[i].iov_base = b->bufs + (size_t) i * UDP_BUF_SIZE;
+        b->iov[i].iov_len = UDP_BUF_SIZE;
+        memset(&b->msgs[i], 0, sizeof(struct mmsghdr));
+        b->msgs[i].msg_hdr.msg_name = &b->reqs[i].addr;
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do
+        n = recvmmsg(fd, b->msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    while (n == -1 && errno == EINTR);
+
+    pthread_mutex_lock(&udp_mutex);
+    if (n <= 0) {
+        b->next = free_batches;
+        free_batches = b;
+    } else {
+        /* the main loop holds a reference while starting requests */
+        b->len = n;
+        b->pending = n + 1;
+        b->sending = FALSE;
+        s->batches++;
+    }
+    pthread_mutex_unlock(&udp_mutex);
+
+    /* the headers are used for sending once the first request is done */
+    for (i = 0; i < n; i++) {
+        r = &b->reqs[i];
+        memset(&r->call, 0, sizeof(conn_call));
+        memset(&r->job, 0, sizeof(sched_job));
+        r->b = b;
+        r->addrlen = b->msgs[i].msg_hdr.msg_namelen;
+        r->reply = NULL;
+        r->ready = FALSE;
+
+        /* drop truncated datagrams like libtirpc does */
+        if (b->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+            r->call.len = 0;
+        else {
+            r->call.rec = b->iov[i].iov_base;
+            r->call.len = b->msgs[i].msg_len;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        r = &b->reqs[i];
+        if (r->call.len == 0) {
+            udp_release(b);
+            continue;
+        }
+
+        conn_call_init(&r->call, &udp_ops, fd, &r->addr, r->addrlen, r);
+
+        if (worker_active()) {
+            r->job.fn = udp_serve;
+            r->job.arg = r;
+            r->job.client = sched_client_get((struct sockaddr *) &r->addr);
+            worker_run(&r->job);
+        } else
+            udp_serve(r);
+    }
+    if (n > 0)
+        udp_release(b);
+
+    /* without workers, the socket is watched level-triggered */
+    if (!worker_active())
+        return TRUE;
+
+    pthread_mutex_lock(&udp_mutex);
+    resume = (s->batches < UDP_BATCHES);
+    if (!resume)
+        s->stalled = TRUE;
+    pthread_mutex_unlock(&udp_mutex);
+
+    if (resume)
+        udp_rearm(s);
+
+    return TRUE;
+}
+
+/*
+ * encode a reply, it is sent once the request is done
+ */
+static bool_t udp_xp_reply(SVCXPRT * xprt, struct rpc_msg *msg)
+{
+    udp_req *r = xprt->xp_p1;
+
+    if (r->reply)
+        return FALSE;
+
+    r->reply = conn_call_encode(&r->call, msg, 0, &r->reply_len);
+    return r->reply != NULL;
+}
+
+#else				       /* UNFS3_UDP */
+
+void udp_watch(U(int fd))
+{
+}
+
+void udp_init(U(int epoll_fd))
+{
+}
+
+int udp_event(U(int fd))
+{
+    return FALSE;
+}
+
+#endif				       /* UNFS3_UDP */
@@ -0,0 +1,25 @@
+/*
+ * UNFS3 batched UDP transport
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_UDP_H
+#define UNFS3_UDP_H
+
+#include "conn.h"
+
+#if defined(UNFS3_CONN) && defined(HAVE_RECVMMSG) && defined(HAVE_SENDMMSG)
+#define UNFS3_UDP 1
+#endif
+
+/* datagrams received with one system call */
+#define UDP_BATCH	32
+
+/* batches of one socket that may be in progress at once */
+#define UDP_BATCHES	4
+
+void udp_watch(int fd);
+void udp_init(int epoll_fd);
+int udp_event(int fd);
+
+#endif
@@ -17,14 +17,29 @@
 #include <sys/stat.h>
 #include <rpc/rpc.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "nfs.h"
 #include "mount.h"
 #include "daemon.h"
 #include "user.h"
 #include "backend.h"
+#include "worker.h"
 #include "Config/exports.h"
 
+#ifdef UNFS3_FSUID
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#include <linux/capability.h>
+
+/* the setgroups() wrapper of glibc applies to all threads */
+#ifdef SYS_setgroups32
+#define SYS_SETGROUPS SYS_setgroups32
+#else
+#define SYS_SETGROUPS SYS_setgroups
+#endif
+#endif				       /* UNFS3_FSUID */
+
 /* user and group id we squash to */
 static uid_t squash_uid = 65534;
 static gid_t squash_gid = 65534;
@@ -32,6 +47,31 @@ static gid_t squash_gid = 65534;
 /* whether we can use seteuid/setegid */
 static int can_switch = TRUE;
 
+#ifdef UNFS3_FSUID
+/*
+ * On Linux, the filesystem uid/gid and the supplementary groups are
+ * switched for the calling thread only, with setfsuid(), setfsgid(),
+ * and the raw setgroups system call. The effective uid stays 0. Each
+ * thread remembers which ids are in effect, so that requests from the
+ * same user need no system calls at all.
+ *
+ * Changing the fsuid to non-zero drops the filesystem capabilities,
+ * just like seteuid() would. CAP_MKNOD and CAP_SYS_RESOURCE are not
+ * part of that set, so they are dropped explicitly while serving a
+ * client other than root.
+ */
+#define MAX_GROUPS 32
+
+static UNFS3_TLS int ids_valid = FALSE;
+static UNFS3_TLS uid_t cur_uid;
+static UNFS3_TLS gid_t cur_gid;
+static UNFS3_TLS int cur_ngroups = -1;
+static UNFS3_TLS gid_t cur_groups[MAX_GROUPS];
+
+/* -1: unknown, FALSE: dropped, TRUE: raised */
+static UNFS3_TLS int caps_raised = -1;
+#endif				       /* UNFS3_FSUID */
+
 /*
  * initialize group and user id used for squashing
  */
@@ -155,6 +195,78 @@ int has_group(int group, struct svc_req *req)
     return FALSE;
 }
 
+#ifdef UNFS3_FSUID
+/*
+ * raise or drop the capabilities that setfsuid() leaves alone
+ */
+static int set_caps(int raise)
+{
+    struct __user_cap_header_struct hdr;
+    struct __user_cap_data_struct data[2];
+    __u32 mask = CAP_TO_MASK(CAP_MKNOD) | CAP_TO_MASK(CAP_SYS_RESOURCE);
+
+    if (caps_raised == raise)
+        return 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.version = _LINUX_CAPABILITY_VERSION_3;
+    hdr.pid = 0;
+
+    if (syscall(SYS_capget, &hdr, data) == -1)
+        return -1;
+
+    if (raise)
+        data[0].effective |= data[0].permitted & mask;
+    else
+        data[0].effective &= ~mask;
+
+    if (syscall(SYS_capset, &hdr, data) == -1)
+        return -1;
+
+    caps_raised = raise;
+    return 0;
+}
+
+/*
+ * switch filesystem ids of the calling thread
+ * ngroups == -1 leaves the supplementary groups alone
+ */
+static int set_ids(uid_t uid, gid_t gid, int ngroups, const gid_t *groups)
+{
+    int res = 0;
+
+    if (!ids_valid || gid != cur_gid) {
+        /* the second call returns the fsgid actually in effect */
+        setfsgid(gid);
+        if ((gid_t) setfsgid(gid) != gid)
+            res = -1;
+        cur_gid = gid;
+    }
+
+    if (ngroups >= 0 &&
+        (ngroups != cur_ngroups ||
+         memcmp(groups, cur_groups, ngroups * sizeof(gid_t)) != 0)) {
+        if (syscall(SYS_SETGROUPS, ngroups, groups) == -1) {
+            res = -1;
+            cur_ngroups = -1;
+        } else {
+            memcpy(cur_groups, groups, ngroups * sizeof(gid_t));
+            cur_ngroups = ngroups;
+        }
+    }
+
+    if (!ids_valid || uid != cur_uid) {
+        setfsuid(uid);
+        if ((uid_t) setfsuid(uid) != uid)
+            res = -1;
+        cur_uid = uid;
+    }
+
+    ids_valid = (res == 0);
+    return res;
+}
+#endif				       /* UNFS3_FSUID */
+
 /*
  * switch to root
  */
@@ -163,14 +275,23 @@ void switch_to_root(void)
     if (!can_switch)
         return;
 
+#ifdef UNFS3_FSUID
+    /* keep the groups, root does not need them anyway; going back to
+       fsuid 0 restores only the filesystem capabilities */
+    if (set_ids(0, 0, -1, NULL) == -1 || set_caps(TRUE) == -1) {
+        logmsg(LOG_EMERG, "fsuid/fsgid switching failed, aborting");
+        daemon_exit(CRISIS);
+    }
+#else
     backend_setegid(0);
     backend_seteuid(0);
+#endif
 }
 
 /*
- * switch auxiliary group ids
+ * mangle auxiliary group ids of a request, returns their number
  */
-static int switch_groups(struct svc_req *req)
+static unsigned int mangle_groups(struct svc_req *req)
 {
     struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
     unsigned int i, max;
@@ -181,7 +302,7 @@ static int switch_groups(struct svc_req *req)
         auth->aup_gids[i] = mangle(auth->aup_gids[i], squash_gid);
     }
 
-    return backend_setgroups(max, auth->aup_gids);
+    return max;
 }
 
 /*
@@ -189,7 +310,9 @@ static int switch_groups(struct svc_req *req)
  */
 void switch_user(struct svc_req *req)
 {
+    struct authunix_parms *auth = (struct authunix_parms *) req->rq_clntcred;
     int uid, gid, aid;
+    unsigned int max;
 
     if (!can_switch)
         return;
@@ -208,11 +331,21 @@ void switch_user(struct svc_req *req)
         return;
     }
 
+    max = mangle_groups(req);
+
+#ifdef UNFS3_FSUID
+    uid = get_uid(req);
+    gid = get_gid(req);
+    aid = set_caps(uid == 0);
+    if (set_ids(uid, gid, max, auth->aup_gids) == -1)
+        uid = -1;
+#else
     backend_setegid(0);
     backend_seteuid(0);
     gid = backend_setegid(get_gid(req));
-    aid = switch_groups(req);
+    aid = backend_setgroups(max, auth->aup_gids);
     uid = backend_seteuid(get_uid(req));
+#endif
 
     if (uid == -1 || gid == -1 || aid == -1) {
         logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
@@ -220,6 +353,56 @@ void switch_user(struct svc_req *req)
     }
 }
 
+/*
+ * return effective user id used for filesystem access
+ */
+uid_t get_euid(void)
+{
+#ifdef UNFS3_FSUID
+    if (can_switch && ids_valid)
+        return cur_uid;
+#endif
+    return backend_geteuid();
+}
+
+/*
+ * return effective group id used for filesystem access
+ */
+gid_t get_egid(void)
+{
+#ifdef UNFS3_FSUID
+    if (can_switch && ids_valid)
+        return cur_gid;
+#endif
+    return backend_getegid();
+}
+
+/*
+ * switch back to ids obtained from get_euid() and get_egid()
+ */
+void switch_ids(uid_t uid, gid_t gid)
+{
+    int res;
+
+    if (!can_switch)
+        return;
+
+#ifdef UNFS3_FSUID
+    res = set_ids(uid, gid, -1, NULL);
+#else
+    res = backend_setegid(gid);
+    if (res == 0)
+        res = backend_seteuid(uid);
+    if (backend_geteuid() != uid || backend_getegid() != gid)
+        res = -1;
+#endif
+
+    if (res == -1) {
+        logmsg(LOG_EMERG, "euid/egid switching failed, aborting");
+        daemon_exit(CRISIS);
+    }
+}
+
 /*
  * re-switch to root for reading executable files
  */
@@ -238,10 +421,8 @@ void read_executable(struct svc_req *req, backend_statstruct buf)
             have_exec = 1;
     }
 
-    if (have_exec) {
-        backend_setegid(0);
-        backend_seteuid(0);
-    }
+    if (have_exec)
+        switch_to_root();
 }
 
 /*
@@ -262,10 +443,8 @@ void read_by_owner(struct svc_req *req, backend_statstruct buf)
         have_read = 1;
     }
 
-    if (have_owner && !have_read) {
-        backend_setegid(0);
-        backend_seteuid(0);
-    }
+    if (have_owner && !have_read)
+        switch_to_root();
 }
 
 /*
@@ -286,8 +465,6 @@ void write_by_owner(struct svc_req *req, backend_statstruct buf)
         have_write = 1;
     }
 
-    if (have_owner && !have_write) {
-        backend_setegid(0);
-        backend_seteuid(0);
-    }
+    if (have_owner && !have_write)
+        switch_to_root();
 }
@@ -9,6 +9,12 @@
 
 #include "backend.h"
 
+/* Linux: switch filesystem ids of the calling thread only */
+#if defined(HAVE_SYS_FSUID_H) && defined(HAVE_SETFSUID) && \
+    defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_LINUX_CAPABILITY_H)
+#define UNFS3_FSUID 1
+#endif
+
 int get_uid(struct svc_req *req);
 
 int mangle_uid(int id);
@@ -22,6 +28,10 @@ void get_squash_ids(void);
 void switch_to_root(void);
 void switch_user(struct svc_req *req);
 
+uid_t get_euid(void);
+gid_t get_egid(void);
+void switch_ids(uid_t uid, gid_t gid);
+
 void read_executable(struct svc_req *req, backend_statstruct buf);
 void read_by_owner(struct svc_req *req, backend_statstruct buf);
 void write_by_owner(struct svc_req *req, backend_statstruct buf);
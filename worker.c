@@ -0,0 +1,452 @@
+
+/*
+ * UNFS3 worker thread pool
+ * see file LICENSE for license details
+ */
+
+#include "config.h"
+
+#include <sys/types.h>
+#include <rpc/rpc.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif				       /* WIN32 */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "nfs.h"
+#include "daemon.h"
+#include "user.h"
+#include "worker.h"
+#include "scheduler.h"
+
+/*
+ * intention of the worker pool
+ *
+ * the main loop polls all transports and hands every readable
+ * connection or datagram socket to one of opt_threads workers, which
+ * runs svc_getreq_common() on it. While a worker owns a transport, the
+ * main loop leaves its fd out of the poll set, so one TCP stream is
+ * never read by two threads at once. Which waiting work a worker picks
+ * up next is decided by the scheduler in sched.c. Listening sockets are
+ * accepted by the main loop itself, since that changes the libtirpc fd
+ * tables.
+ *
+ * the protocol code (caches, export list, effective ids) is still
+ * serialized by a single server lock. Handlers drop it around blocking
+ * file I/O with worker_io_begin() and worker_io_end(), which is where
+ * the concurrency comes from. Everything a handler needs across such a
+ * window, like its result structure and st_cache, is thread-local.
+ *
+ * so only the file I/O of READ, WRITE and COMMIT runs in parallel.
+ * lstat(), LOOKUP, READDIR, filehandle resolution and the other metadata
+ * procedures are still done one request at a time. Narrowing the lock
+ * needs the fh and fd caches, the export list and the switching of
+ * effective ids to be made thread-safe first.
+ */
+
+/* number of worker threads, 0 means serve requests in the main loop */
+int opt_threads = 0;
+
+#ifdef UNFS3_THREADS
+
+static pthread_mutex_t server_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* signalled by worker_wake(), and when server_requests drops to zero */
+static pthread_cond_t server_cond = PTHREAD_COND_INITIALIZER;
+
+/* requests between worker_enter() and worker_leave() */
+static int server_requests = 0;
+
+/* the main loop waits for the server to itself */
+static int server_exclusive = FALSE;
+
+/* bumped on every acquisition of the server lock */
+static unsigned long server_epoch = 0;
+
+/* request served by this thread, for restoring effective ids */
+static UNFS3_TLS struct svc_req *worker_req = NULL;
+static UNFS3_TLS unsigned long worker_epoch = 0;
+
+/* protects the busy map */
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* fds currently owned by a worker or waiting in the queue */
+static unsigned char *busy = NULL;
+static int busy_size = 0;
+
+static int wakeup_pipe[2] = { -1, -1 };
+
+/* called when a worker is finished with a transport fd */
+static void (*worker_done) (int fd) = NULL;
+
+/*
+ * grow the busy map so that fd is a valid index
+ * called with queue_mutex held
+ */
+static void busy_reserve(int fd)
+{
+    int size;
+    unsigned char *p;
+
+    if (fd < busy_size)
+        return;
+
+    size = busy_size ? busy_size : 64;
+    while (size <= fd)
+        size *= 2;
+
+    p = realloc(busy, size);
+    if (!p) {
+        logmsg(LOG_EMERG, "Out of memory in worker pool");
+        daemon_exit(CRISIS);
+    }
+    memset(p + busy_size, 0, size - busy_size);
+    busy = p;
+    busy_size = size;
+}
+
+/*
+ * worker thread main function
+ */
+static void *worker_main(U(void *arg))
+{
+    sched_job *job;
+    int fd;
+    char c = 0;
+
+    for (;;) {
+        job = sched_next();
+
+        if (job->fn) {
+            job->fn(job->arg);
+            continue;
+        }
+
+        fd = job->fd;
+        free(job);
+        svc_getreq_common(fd);
+
+        pthread_mutex_lock(&queue_mutex);
+        busy[fd] = 0;
+        pthread_mutex_unlock(&queue_mutex);
+
+        /* let the main loop poll this fd again */
+        if (worker_done)
+            worker_done(fd);
+        else if (write(wakeup_pipe[1], &c, 1) == -1 && errno != EAGAIN)
+            logmsg(LOG_WARNING, "Unable to wake up main loop");
+    }
+
+    return NULL;
+}
+
+/*
+ * start the worker threads
+ *
+ * done is called by a worker when it is finished with a transport fd.
+ * If it is NULL, the main loop is woken up through worker_wakeup_fd()
+ * instead and has to find out by itself with worker_busy().
+ */
+void worker_init(void (*done) (int fd))
+{
+    pthread_t thread;
+    sigset_t all, old;
+    int i;
+
+    if (opt_threads == 0)
+        return;
+
+    worker_done = done;
+    sched_init();
+
+    if (pipe(wakeup_pipe) == -1) {
+        logmsg(LOG_EMERG, "Unable to create worker wakeup pipe");
+        daemon_exit(CRISIS);
+    }
+    fcntl(wakeup_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wakeup_pipe[1], F_SETFL, O_NONBLOCK);
+
+    /* signals are handled by the main thread only */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    for (i = 0; i < opt_threads; i++) {
+        if (pthread_create(&thread, NULL, worker_main, NULL) != 0) {
+            logmsg(LOG_EMERG, "Unable to start worker thread");
+            daemon_exit(CRISIS);
+        }
+        pthread_detach(thread);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * check whether requests are served by worker threads
+ */
+int worker_active(void)
+{
+    return opt_threads > 0;
+}
+
+/*
+ * fd the main loop has to poll for finished transports
+ */
+int worker_wakeup_fd(void)
+{
+    return wakeup_pipe[0];
+}
+
+/*
+ * consume pending wakeups
+ */
+void worker_wakeup_drain(void)
+{
+    char buf[64];
+
+    while (read(wakeup_pipe[0], buf, sizeof(buf)) > 0);
+}
+
+/*
+ * check whether a transport fd is owned by a worker
+ */
+int worker_busy(int fd)
+{
+    int res;
+
+    if (fd < 0)
+        return FALSE;
+
+    pthread_mutex_lock(&queue_mutex);
+    res = fd < busy_size && busy[fd];
+    pthread_mutex_unlock(&queue_mutex);
+
+    return res;
+}
+
+/*
+ * hand a readable transport fd to the pool
+ */
+void worker_submit(int fd)
+{
+    sched_job *job = NULL;
+
+    pthread_mutex_lock(&queue_mutex);
+    busy_reserve(fd);
+    if (!busy[fd]) {
+        job = calloc(1, sizeof(sched_job));
+        if (!job) {
+            logmsg(LOG_EMERG, "Out of memory in worker pool");
+            daemon_exit(CRISIS);
+        }
+        busy[fd] = 1;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+
+    if (job) {
+        job->fd = fd;
+        sched_queue(job);
+    }
+}
+
+/*
+ * have a worker call job->fn(job->arg), in the turn of job->client
+ */
+void worker_run(struct sched_job *job)
+{
+    sched_queue(job);
+}
+
+/*
+ * acquire the server lock
+ */
+void worker_lock(void)
+{
+    pthread_mutex_lock(&server_mutex);
+    server_epoch++;
+}
+
+/*
+ * release the server lock
+ */
+void worker_unlock(void)
+{
+    pthread_mutex_unlock(&server_mutex);
+}
+
+/*
+ * start serving a request, takes the server lock
+ */
+void worker_enter(struct svc_req *rqstp)
+{
+    worker_lock();
+    while (server_exclusive)
+        pthread_cond_wait(&server_cond, &server_mutex);
+    server_requests++;
+    worker_req = rqstp;
+}
+
+/*
+ * done serving a request, releases the server lock
+ */
+void worker_leave(void)
+{
+    worker_req = NULL;
+    if (--server_requests == 0 && server_exclusive)
+        pthread_cond_broadcast(&server_cond);
+    worker_unlock();
+}
+
+/*
+ * wait until no request is being served, with the server lock held
+ *
+ * requests drop the lock around file I/O, so holding it is not enough
+ * to change what they may still be using, like the export list. New
+ * requests wait until worker_shared() is called.
+ */
+void worker_exclusive(void)
+{
+    server_exclusive = TRUE;
+    while (server_requests > 0)
+        pthread_cond_wait(&server_cond, &server_mutex);
+}
+
+/*
+ * let requests be served again after worker_exclusive()
+ */
+void worker_shared(void)
+{
+    server_exclusive = FALSE;
+    pthread_cond_broadcast(&server_cond);
+}
+
+/*
+ * drop the server lock around blocking file I/O
+ */
+void worker_io_begin(void)
+{
+    worker_epoch = server_epoch;
+    worker_unlock();
+}
+
+/*
+ * reacquire the server lock after file I/O
+ *
+ * unless they are switched per thread, effective ids are process-wide,
+ * so if another request ran in the meantime, switch back to the
+ * credentials of our own request
+ */
+void worker_io_end(void)
+{
+    worker_lock();
+#ifndef UNFS3_FSUID
+    if (worker_req && server_epoch != worker_epoch + 1)
+        switch_user(worker_req);
+#endif
+}
+
+/*
+ * wait for another request to call worker_wake(), the server lock is
+ * dropped in the meantime
+ */
+void worker_wait(void)
+{
+    pthread_cond_wait(&server_cond, &server_mutex);
+    server_epoch++;
+#ifndef UNFS3_FSUID
+    if (worker_req)
+        switch_user(worker_req);
+#endif
+}
+
+/*
+ * wake up all requests in worker_wait()
+ */
+void worker_wake(void)
+{
+    pthread_cond_broadcast(&server_cond);
+}
+
+#else				       /* UNFS3_THREADS */
+
+void worker_init(U(void (*done) (int fd)))
+{
+}
+
+int worker_active(void)
+{
+    return FALSE;
+}
+
+int worker_wakeup_fd(void)
+{
+    return -1;
+}
+
+void worker_wakeup_drain(void)
+{
+}
+
+int worker_busy(U(int fd))
+{
+    return FALSE;
+}
+
+void worker_submit(U(int fd))
+{
+}
+
+void worker_run(struct sched_job *job)
+{
+    job->fn(job->arg);
+}
+
+void worker_lock(void)
+{
+}
+
+void worker_unlock(void)
+{
+}
+
+void worker_enter(U(struct svc_req *rqstp))
+{
+}
+
+void worker_leave(void)
+{
+}
+
+void worker_exclusive(void)
+{
+}
+
+void worker_shared(void)
+{
+}
+
+void worker_io_begin(void)
+{
+}
+
+void worker_io_end(void)
+{
+}
+
+void worker_wait(void)
+{
+}
+
+void worker_wake(void)
+{
+}
+
+#endif				       /* UNFS3_THREADS */
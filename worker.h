@@ -0,0 +1,47 @@
+/*
+ * UNFS3 worker thread pool
+ * see file LICENSE for license details
+ */
+
+#ifndef UNFS3_WORKER_H
+#define UNFS3_WORKER_H
+
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_SVC_GETREQ_POLL) && \
+    HAVE_DECL_SVC_POLLFD && !defined(WIN32)
+#define UNFS3_THREADS 1
+#endif
+
+/* storage class for per-request state */
+#ifdef UNFS3_THREADS
+#define UNFS3_TLS __thread
+#else
+#define UNFS3_TLS
+#endif
+
+/* upper limit for -W */
+#define WORKER_MAX 256
+
+extern int opt_threads;
+
+struct sched_job;
+
+void worker_init(void (*done) (int fd));
+int worker_active(void);
+int worker_wakeup_fd(void);
+void worker_wakeup_drain(void);
+int worker_busy(int fd);
+void worker_submit(int fd);
+void worker_run(struct sched_job *job);
+
+void worker_lock(void);
+void worker_unlock(void);
+void worker_enter(struct svc_req *rqstp);
+void worker_leave(void);
+void worker_exclusive(void);
+void worker_shared(void);
+void worker_io_begin(void);
+void worker_io_end(void);
+void worker_wait(void);
+void worker_wake(void);
+
+#endif
@@ -14,6 +14,7 @@
 #include "mount.h"
 #include "nfs.h"
 #include "xdr.h"
+#include "worker.h"
 
 bool_t xdr_fhandle3(XDR * xdrs, fhandle3 * objp)
 {
@@ -770,8 +771,17 @@ bool_t xdr_stable_how(XDR * xdrs, stable_how * objp)
     return TRUE;
 }
 
+/*
+ * the data of a WRITE is not allocated: it is left in place when the
+ * stream holds the whole request in memory, which is always the case
+ * with the server's own transports, and otherwise decoded into a buffer
+ * of the thread. Either way, it is only valid while the request is.
+ */
 bool_t xdr_WRITE3args(XDR * xdrs, WRITE3args * objp)
 {
+    static UNFS3_TLS char buf[NFS_MAXDATA_TCP];
+    char *data;
+
     if (!xdr_nfs_fh3(xdrs, &objp->file))
         return FALSE;
     if (!xdr_offset3(xdrs, &objp->offset))
@@ -780,6 +790,28 @@ bool_t xdr_WRITE3args(XDR * xdrs, WRITE3args * objp)
         return FALSE;
     if (!xdr_stable_how(xdrs, &objp->stable))
         return FALSE;
+
+    switch (xdrs->x_op) {
+        case XDR_DECODE:
+            if (!xdr_u_int(xdrs, (u_int *) & objp->data.data_len))
+                return FALSE;
+            if (objp->data.data_len > NFS_MAXDATA_TCP)
+                return FALSE;
+            data = (char *) XDR_INLINE(xdrs, RNDUP(objp->data.data_len));
+            if (!data) {
+                data = buf;
+                if (!xdr_opaque(xdrs, data, objp->data.data_len))
+                    return FALSE;
+            }
+            objp->data.data_val = data;
+            return TRUE;
+        case XDR_FREE:
+            objp->data.data_val = NULL;
+            return TRUE;
+        default:
+            break;
+    }
+
     if (!xdr_bytes
         (xdrs, (char **) &objp->data.data_val,
          (u_int *) & objp->data.data_len, ~0))